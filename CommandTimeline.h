@@ -0,0 +1,352 @@
+/**
+ * @file CommandTimeline.h
+ * @brief 速度指令の列（経路）と，それに沿ってシミュレーションを進める実行器
+ * @author Kazumichi INOUE <k.inoue@oyama-ct.ac.jp>
+ *
+ * 経路は (v, w, 継続時間) の区間の並びで表し，ファイルから読み込める．
+ * TimelineExecutor は経路の最後までロボット集合を動かし，登録された観測者
+ * （描画・統計・ログなど）を指定した時刻にだけ呼ぶ．
+ * 観測の間は advance() でまとめて進める．
+ * 統計の観測者（addStatisticsObserver()）を呼ぶステップでは，統計を advance() の中で
+ * 求めさせ，集合を読み直さずに済ませる．
+ * 同じステップでは，統計の観測者を全て呼んでから普通の観測者を呼ぶ（それぞれ登録した順）．
+ * 統計の観測者は集合を変えないこと．
+ */
+
+#ifndef __COMMAND_TIMELINE_H__
+#define __COMMAND_TIMELINE_H__
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "PoseStatistics.h"
+
+/**
+ * @brief 速度指令の1区間
+ */
+struct Command
+{
+    double v;           //!< 並進速度 [m/s]
+    double w;           //!< 角速度 [rad/s]
+    double duration;    //!< 継続時間 [s]
+};
+
+class CommandTimeline
+{
+    private:
+        std::vector<Command> cmd;
+
+    public:
+        /**
+         * @brief 区間を末尾に追加する
+         */
+        void add(double v, double w, double duration);
+
+        /**
+         * @brief ファイルから経路を読み込み，末尾に追加する
+         * @param path 1行に "v w duration" を書いたテキストファイル．# 以降はコメント
+         * @return 読み込めなかった場合，または空行以外で形式の違う行（数でない・数が3つでない）があれば false
+         */
+        bool load(const std::string &path);
+
+        void clear();
+        int size() const;
+        const Command &operator[](int i) const;
+
+        /**
+         * @brief 経路全体の時間 [s]
+         */
+        double getDuration() const;
+
+        std::vector<Command>::const_iterator begin() const;
+        std::vector<Command>::const_iterator end() const;
+};
+
+void CommandTimeline::add(double v, double w, double duration)
+{
+    Command c;
+    c.v = v;
+    c.w = w;
+    c.duration = duration;
+    cmd.push_back(c);
+}
+
+bool CommandTimeline::load(const std::string &path)
+{
+    std::ifstream ifs(path.c_str());
+    if (!ifs) {
+        std::cerr << "経路ファイルを開けません: " << path << "\n";
+        return false;
+    }
+
+    std::string line;
+    int lineNo = 0;
+    while (std::getline(ifs, line)) {
+        lineNo++;
+        std::string::size_type p = line.find('#');
+        if (p != std::string::npos) line.erase(p);
+
+        // 空白だけの行（コメントだけの行を含む）は読み飛ばす
+        if (line.find_first_not_of(" \t\r\n") == std::string::npos) continue;
+
+        std::istringstream iss(line);
+        double v, w, d;
+        bool ok = (iss >> v >> w >> d) && d >= 0.0;
+        if (ok) {
+            iss >> std::ws;
+            ok = iss.eof();                 // 余計なものが続いていないか
+        }
+        if (!ok) {
+            std::cerr << path << ":" << lineNo << ": \"v w duration\" の形式ではありません\n";
+            return false;
+        }
+        add(v, w, d);
+    }
+    return true;
+}
+
+void CommandTimeline::clear()
+{
+    cmd.clear();
+}
+
+int CommandTimeline::size() const
+{
+    return cmd.size();
+}
+
+const Command &CommandTimeline::operator[](int i) const
+{
+    return cmd[i];
+}
+
+double CommandTimeline::getDuration() const
+{
+    double t = 0.0;
+    for (const Command &c: cmd) t += c.duration;
+    return t;
+}
+
+std::vector<Command>::const_iterator CommandTimeline::begin() const
+{
+    return cmd.begin();
+}
+
+std::vector<Command>::const_iterator CommandTimeline::end() const
+{
+    return cmd.end();
+}
+
+/**
+ * @brief 経路に沿ってロボット集合を動かす実行器
+ * @details Engine は advance(v, w, dt, nsteps), advance(v, w, dt, nsteps, stat),
+ *          getStatistics(stat) を持つクラス（RobotBatch など）
+ */
+template <typename Engine>
+class TimelineExecutor
+{
+    public:
+        /**
+         * @brief 観測者．e は現在の集合，t は経路の開始からの時刻 [s]
+         */
+        typedef std::function<void(Engine &e, double t)> Observer;
+
+        /**
+         * @brief 統計の観測者．s はその時刻の姿勢の統計
+         */
+        typedef std::function<void(Engine &e, const PoseStatistics &s, double t)> StatisticsObserver;
+
+        /**
+         * @brief コンストラクタ
+         * @param dt_ シミュレーションの時間刻み [s]
+         */
+        explicit TimelineExecutor(double dt_);
+
+        /**
+         * @brief interval [s] ごとに呼ばれる観測者を登録する
+         * @details 時刻 0（動き始める前）にも呼ばれる
+         */
+        void addObserver(const Observer &f, double interval);
+
+        /**
+         * @brief 指定した時刻 [s] に呼ばれる観測者を登録する
+         */
+        void addObserver(const Observer &f, const std::vector<double> &times);
+
+        /**
+         * @brief interval [s] ごとに呼ばれる統計の観測者を登録する
+         * @details 時刻 0（動き始める前）にも呼ばれる．同じ時刻の普通の観測者より先に呼ばれる．
+         *          統計はその時刻の集合1つから求めるので，ここでは集合を変えないこと
+         */
+        void addStatisticsObserver(const StatisticsObserver &f, double interval);
+
+        /**
+         * @brief 指定した時刻 [s] に呼ばれる統計の観測者を登録する
+         */
+        void addStatisticsObserver(const StatisticsObserver &f, const std::vector<double> &times);
+
+        /**
+         * @brief 経路の最後まで e を動かす
+         */
+        void run(Engine &e, const CommandTimeline &tl);
+
+        /**
+         * @brief 区間の継続時間を何ステップで進めるか
+         * @details for (i = 0; i < duration/dt; i++) と同じ回数になる
+         */
+        long stepsOf(double duration) const;
+
+    private:
+        struct Entry
+        {
+            Observer f;
+            StatisticsObserver g;           //!< 統計の観測者（f が空のとき）
+            double interval;                //!< 0 なら times を使う
+            std::vector<double> times;
+        };
+
+        double dt;
+        std::vector<Entry> observers;
+        PoseStatistics stat;
+
+        void add(const Observer &f, const StatisticsObserver &g, double interval, const std::vector<double> &times);
+
+        // ステップ s の後に統計の観測者を呼ぶか
+        bool wantStatistics(long s, const std::vector<std::vector<long> > &due, const std::vector<size_t> &next) const;
+
+        // ステップ s の後に呼ぶ観測者があれば呼ぶ．haveStat が false なら必要に応じて統計を求める
+        void notify(Engine &e, long s, const std::vector<std::vector<long> > &due, std::vector<size_t> &next, bool haveStat);
+};
+
+template <typename Engine>
+TimelineExecutor<Engine>::TimelineExecutor(double dt_)
+    : dt(dt_)
+{
+}
+
+template <typename Engine>
+void TimelineExecutor<Engine>::addObserver(const Observer &f, double interval)
+{
+    add(f, StatisticsObserver(), interval, std::vector<double>());
+}
+
+template <typename Engine>
+void TimelineExecutor<Engine>::addObserver(const Observer &f, const std::vector<double> &times)
+{
+    add(f, StatisticsObserver(), 0.0, times);
+}
+
+template <typename Engine>
+void TimelineExecutor<Engine>::addStatisticsObserver(const StatisticsObserver &f, double interval)
+{
+    add(Observer(), f, interval, std::vector<double>());
+}
+
+template <typename Engine>
+void TimelineExecutor<Engine>::addStatisticsObserver(const StatisticsObserver &f, const std::vector<double> &times)
+{
+    add(Observer(), f, 0.0, times);
+}
+
+template <typename Engine>
+void TimelineExecutor<Engine>::add(const Observer &f, const StatisticsObserver &g, double interval, const std::vector<double> &times)
+{
+    Entry e;
+    e.f = f;
+    e.g = g;
+    e.interval = interval;
+    e.times = times;
+    observers.push_back(e);
+}
+
+template <typename Engine>
+long TimelineExecutor<Engine>::stepsOf(double duration) const
+{
+    return (long)ceil(duration / dt - 1e-9);
+}
+
+template <typename Engine>
+void TimelineExecutor<Engine>::run(Engine &e, const CommandTimeline &tl)
+{
+    long total = 0;
+    for (const Command &c: tl) total += stepsOf(c.duration);
+
+    // 観測者ごとに，呼ぶステップ番号を昇順に並べておく
+    std::vector<std::vector<long> > due(observers.size());
+    for (size_t k = 0; k < observers.size(); k++) {
+        const Entry &o = observers[k];
+        if (o.interval > 0.0) {
+            long every = std::max(1L, (long)llround(o.interval / dt));
+            for (long s = 0; s <= total; s += every) due[k].push_back(s);
+        } else {
+            for (double t: o.times) {
+                long s = llround(t / dt);
+                if (s >= 0 && s <= total) due[k].push_back(s);
+            }
+            std::sort(due[k].begin(), due[k].end());
+            due[k].erase(std::unique(due[k].begin(), due[k].end()), due[k].end());
+        }
+    }
+    std::vector<size_t> next(observers.size(), 0);
+
+    long s = 0;
+    notify(e, s, due, next, false);
+    for (const Command &c: tl) {
+        long end = s + stepsOf(c.duration);
+        while (s < end) {
+            // 次に観測するステップか区間の終わりまで，まとめて進める
+            long stop = end;
+            for (size_t k = 0; k < due.size(); k++) {
+                if (next[k] < due[k].size() && due[k][next[k]] < stop) stop = due[k][next[k]];
+            }
+            bool haveStat = wantStatistics(stop, due, next);
+            if (haveStat) {
+                e.advance(c.v, c.w, dt, stop - s, stat);
+            } else {
+                e.advance(c.v, c.w, dt, stop - s);
+            }
+            s = stop;
+            notify(e, s, due, next, haveStat);
+        }
+    }
+}
+
+template <typename Engine>
+bool TimelineExecutor<Engine>::wantStatistics(long s, const std::vector<std::vector<long> > &due, const std::vector<size_t> &next) const
+{
+    for (size_t k = 0; k < observers.size(); k++) {
+        if (observers[k].g && next[k] < due[k].size() && due[k][next[k]] == s) return true;
+    }
+    return false;
+}
+
+template <typename Engine>
+void TimelineExecutor<Engine>::notify(Engine &e, long s, const std::vector<std::vector<long> > &due, std::vector<size_t> &next, bool haveStat)
+{
+    if (!haveStat && wantStatistics(s, due, next)) e.getStatistics(stat);
+
+    // 統計の観測者を先に呼ぶ．普通の観測者は集合を変えてよい（再標本化で台数が変わるなど）ので，
+    // 後に呼ばないと，求めた統計と集合が食い違う
+    for (int pass = 0; pass < 2; pass++) {
+        for (size_t k = 0; k < observers.size(); k++) {
+            bool isStat = !observers[k].f;
+            if (isStat != (pass == 0)) continue;
+            if (next[k] < due[k].size() && due[k][next[k]] == s) {
+                if (isStat) {
+                    observers[k].g(e, stat, s * dt);
+                } else {
+                    observers[k].f(e, s * dt);
+                }
+                next[k]++;
+            }
+        }
+    }
+}
+
+#endif
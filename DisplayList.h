@@ -0,0 +1,186 @@
+/**
+ * @file DisplayList.h
+ * @brief 線・円・ロボットの記号を記録しておき，後でまとめて描くための表
+ * @author Kazumichi INOUE <k.inoue@oyama-ct.ac.jp>
+ *
+ * Drawer::line() などはその場で1本ずつはみ出しを判定して描く．DisplayList は
+ * 実座標系のまま図形を記録するだけで，Drawer::render() に渡すと
+ *   1. 全図形の座標変換と外接矩形の計算（配列ごとにまとめて）
+ *   2. 描画領域の外の図形を捨て，線分を領域で切り落とす
+ *   3. 画像を横長の帯に分け，帯ごとに（スレッドプールがあれば並列に）描く
+ * の順に処理する．多数のロボットの記号（robot()）を毎フレーム描くときに使う．
+ * 座標は列ごとの配列（SoA），色と太さは図形ごとに持つ．
+ */
+
+#ifndef __DISPLAY_LIST_H__
+#define __DISPLAY_LIST_H__
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+/**
+ * @brief 図形の種類
+ */
+enum PrimitiveType
+{
+    PRIM_LINE = 0,      //!< 線分 (x1, y1)-(x2, y2)
+    PRIM_CIRCLE         //!< 中心 (x1, y1)，半径 r の円
+};
+
+/**
+ * @brief 図形の描き方
+ */
+struct PrimitiveStyle
+{
+    uint8_t type;       //!< PrimitiveType
+    uint8_t fill;       //!< 円を塗りつぶすか
+    uint8_t color[3];   //!< B, G, R
+    int16_t width;      //!< 線の太さ [pixel]
+};
+
+class DisplayList
+{
+    public:
+        DisplayList();
+
+        /**
+         * @brief 記録を全て消す（確保した配列は使い回す）
+         */
+        void clear();
+
+        /**
+         * @brief n 個の図形を記録できるよう配列を確保しておく
+         */
+        void reserve(int n);
+
+        int size() const;
+
+        void setLineColor(cv::Scalar c);
+        void setLineWidth(int w);
+
+        // 記録する図形（実座標系．引数の意味は Drawer の同名の関数と同じ）
+        void line(double x1, double y1, double x2, double y2);
+        void lineRA(double x1, double y1, double r, double angle);
+        void lineRA2(double x1, double y1, double r, double angle);
+        void circle(double x1, double y1, double radius, bool fill = true);
+
+        /**
+         * @brief 円形のロボット（Drawer::robot() と同じ形）
+         * @details 輪郭と向きの線は太さ2，車輪は太さ10で描く．現在の線の太さは変えない
+         */
+        void robot(double x1, double y1, double r, double angle);
+
+        // Drawer::render() が読む列
+        std::vector<double> x1, y1, x2, y2, r;
+        std::vector<PrimitiveStyle> style;
+
+    private:
+        PrimitiveStyle current;
+
+        void push(PrimitiveType type, double ax, double ay, double bx, double by, double radius, int width, bool fill);
+};
+
+DisplayList::DisplayList()
+{
+    current.type = PRIM_LINE;
+    current.fill = 0;
+    current.color[0] = 200;         // Drawer と同じ初期値
+    current.color[1] = 0;
+    current.color[2] = 0;
+    current.width = 1;
+}
+
+void DisplayList::clear()
+{
+    x1.clear();
+    y1.clear();
+    x2.clear();
+    y2.clear();
+    r.clear();
+    style.clear();
+}
+
+void DisplayList::reserve(int n)
+{
+    x1.reserve(n);
+    y1.reserve(n);
+    x2.reserve(n);
+    y2.reserve(n);
+    r.reserve(n);
+    style.reserve(n);
+}
+
+int DisplayList::size() const
+{
+    return style.size();
+}
+
+void DisplayList::setLineColor(cv::Scalar c)
+{
+    current.color[0] = c[0];
+    current.color[1] = c[1];
+    current.color[2] = c[2];
+}
+
+void DisplayList::setLineWidth(int w)
+{
+    current.width = w;
+}
+
+void DisplayList::push(PrimitiveType type, double ax, double ay, double bx, double by, double radius, int width, bool fill)
+{
+    PrimitiveStyle s = current;
+    s.type = type;
+    s.fill = fill;
+    s.width = width;
+    x1.push_back(ax);
+    y1.push_back(ay);
+    x2.push_back(bx);
+    y2.push_back(by);
+    r.push_back(radius);
+    style.push_back(s);
+}
+
+void DisplayList::line(double x1_, double y1_, double x2_, double y2_)
+{
+    push(PRIM_LINE, x1_, y1_, x2_, y2_, 0.0, current.width, false);
+}
+
+void DisplayList::lineRA(double x1_, double y1_, double r_, double angle)
+{
+    line(x1_, y1_, x1_ + r_ * cos(angle), y1_ + r_ * sin(angle));
+}
+
+void DisplayList::lineRA2(double x1_, double y1_, double r_, double angle)
+{
+    lineRA(x1_, y1_, r_, angle);
+    lineRA(x1_, y1_, r_, angle + M_PI);
+}
+
+void DisplayList::circle(double x1_, double y1_, double radius, bool fill)
+{
+    push(PRIM_CIRCLE, x1_, y1_, x1_, y1_, radius, current.width, fill);
+}
+
+void DisplayList::robot(double x1_, double y1_, double r_, double angle)
+{
+    double c = cos(angle), s = sin(angle);
+    double x = r_ * c;
+    double y = r_ * s;
+
+    push(PRIM_CIRCLE, x1_, y1_, x1_, y1_, r_, 2, false);
+    push(PRIM_LINE, x1_, y1_, x1_ + x, y1_ + y, 0.0, 2, false);
+
+    // 左右の車輪（中心から ±90° の位置に，向きに沿って長さ 0.2 の線を両側へ）
+    double xr = x1_ + y, yr = y1_ - x;
+    double xl = x1_ - y, yl = y1_ + x;
+    double dx = 0.2 * c, dy = 0.2 * s;
+    push(PRIM_LINE, xr, yr, xr + dx, yr + dy, 0.0, 10, false);
+    push(PRIM_LINE, xr, yr, xr - dx, yr - dy, 0.0, 10, false);
+    push(PRIM_LINE, xl, yl, xl + dx, yl + dy, 0.0, 10, false);
+    push(PRIM_LINE, xl, yl, xl - dx, yl - dy, 0.0, 10, false);
+}
+
+#endif
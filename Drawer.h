@@ -2,13 +2,144 @@
  * @file Drawer.h
  * @brief 実座標系での画像描画クラス
  * @author Kazumichi INOUE <k.inoue@oyama-ct.ac.jp>
+ *
+ * 環境変数 DRAWER_OUTPUT に出力先を指定するとウィンドウを開かずに動く（ヘッドレス）．
+ * このとき show() は画面に出す代わりにフレームを FrameWriter に渡し（連番PNG か .avi 動画），
+ * 待ち時間も入れない．imgWrite() の出力先は DRAWER_RESULT で変えられる．
+ * 描画を別のスレッドで行うときは，そのスレッドで publish() を呼び，ウィンドウへの表示は
+ * メインスレッドの present() で行う（HighGUI の関数はウィンドウを作ったスレッドからしか呼べない）．
+ *
+ * 描画先は層（レイヤ）に分けられる．一番下の層（名前は ""）は不透明で，これまでの img と同じ．
+ * setLayer() で名前を付けた層を作ると，以後の描画はその層に入り，show() と imgWrite() の前に
+ * 下から順に重ねる．重ね直すのは前回から描いた・消した所（dirty rect）だけで，
+ * 背景（一番下の層）を描き直したり画像全体をコピーしたりはしない．
  */
 
 #ifndef __DRAWER_H__
 #define __DRAWER_H__
 
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
 #include <opencv2/opencv.hpp>
 
+#include "DisplayList.h"
+#include "FrameWriter.h"
+#include "Probe.h"
+#include "SimdMath.h"
+#include "Sprite.h"
+#include "ThreadPool.h"
+
+/**
+ * @brief drawPoints() の座標変換カーネルに渡す引数
+ */
+struct PointArgs
+{
+    const double *x, *y;        //!< 実座標系の点 [m]
+    int n;                      //!< 点の数
+    double csize;               //!< 解像度 [m/pixel]
+    double ox, oy;              //!< 画像原点 [pixel]
+    double width, hight;        //!< 画像の大きさ [pixel]
+    int32_t *ix, *iy;           //!< [出力] 画素の列と行．範囲外は ix = -1
+};
+
+typedef void (*PointKernel)(const PointArgs &a);
+
+namespace simd
+{
+    // drawing() と同じく 0 方向への切り捨てで画素を決める．範囲内の条件は -1 < fx < width
+    // （範囲外の値を整数に変換しないよう，先に判定して 0 に置き換える）．
+    // 画素の位置（行 * 1行のバイト数）は 2GiB を超える画像では 32bit に収まらないので，列と行のまま返す
+    template <typename V>
+    inline void pointBlock(const PointArgs &a, const double *x, const double *y, int32_t *px, int32_t *py)
+    {
+        typedef typename Traits<V>::M M;
+        typedef typename Traits<V>::I I;
+
+        V fx = load<V>(x) / a.csize + a.ox;
+        V fy =-load<V>(y) / a.csize + a.oy;
+        M in = (fx > -1.0) & (fx < a.width) & (fy > -1.0) & (fy < a.hight);
+        I ix = __builtin_convertvector(in ? fx : V{}, I);
+        I iy = __builtin_convertvector(in ? fy : V{}, I);
+        ix = __builtin_convertvector(in, I) ? ix : -1;
+        memcpy(px, &ix, sizeof(I));
+        memcpy(py, &iy, sizeof(I));
+    }
+
+    template <typename V>
+    inline void pointKernel(const PointArgs &a)
+    {
+        const int W = Traits<V>::W;
+        int i = 0;
+        for (; i + W <= a.n; i += W) {
+            pointBlock<V>(a, a.x + i, a.y + i, a.ix + i, a.iy + i);
+        }
+
+        int rest = a.n - i;
+        if (rest > 0) {
+            double buf[2][W];
+            int32_t px[W], py[W];
+            memset(buf, 0, sizeof(buf));
+            memcpy(buf[0], a.x + i, rest * sizeof(double));
+            memcpy(buf[1], a.y + i, rest * sizeof(double));
+            pointBlock<V>(a, buf[0], buf[1], px, py);
+            memcpy(a.ix + i, px, rest * sizeof(int32_t));
+            memcpy(a.iy + i, py, rest * sizeof(int32_t));
+        }
+    }
+
+    // スカラー版は1要素のベクトル型を使うより素直なループの方が速い
+    inline void pointKernelScalar(const PointArgs &a)
+    {
+        for (int i = 0; i < a.n; i++) {
+            double fx = a.x[i] / a.csize + a.ox;
+            double fy =-a.y[i] / a.csize + a.oy;
+            bool in = (fx > -1.0) & (fx < a.width) & (fy > -1.0) & (fy < a.hight);
+            a.ix[i] = in ? (int)fx : -1;
+            a.iy[i] = in ? (int)fy : 0;
+        }
+    }
+
+#ifdef SIMD_X86
+    SIMD_TARGET("sse2")
+    inline void pointKernelSSE2(const PointArgs &a) { pointKernel<v2d>(a); }
+
+    SIMD_TARGET("avx2")
+    inline void pointKernelAVX2(const PointArgs &a) { pointKernel<v4d>(a); }
+#endif
+}
+
+/**
+ * @brief 命令セットに対応する座標変換カーネルを返す
+ * @details AVX-512F だけでは比較結果を整数ベクトルにする命令がなく要素ごとの処理になるので，
+ *          AVX-512 でも AVX2 版を使う
+ */
+inline PointKernel getPointKernel(SimdIsa isa)
+{
+#ifdef SIMD_X86
+    switch (isa) {
+        case ISA_SSE2:   return simd::pointKernelSSE2;
+        case ISA_AVX2:
+        case ISA_AVX512: return simd::pointKernelAVX2;
+        default:         break;
+    }
+#endif
+    return simd::pointKernelScalar;
+}
+
+/**
+ * @brief 密度表示の濃淡の付け方
+ */
+enum DensityTone
+{
+    DENSITY_LINEAR = 0,     //!< 点の数に比例
+    DENSITY_LOG             //!< log(1 + 点の数) に比例．点の少ない所も見える
+};
+
 class Drawer
 {
     private:
@@ -25,8 +156,72 @@ class Drawer
 
         int line_width;             //!< 描画する線の太さ
 
-        cv::Mat img;        //!< キャンバス
-        cv::Mat img_init;   //!< 初期化用のキャンバスのコピー
+        /**
+         * @brief 描画先の層
+         * @details pix は色，alpha は覆っている割合（一番下の層にはない）．pix は alpha を掛けた色
+         *          （premultiplied）になっている．何もない所は pix = alpha = 0
+         */
+        struct Layer
+        {
+            std::string name;
+            cv::Mat pix;
+            cv::Mat alpha;
+            cv::Rect dirty;         //!< 前回重ねてから変わった所
+            cv::Rect extent;        //!< 前回消してから描いた所
+            bool visible;
+        };
+
+        cv::Mat img;        //!< 表示・書き出しする画像．層が1つだけのときは layers[0].pix と同じもの
+        cv::Mat img_init;   //!< 初期化用のキャンバスのコピー（一番下の層）
+        std::vector<Layer> layers;  //!< layers[0] が一番下の層
+        int current;                //!< 描画先の層
+
+        PointKernel pointKernel;    //!< drawPoints() の座標変換カーネル
+        BlendKernel blendKernel;    //!< overText() の合成カーネル
+
+        std::vector<std::vector<uint32_t> > density;    //!< 密度表示用の画素ごとの点の数（スレッドごと）
+        std::vector<uint32_t> densityTotal;             //!< density の合計
+
+        std::shared_ptr<FrameWriter> writer;    //!< ヘッドレスのときのフレームの書き出し先
+
+        std::mutex frontMutex;      //!< front と frontFresh を守る
+        cv::Mat front;              //!< publish() した画像（present() で表示する）
+        bool frontFresh;            //!< front をまだ表示していないか
+        std::shared_ptr<ThreadPool> pool;       //!< render() で帯を分担するスレッド
+
+        /**
+         * @brief render() で描く図形（ピクセル座標系，領域で切り落とした後）
+         */
+        struct RasterItem
+        {
+            cv::Point p1, p2;       //!< 線分の端点．円なら p1 が中心
+            int radius;
+            int index;              //!< DisplayList での番号（描き方を引く）
+            int y0, y1;             //!< 描く行の範囲
+        };
+        std::vector<double> rx1, ry1, rx2, ry2, rr;     //!< render() の作業用（使い回す）
+        std::vector<RasterItem> items;
+        std::vector<std::vector<int> > bands;
+        std::string resultPath;                 //!< imgWrite() の出力先
+
+        // 座標変換カーネルの引数．step, pixel は書き込み先の1行・1画素の要素数
+        PointArgs pointArgs() const;
+
+        // 一番下の層を作り直して座標軸を描く（他の層は捨てる）
+        void initCanvas();
+
+        // 描画先の層の r を変わった所として記録する
+        void touch(cv::Rect r);
+
+        // f(画像, 色) で描画先の層に描く．bound は描く範囲を含む矩形．
+        // 一番下でない層には，同じ形を alpha にも描く
+        template <typename F> void paint(cv::Rect bound, const cv::Scalar &color, F f);
+
+        int findLayer(const std::string &name) const;
+
+        // 変わった所だけ層を重ね直して img を作る
+        void compose();
+        void composeRect(cv::Rect r);
 
     public:
         /**
@@ -51,32 +246,146 @@ class Drawer
          */
         template <typename T> void drawing(T &a);   
 
+        /**
+         * @brief x[i], y[i] (i = 0〜n-1) の位置にまとめて点を打つ
+         * @param x, y [m] 実座標系の点の配列
+         * @param n 点の数
+         * @details drawing() を n 回呼ぶのと同じ結果になる．座標変換と範囲判定は
+         *          SIMD カーネルでブロックごとに分岐なしで行い，画素は画像の先頭ポインタと
+         *          行の幅から直接書き込む
+         */
+        void drawPoints(const double *x, const double *y, int n);
+
+        /**
+         * @brief 集合の全ロボットの位置に点を打つ
+         * @details getXData(), getYData(), size() を持つクラス（RobotBatch など）
+         */
+        template <typename T> void drawPoints(const T &batch);
+
+        /**
+         * @brief 密度表示のために画素ごとの点の数を数えるバッファの数を指定する
+         * @param n 同時に accumulate() を呼ぶスレッドの数
+         * @details それまでに数えた点は捨てる
+         */
+        void setDensityWorkers(int n);
+
+        /**
+         * @brief x[i], y[i] (i = 0〜n-1) の点を画素ごとに数える
+         * @param worker 数えるバッファの番号（0〜setDensityWorkers()-1）
+         * @details 画素の決め方は drawPoints() と同じ．worker が異なれば複数のスレッドから
+         *          同時に呼んでもよい（バッファを共有しないので排他制御はいらない）
+         */
+        void accumulate(const double *x, const double *y, int n, int worker = 0);
+
+        /**
+         * @brief 集合の全ロボットの位置を画素ごとに数える
+         * @details getXData(), getYData(), size() を持つクラス（RobotBatch など）
+         */
+        template <typename T> void accumulate(const T &batch);
+
+        /**
+         * @brief 数えた点を全て捨てる
+         */
+        void clearDensity();
+
+        /**
+         * @brief 数えた点の密度を img に描く
+         * @param tone 点の数から濃さへの変換
+         * @param colormap OpenCV のカラーマップ（cv::COLORMAP_JET など）．
+         *                 負の値なら点の色（setPointColor()）を濃さに応じて背景に重ねる
+         * @details 全バッファを合計してから描く．点のない画素は変えない
+         */
+        void drawDensity(DensityTone tone = DENSITY_LOG, int colormap = -1);
+
         /**
          * @fn void show(int)
          * @brief imgを表示し，指定時間だけ待つ
          * @param wait 表示後の待機時間[ms]
-         * @details 
+         * @details ヘッドレスのときは img を1フレームとして書き出し待ちに入れ，すぐに戻る
          */
         void show(int wait = 5);                    
 
+        /**
+         * @brief 描画スレッドで描き終えた画像を渡す
+         * @details 層を重ね，ヘッドレスなら1フレームとして書き出し待ちに入れる．そうでなければ
+         *          表示用のバッファにコピーし，表示はメインスレッドの present() に任せる
+         */
+        void publish();
+
+        /**
+         * @brief publish() された最新の画像を表示し，指定時間だけ待つ（メインスレッドで呼ぶ）
+         * @param wait 表示後の待機時間[ms]
+         * @return 新しい画像を表示したら true．ヘッドレスのときは何もせずに false
+         */
+        bool present(int wait = 1);
+
+        /**
+         * @brief キー入力を待つ（cv::waitKey と同じ）
+         * @details ヘッドレスのときは待たずに -1 を返す
+         */
+        int waitKey(int wait = 0);
+
+        /**
+         * @brief ヘッドレスにして，show() のフレームを path に書き出す
+         * @param path FrameWriter の出力先（連番PNG の書式・ディレクトリ・.avi）．空ならウィンドウ表示に戻す．
+         *             書式が正しくないときもヘッドレスのままにし，フレームは書き出さずに捨てる
+         * @param fps 動画のフレームレート
+         */
+        void setOutput(const std::string &path, double fps = 10.0);
+
+        /**
+         * @brief ヘッドレスか
+         */
+        bool isHeadless() const;
+
         /**
          * @brief img をファイルに書き出す
-         * @details ファイル名は`result.png`になる
+         * @details ファイル名は`result.png`になる（setResultPath() で変更できる）
          */
         void imgWrite();                            
 
+        /**
+         * @brief imgWrite() の出力先を指定する
+         */
+        void setResultPath(const std::string &path);
+
+        /**
+         * @brief 層を重ねた画像を返す（show() や imgWrite() と同じもの）
+         * @details 次に描画するまで有効
+         */
+        const cv::Mat &getImage();
+
         /**
          * @brief img を最初の状態に戻す
-         * @details img_initをimgにクローンする．imgHold()と組み合わせて使うと良い
+         * @details 一番下の層は，imgHold() の後で描いた所だけを img_init から戻す．
+         *          他の層は描いたものを消す．imgHold()と組み合わせて使うと良い
          */
         void clear();                              
 
         /**
          * @brief 現在のimgを初期化用に登録する
-         * @details img_initに現在のimgを保存する
+         * @details img_initに現在の一番下の層を保存する（バッファは使い回す）
          */
         void imgHold();                             
 
+        /**
+         * @brief 以後の描画先の層を指定する
+         * @param name 層の名前．なければ一番上に新しく作る．"" なら一番下の層
+         * @details 層は描画領域の設定（setCsize() など）を変えると捨てられる
+         */
+        void setLayer(const std::string &name);
+
+        /**
+         * @brief 層に描いたものを消す
+         * @details 消すのは前回消してから描いた範囲だけ．一番下の層なら clear() と同じ
+         */
+        void clearLayer(const std::string &name);
+
+        /**
+         * @brief 層を表示するか
+         */
+        void setLayerVisible(const std::string &name, bool visible);
+
         // 描画するための補助機能
         /**
          * @brief 解像度を設定する
@@ -167,8 +476,31 @@ class Drawer
 
         void robot(double x1, double y1, double r, double angle);       // 円形のロボット 
 
+        /**
+         * @brief 記録した図形をまとめて描く
+         * @details 座標変換・領域外の図形の除外・線分の切り落としを全図形について先に行い，
+         *          画像を横長の帯に分けて描く．setThreadPool() でプールを渡しておくと帯を並列に描く
+         */
+        void render(const DisplayList &dl);
+
+        /**
+         * @brief render() で使うスレッドプールを指定する（nullptr なら1スレッド）
+         * @details ThreadPool は2つのスレッドから同時に使えないので，シミュレーションと別の
+         *          スレッドで描くときは，シミュレーションと別のプールを渡すこと
+         */
+        void setThreadPool(std::shared_ptr<ThreadPool> p);
+
         void text(double x, double y, std::string text);                // 指定位置にテキストを描画
-        void includeImage(double x, double y, std::string path);        // 指定位置に画像を描画
+        /**
+         * @brief 指定位置に画像をそのまま貼る（透明度は使わない）
+         * @details 画像は SpriteCache で一度だけ読み込む．描画領域からはみ出さないよう位置をずらす
+         */
+        void includeImage(double x, double y, std::string path);
+
+        /**
+         * @brief 指定位置に透明度付きの画像（PNG など）を重ねる
+         * @details 画像は SpriteCache で一度だけ読み込み，alpha を掛けた色で合成する．はみ出す所は描かない
+         */
 		void overText(double x, double y, std::string path);
 };
 
@@ -181,8 +513,6 @@ Drawer::Drawer()
     IMG_ORIGIN_Y = IMG_HIGHT * (1.0 - 1.0/ 6);  // 画像原点は下の1/6
     csize = 0.005;                      // 画像解像度[m/pixel]
 
-    img = cv::Mat(cv::Size(IMG_WIDTH, IMG_HIGHT), CV_8UC3, cv::Scalar(182, 182, 182));
-
     // 描画する色のデフォルト値
     point_color = cv::Scalar(0, 0, 0);
     line_color = cv::Scalar(200, 0, 0);
@@ -194,17 +524,23 @@ Drawer::Drawer()
     XaxisColor = cv::Scalar(0, 0, 0);
     YaxisColor = cv::Scalar(0, 0, 0);
 
-    cv::line(img, cv::Point(0, IMG_ORIGIN_Y), cv::Point(IMG_WIDTH, IMG_ORIGIN_Y), XaxisColor, 1, cv::LINE_AA, 0);
-    cv::line(img, cv::Point(IMG_ORIGIN_X, 0), cv::Point(IMG_ORIGIN_X, IMG_HIGHT), YaxisColor, 1, cv::LINE_AA, 0);
+    initCanvas();
 
-    // clear 用にコピーを残す
-    img_init = img.clone();
+    SimdIsa isa = detectSimdIsa();
+    pointKernel = getPointKernel(isa);
+    blendKernel = getBlendKernel(isa);
+
+    // 出力先（ヘッドレス）
+    frontFresh = false;
+    resultPath = "result.png";
+    const char *env = getenv("DRAWER_RESULT");
+    if (env != nullptr && *env != '\0') resultPath = env;
+    env = getenv("DRAWER_OUTPUT");
+    if (env != nullptr && *env != '\0') setOutput(env);
 }
 
 void Drawer::reset()
 {
-    img = cv::Mat(cv::Size(IMG_WIDTH, IMG_HIGHT), CV_8UC3, cv::Scalar(182, 182, 182));
-
     // 描画する色のデフォルト値
     point_color = cv::Scalar(0, 0, 0);
     line_color = cv::Scalar(200, 0, 0);
@@ -216,6 +552,25 @@ void Drawer::reset()
     XaxisColor = cv::Scalar(0, 0, 0);
     YaxisColor = cv::Scalar(0, 0, 0);
 
+    initCanvas();
+
+    // 画像の大きさが変わるので，密度表示のバッファも作り直す
+    if (!density.empty()) setDensityWorkers(density.size());
+}
+
+void Drawer::initCanvas()
+{
+    layers.resize(1);
+    current = 0;
+
+    Layer &base = layers[0];
+    base.name = "";
+    base.pix = cv::Mat(cv::Size(IMG_WIDTH, IMG_HIGHT), CV_8UC3, cv::Scalar(182, 182, 182));
+    base.alpha = cv::Mat();
+    base.dirty = base.extent = cv::Rect();
+    base.visible = true;
+    img = base.pix;
+
     cv::line(img, cv::Point(0, IMG_ORIGIN_Y), cv::Point(IMG_WIDTH, IMG_ORIGIN_Y), XaxisColor, 1, cv::LINE_AA, 0);
     cv::line(img, cv::Point(IMG_ORIGIN_X, 0), cv::Point(IMG_ORIGIN_X, IMG_HIGHT), YaxisColor, 1, cv::LINE_AA, 0);
 
@@ -223,6 +578,24 @@ void Drawer::reset()
     img_init = img.clone();
 }
 
+void Drawer::touch(cv::Rect r)
+{
+    r &= cv::Rect(0, 0, IMG_WIDTH, IMG_HIGHT);
+    if (r.empty()) return;
+    Layer &L = layers[current];
+    L.dirty |= r;
+    L.extent |= r;
+}
+
+template <typename F>
+void Drawer::paint(cv::Rect bound, const cv::Scalar &color, F f)
+{
+    Layer &L = layers[current];
+    f(L.pix, color);
+    if (current > 0) f(L.alpha, cv::Scalar(255));
+    touch(bound);
+}
+
 template <typename T>
 void Drawer::drawing(T &a)
 {
@@ -234,11 +607,167 @@ void Drawer::drawing(T &a)
         cl[0] = point_color[0];
         cl[1] = point_color[1];
         cl[2] = point_color[2];
-        img.at<cv::Vec3b>(iy, ix) = cl;
+        layers[current].pix.at<cv::Vec3b>(iy, ix) = cl;
+        if (current > 0) layers[current].alpha.at<unsigned char>(iy, ix) = 255;
+        touch(cv::Rect(ix, iy, 1, 1));
+    }
+}
+
+PointArgs Drawer::pointArgs() const
+{
+    PointArgs a;
+    a.csize = csize;
+    a.ox = IMG_ORIGIN_X;
+    a.oy = IMG_ORIGIN_Y;
+    a.width = IMG_WIDTH;
+    a.hight = IMG_HIGHT;
+    return a;
+}
+
+void Drawer::drawPoints(const double *x, const double *y, int n)
+{
+    PROBE_SCOPE("draw_points");
+    const int BLOCK = 256;
+    int32_t ix[BLOCK], iy[BLOCK];
+
+    Layer &L = layers[current];
+    PointArgs a = pointArgs();
+    a.ix = ix;
+    a.iy = iy;
+
+    unsigned char *base = L.pix.ptr<unsigned char>(0);
+    unsigned char *alpha = (current > 0) ? L.alpha.ptr<unsigned char>(0) : nullptr;
+    size_t step = L.pix.step;
+    unsigned char c0 = point_color[0];
+    unsigned char c1 = point_color[1];
+    unsigned char c2 = point_color[2];
+    int lo = INT32_MAX, hi = -1;        // 書いた行の範囲
+
+    for (int i0 = 0; i0 < n; i0 += BLOCK) {
+        a.x = x + i0;
+        a.y = y + i0;
+        a.n = (n - i0 < BLOCK) ? n - i0 : BLOCK;
+        pointKernel(a);
+
+        for (int k = 0; k < a.n; k++) {
+            if (ix[k] < 0) continue;
+            unsigned char *p = base + iy[k] * step + ix[k] * 3;
+            p[0] = c0;
+            p[1] = c1;
+            p[2] = c2;
+            if (alpha) alpha[(size_t)iy[k] * IMG_WIDTH + ix[k]] = 255;     // 層の画像は連続している
+            lo = std::min(lo, (int)iy[k]);
+            hi = std::max(hi, (int)iy[k]);
+        }
+    }
+    if (hi >= 0) touch(cv::Rect(0, lo, IMG_WIDTH, hi - lo + 1));
+}
+
+template <typename T>
+void Drawer::drawPoints(const T &batch)
+{
+    drawPoints(batch.getXData(), batch.getYData(), batch.size());
+}
+
+void Drawer::setDensityWorkers(int n)
+{
+    density.resize(n < 1 ? 1 : n);
+    for (std::vector<uint32_t> &d: density) d.assign((size_t)IMG_WIDTH * IMG_HIGHT, 0);
+}
+
+void Drawer::accumulate(const double *x, const double *y, int n, int worker)
+{
+    if (density.empty()) setDensityWorkers(1);
+
+    const int BLOCK = 256;
+    int32_t ix[BLOCK], iy[BLOCK];
+
+    PointArgs a = pointArgs();
+    a.ix = ix;
+    a.iy = iy;
+    uint32_t *bin = density[worker].data();
+
+    for (int i0 = 0; i0 < n; i0 += BLOCK) {
+        a.x = x + i0;
+        a.y = y + i0;
+        a.n = (n - i0 < BLOCK) ? n - i0 : BLOCK;
+        pointKernel(a);
+
+        for (int k = 0; k < a.n; k++) {
+            if (ix[k] >= 0) bin[(size_t)iy[k] * IMG_WIDTH + ix[k]]++;
+        }
+    }
+}
+
+template <typename T>
+void Drawer::accumulate(const T &batch)
+{
+    accumulate(batch.getXData(), batch.getYData(), batch.size());
+}
+
+void Drawer::clearDensity()
+{
+    for (std::vector<uint32_t> &d: density) std::fill(d.begin(), d.end(), 0);
+}
+
+void Drawer::drawDensity(DensityTone tone, int colormap)
+{
+    if (density.empty()) return;
+    PROBE_SCOPE("density");
+
+    // スレッドごとのバッファを合計する
+    size_t np = (size_t)IMG_WIDTH * IMG_HIGHT;
+    densityTotal.assign(density[0].begin(), density[0].end());
+    for (size_t w = 1; w < density.size(); w++) {
+        const uint32_t *d = density[w].data();
+        for (size_t i = 0; i < np; i++) densityTotal[i] += d[i];
+    }
+    uint32_t maxCount = 0;
+    for (size_t i = 0; i < np; i++) maxCount = std::max(maxCount, densityTotal[i]);
+    if (maxCount == 0) return;
+
+    // 濃さ 1〜255 ごとの色．カラーマップは 0〜255 の階調画像を変換して作る
+    cv::Mat lut;
+    if (colormap >= 0) {
+        cv::Mat ramp(1, 256, CV_8UC1);
+        for (int k = 0; k < 256; k++) ramp.ptr<unsigned char>(0)[k] = k;
+        cv::applyColorMap(ramp, lut, colormap);
+    }
+
+    // 点の数から濃さ 1〜255 への変換．少ない数は表にしておく
+    double scale = (tone == DENSITY_LOG) ? 255.0 / log1p((double)maxCount) : 255.0 / maxCount;
+    auto levelOf = [&](uint32_t c) {
+        double t = (tone == DENSITY_LOG) ? log1p((double)c) * scale : c * scale;
+        return std::max(1, std::min(255, (int)(t + 0.5)));
+    };
+    const uint32_t TABLE = 4096;
+    unsigned char table[TABLE];
+    for (uint32_t c = 1; c < TABLE && c <= maxCount; c++) table[c] = levelOf(c);
+
+    Layer &L = layers[current];
+    for (int iy = 0; iy < IMG_HIGHT; iy++) {
+        const uint32_t *c = densityTotal.data() + (size_t)iy * IMG_WIDTH;
+        unsigned char *p = L.pix.ptr<unsigned char>(iy);
+        unsigned char *al = (current > 0) ? L.alpha.ptr<unsigned char>(iy) : nullptr;
+        for (int ix = 0; ix < IMG_WIDTH; ix++, p += 3) {
+            if (c[ix] == 0) continue;
+            int level = (c[ix] < TABLE) ? table[c[ix]] : levelOf(c[ix]);
+            if (colormap >= 0) {
+                const unsigned char *q = lut.ptr<unsigned char>(0) + level * 3;
+                p[0] = q[0];
+                p[1] = q[1];
+                p[2] = q[2];
+            } else {
+                for (int ch = 0; ch < 3; ch++) {
+                    p[ch] = (p[ch] * (255 - level) + (int)point_color[ch] * level + 127) / 255;
+                }
+            }
+            if (al) al[ix] = (colormap >= 0) ? 255 : (al[ix] * (255 - level) + 255 * level + 127) / 255;
+        }
     }
+    touch(cv::Rect(0, 0, IMG_WIDTH, IMG_HIGHT));
 }
 
-// 解像度を設定する
 void Drawer::setCsize(double val)
 {
     csize = val;
@@ -294,30 +823,206 @@ void Drawer::setLineWidth(int w)
 // 描画する
 void Drawer::show(int wait)
 {
-    cv::imshow("IRLab.", img);
+    compose();
+    if (writer) {
+        PROBE_SCOPE("frame_queue");
+        writer->write(img);
+        return;
+    }
+    {
+        PROBE_SCOPE("imshow");
+        cv::imshow("IRLab.", img);
+    }
+    PROBE_SCOPE("waitKey");
     cv::waitKey(wait);
 }
 
+void Drawer::publish()
+{
+    compose();
+    if (writer) {
+        PROBE_SCOPE("frame_queue");
+        writer->write(img);
+        return;
+    }
+    std::lock_guard<std::mutex> lock(frontMutex);
+    img.copyTo(front);                  // 大きさが同じなら確保し直さない
+    frontFresh = true;
+}
+
+bool Drawer::present(int wait)
+{
+    if (writer) return false;
+    bool shown = false;
+    {
+        std::lock_guard<std::mutex> lock(frontMutex);
+        if (frontFresh) {
+            PROBE_SCOPE("imshow");
+            cv::imshow("IRLab.", front);
+            frontFresh = false;
+            shown = true;
+        }
+    }
+    PROBE_SCOPE("waitKey");
+    cv::waitKey(wait);
+    return shown;
+}
+
+int Drawer::waitKey(int wait)
+{
+    if (writer) return -1;
+    PROBE_SCOPE("waitKey");
+    return cv::waitKey(wait);
+}
+
+void Drawer::setOutput(const std::string &path, double fps)
+{
+    if (path.empty()) {
+        writer.reset();
+    } else {
+        writer = std::make_shared<FrameWriter>(path, fps);
+    }
+}
+
+bool Drawer::isHeadless() const
+{
+    return (bool)writer;
+}
+
 // ファイルに保存する
 void Drawer::imgWrite()
 {
-    cv::imwrite("result.png", img);
+    compose();
+    PROBE_SCOPE("imwrite");
+    cv::imwrite(resultPath, img);
+}
+
+void Drawer::setResultPath(const std::string &path)
+{
+    resultPath = path;
+}
+
+const cv::Mat &Drawer::getImage()
+{
+    compose();
+    return img;
 }
 
 void Drawer::clear()
 {
-    img = img_init.clone();
+    Layer &base = layers[0];
+    if (!base.extent.empty()) {
+        cv::Mat dst = base.pix(base.extent);
+        img_init(base.extent).copyTo(dst);
+        base.dirty |= base.extent;
+        base.extent = cv::Rect();
+    }
+    for (size_t k = 1; k < layers.size(); k++) clearLayer(layers[k].name);
 }
 
 void Drawer::imgHold()
 {
-    img_init = img.clone();
+    layers[0].pix.copyTo(img_init);
+    layers[0].extent = cv::Rect();
+}
+
+int Drawer::findLayer(const std::string &name) const
+{
+    for (size_t k = 0; k < layers.size(); k++) {
+        if (layers[k].name == name) return k;
+    }
+    return -1;
+}
+
+void Drawer::setLayer(const std::string &name)
+{
+    int k = findLayer(name);
+    if (k < 0) {
+        // 層が2つ以上になったら，重ねた結果を入れる画像を別に持つ
+        if (layers.size() == 1) img = layers[0].pix.clone();
+
+        Layer L;
+        L.name = name;
+        L.pix = cv::Mat(cv::Size(IMG_WIDTH, IMG_HIGHT), CV_8UC3, cv::Scalar(0, 0, 0));
+        L.alpha = cv::Mat(cv::Size(IMG_WIDTH, IMG_HIGHT), CV_8UC1, cv::Scalar(0));
+        L.visible = true;
+        layers.push_back(L);
+        k = layers.size() - 1;
+    }
+    current = k;
+}
+
+void Drawer::clearLayer(const std::string &name)
+{
+    int k = findLayer(name);
+    if (k < 0) return;
+    if (k == 0) {
+        clear();
+        return;
+    }
+    Layer &L = layers[k];
+    if (L.extent.empty()) return;
+    L.pix(L.extent).setTo(cv::Scalar(0, 0, 0));
+    L.alpha(L.extent).setTo(cv::Scalar(0));
+    L.dirty |= L.extent;
+    L.extent = cv::Rect();
+}
+
+void Drawer::setLayerVisible(const std::string &name, bool visible)
+{
+    int k = findLayer(name);
+    if (k <= 0 || layers[k].visible == visible) return;
+    layers[k].visible = visible;
+    layers[k].dirty |= layers[k].extent;
+}
+
+void Drawer::compose()
+{
+    PROBE_SCOPE("compose");
+    if (layers.size() == 1) {
+        layers[0].dirty = cv::Rect();       // img は一番下の層そのもの
+        return;
+    }
+    for (Layer &L: layers) {
+        if (!L.dirty.empty()) composeRect(L.dirty);
+        L.dirty = cv::Rect();
+    }
+}
+
+void Drawer::composeRect(cv::Rect r)
+{
+    cv::Mat dst = img(r);
+    layers[0].pix(r).copyTo(dst);
+
+    // 上の層を順に重ねる: out = pix + out (255 - alpha) / 255（pix は alpha を掛けてある）
+    for (size_t k = 1; k < layers.size(); k++) {
+        const Layer &L = layers[k];
+        cv::Rect s = r & L.extent;
+        if (!L.visible || s.empty()) continue;
+        for (int iy = s.y; iy < s.y + s.height; iy++) {
+            const unsigned char *src = L.pix.ptr<unsigned char>(iy) + s.x * 3;
+            const unsigned char *a = L.alpha.ptr<unsigned char>(iy) + s.x;
+            unsigned char *out = img.ptr<unsigned char>(iy) + s.x * 3;
+            for (int ix = 0; ix < s.width; ix++) {
+                int t = 255 - a[ix];
+                for (int ch = 0; ch < 3; ch++) {
+                    int v = src[3 * ix + ch] + (out[3 * ix + ch] * t + 127) / 255;
+                    out[3 * ix + ch] = (v > 255) ? 255 : v;
+                }
+            }
+        }
+    }
 }
 
 // 2点を結ぶ直線
 void Drawer::line(cv::Point p1, cv::Point p2)
 {
-    cv::line(img, p1, p2, line_color, line_width, cv::LINE_AA, 0);
+    int m = line_width + 1;     // 線の太さと AA のにじみの分
+    cv::Rect bound(std::min(p1.x, p2.x) - m, std::min(p1.y, p2.y) - m,
+                   std::abs(p1.x - p2.x) + 2 * m + 1, std::abs(p1.y - p2.y) + 2 * m + 1);
+    paint(bound, line_color, [&](cv::Mat &dst, const cv::Scalar &c) {
+        cv::line(dst, p1, p2, c, line_width, cv::LINE_AA, 0);
+    });
 }
 
 void Drawer::line(double x1, double y1, double x2, double y2)
@@ -357,6 +1062,9 @@ void Drawer::line(double x1, double y1, double x2, double y2)
         if (x2 > cx2) c2 |= 0b0010;
         if (x2 < cx1) c2 |= 0b0001;
 
+        // 両端が同じ側の外にあれば，線はウィンドウにかからない
+        if ((c1 & c2) != 0b0000) break;
+
         if (c1 == 0b0000 && c2 == 0b0000) {
             int px1 = x1 / csize + IMG_ORIGIN_X;
             int py1 =-y1 / csize + IMG_ORIGIN_Y;
@@ -370,7 +1078,7 @@ void Drawer::line(double x1, double y1, double x2, double y2)
         if (c1 == 0b0000) c = c2;
         else              c = c1;
 
-        double x, y;
+        double x = x1, y = y1;
         if ((c & 0b0001) != 0b0000) {
             // 左端
             y = y1 + (y2 - y1) / (x2 - x1) * (cx1 - x1);
@@ -427,29 +1135,33 @@ void Drawer::lineRA2(double x1, double y1, double r, double angle)
 // 円を描画 ピクセル座標系
 void Drawer::circle(cv::Point p, int radius, bool fill)
 {
-    if (fill)
-        cv::circle(img, p, radius, line_color, -1, cv::LINE_AA, 0);
-    else 
-        cv::circle(img, p, radius, line_color, line_width, cv::LINE_AA, 0);
+    int m = radius + line_width + 1;
+    paint(cv::Rect(p.x - m, p.y - m, 2 * m + 1, 2 * m + 1), line_color, [&](cv::Mat &dst, const cv::Scalar &c) {
+        if (fill)
+            cv::circle(dst, p, radius, c, -1, cv::LINE_AA, 0);
+        else 
+            cv::circle(dst, p, radius, c, line_width, cv::LINE_AA, 0);
+    });
 }
 
 void Drawer::circle(double x1, double y1, double radius, bool fill)
 {
     int px = x1/csize + IMG_ORIGIN_X;
     int py =-y1/csize + IMG_ORIGIN_Y;
-    if (fill)
-        cv::circle(img, cv::Point(px, py), radius/csize, line_color, -1, cv::LINE_AA, 0);
-    else 
-        cv::circle(img, cv::Point(px, py), radius/csize, line_color, line_width, cv::LINE_AA, 0);
+    circle(cv::Point(px, py), radius/csize, fill);
 }
 
 void Drawer::circle(double x, double y, double radius, double startAngle, double endAngle, bool fill)
 {
     int px = x/csize + IMG_ORIGIN_X;
     int py =-y/csize + IMG_ORIGIN_Y;
-    cv::ellipse(img,
-            cv::Point(px, py), 
-            cv::Size(radius/csize, radius/csize), 0.0, startAngle, endAngle, line_color, line_width, cv::LINE_AA,0);
+    int r = radius/csize;
+    int m = r + line_width + 1;
+    paint(cv::Rect(px - m, py - m, 2 * m + 1, 2 * m + 1), line_color, [&](cv::Mat &dst, const cv::Scalar &c) {
+        cv::ellipse(dst,
+                cv::Point(px, py), 
+                cv::Size(r, r), 0.0, startAngle, endAngle, c, line_width, cv::LINE_AA,0);
+    });
 }
 
 // 円形のロボット 
@@ -474,11 +1186,131 @@ void Drawer::robot(double x1, double y1, double r, double angle)
     lineRA2(x1 + xl_, y1 + yl_, 0.2, angle);
 }
 
+void Drawer::render(const DisplayList &dl)
+{
+    int n = dl.size();
+    if (n == 0) return;
+    PROBE_SCOPE("render");
+
+    // 1. 座標変換（列ごとにまとめて行う）
+    rx1.resize(n);
+    ry1.resize(n);
+    rx2.resize(n);
+    ry2.resize(n);
+    rr.resize(n);
+    for (int i = 0; i < n; i++) {
+        rx1[i] = dl.x1[i] / csize + IMG_ORIGIN_X;
+        ry1[i] =-dl.y1[i] / csize + IMG_ORIGIN_Y;
+        rx2[i] = dl.x2[i] / csize + IMG_ORIGIN_X;
+        ry2[i] =-dl.y2[i] / csize + IMG_ORIGIN_Y;
+        rr[i] = dl.r[i] / csize;
+    }
+
+    // 2. 外接矩形が領域の外なら捨て，線分は領域 [0, W] x [0, H] で切り落とす（Liang-Barsky）
+    items.clear();
+    cv::Rect all;
+    for (int i = 0; i < n; i++) {
+        const PrimitiveStyle &s = dl.style[i];
+        double m = s.width / 2 + 2;             // 線の太さと AA のにじみの分
+        double ax = rx1[i], ay = ry1[i], bx = rx2[i], by = ry2[i];
+        double ext = (s.type == PRIM_CIRCLE) ? rr[i] + m : m;
+        if (std::max(ax, bx) + ext < 0.0 || std::min(ax, bx) - ext > IMG_WIDTH
+            || std::max(ay, by) + ext < 0.0 || std::min(ay, by) - ext > IMG_HIGHT) continue;
+
+        RasterItem it;
+        it.index = i;
+        it.radius = 0;
+        if (s.type == PRIM_CIRCLE) {
+            it.p1 = cv::Point((int)ax, (int)ay);
+            it.radius = (int)rr[i];
+        } else {
+            double t0 = 0.0, t1 = 1.0;
+            double dx = bx - ax, dy = by - ay;
+            double p[4] = { -dx, dx, -dy, dy };
+            double q[4] = { ax, IMG_WIDTH - ax, ay, IMG_HIGHT - ay };
+            bool inside = true;
+            for (int k = 0; k < 4 && inside; k++) {
+                if (p[k] == 0.0) {
+                    if (q[k] < 0.0) inside = false;
+                    continue;
+                }
+                double t = q[k] / p[k];
+                if (p[k] < 0.0) t0 = std::max(t0, t);
+                else            t1 = std::min(t1, t);
+                if (t0 > t1) inside = false;
+            }
+            if (!inside) continue;
+            it.p1 = cv::Point((int)(ax + t0 * dx), (int)(ay + t0 * dy));
+            it.p2 = cv::Point((int)(ax + t1 * dx), (int)(ay + t1 * dy));
+        }
+        int e = it.radius + (int)m;
+        int ya = (s.type == PRIM_CIRCLE) ? it.p1.y : std::min(it.p1.y, it.p2.y);
+        int yb = (s.type == PRIM_CIRCLE) ? it.p1.y : std::max(it.p1.y, it.p2.y);
+        int xa = (s.type == PRIM_CIRCLE) ? it.p1.x : std::min(it.p1.x, it.p2.x);
+        int xb = (s.type == PRIM_CIRCLE) ? it.p1.x : std::max(it.p1.x, it.p2.x);
+        it.y0 = std::max(0, ya - e);
+        it.y1 = std::min(IMG_HIGHT - 1, yb + e);
+        if (it.y0 > it.y1) continue;
+        all |= cv::Rect(xa - e, ya - e, xb - xa + 2 * e + 1, yb - ya + 2 * e + 1);
+        items.push_back(it);
+    }
+    if (items.empty()) return;
+
+    // 3. 帯に分ける．帯の中では記録した順に描くので，重なりの順序は変わらない
+    int nb = 1;
+    if (pool && pool->size() > 1) nb = std::max(1, std::min(pool->size() * 4, IMG_HIGHT / 32));
+    int bh = (IMG_HIGHT + nb - 1) / nb;
+    if ((int)bands.size() < nb) bands.resize(nb);
+    for (int b = 0; b < nb; b++) bands[b].clear();
+    for (size_t k = 0; k < items.size(); k++) {
+        for (int b = items[k].y0 / bh; b <= items[k].y1 / bh; b++) bands[b].push_back(k);
+    }
+
+    // 4. 帯ごとに描く．帯は画像の重ならない部分なので，別々のスレッドで描いてよい
+    Layer &L = layers[current];
+    auto drawBand = [&](int b, int) {
+        cv::Rect band(0, b * bh, IMG_WIDTH, std::min(bh, IMG_HIGHT - b * bh));
+        if (band.height <= 0) return;
+        cv::Mat pix = L.pix(band);
+        cv::Mat alpha = (current > 0) ? L.alpha(band) : cv::Mat();
+        cv::Point o(0, band.y);
+        for (int k: bands[b]) {
+            const RasterItem &it = items[k];
+            const PrimitiveStyle &s = dl.style[it.index];
+            cv::Scalar c(s.color[0], s.color[1], s.color[2]);
+            cv::Point p1(it.p1.x - o.x, it.p1.y - o.y);
+            if (s.type == PRIM_CIRCLE) {
+                int w = s.fill ? -1 : s.width;
+                cv::circle(pix, p1, it.radius, c, w, cv::LINE_AA, 0);
+                if (current > 0) cv::circle(alpha, p1, it.radius, cv::Scalar(255), w, cv::LINE_AA, 0);
+            } else {
+                cv::Point p2(it.p2.x - o.x, it.p2.y - o.y);
+                cv::line(pix, p1, p2, c, s.width, cv::LINE_AA, 0);
+                if (current > 0) cv::line(alpha, p1, p2, cv::Scalar(255), s.width, cv::LINE_AA, 0);
+            }
+        }
+    };
+    if (nb > 1) pool->parallelFor(nb, drawBand);
+    else        drawBand(0, 0);
+
+    touch(all);
+}
+
+void Drawer::setThreadPool(std::shared_ptr<ThreadPool> p)
+{
+    pool = p;
+}
+
 void Drawer::text(double x, double y, std::string text)
 {
     int px = x/csize + IMG_ORIGIN_X;
     int py =-y/csize + IMG_ORIGIN_Y;
-    cv::putText(img, text, cv::Point(px, py), cv::FONT_HERSHEY_SIMPLEX, 1.0, line_color, 1, cv::LINE_AA, false);
+    int baseline = 0;
+    cv::Size s = cv::getTextSize(text, cv::FONT_HERSHEY_SIMPLEX, 1.0, 1, &baseline);
+    cv::Rect bound(px - 2, py - s.height - 2, s.width + 4, s.height + baseline + 4);
+    paint(bound, line_color, [&](cv::Mat &dst, const cv::Scalar &c) {
+        cv::putText(dst, text, cv::Point(px, py), cv::FONT_HERSHEY_SIMPLEX, 1.0, c, 1, cv::LINE_AA, false);
+    });
 }
 
 // 指定位置に画像を描画
@@ -487,15 +1319,19 @@ void Drawer::includeImage(double x, double y, std::string path)
 	int px = x/csize + IMG_ORIGIN_X;
 	int py =-y/csize + IMG_ORIGIN_Y;
 
-	cv::Mat img2 = cv::imread(path);
+	std::shared_ptr<const Sprite> s = SpriteCache::instance().get(path);
+	if (s->empty()) return;
+	px = (px > IMG_WIDTH - s->cols()) ? IMG_WIDTH - s->cols() : px;
+	py = (py > IMG_HIGHT - s->rows()) ? IMG_HIGHT - s->rows() : py;
 	px = (px < 0) ? 0 : px;
 	py = (py < 0) ? 0 : py;
-	px = (px > IMG_WIDTH - img2.cols) ? IMG_WIDTH - img2.cols : px;
-	py = (py > IMG_HIGHT - img2.rows) ? IMG_HIGHT - img2.rows : py;
-
-	cv::Mat roi = img(cv::Rect(px, py, img2.cols, img2.rows));
 
-	img2.copyTo(roi);
+	// 透明度は使わずにそのまま貼る．描画領域より大きい画像ははみ出す所を切る
+	cv::Rect r = cv::Rect(px, py, s->cols(), s->rows()) & cv::Rect(0, 0, IMG_WIDTH, IMG_HIGHT);
+	cv::Mat roi = layers[current].pix(r);
+	s->bgr(cv::Rect(0, 0, r.width, r.height)).copyTo(roi);
+	if (current > 0) layers[current].alpha(r).setTo(cv::Scalar(255));
+	touch(r);
 }
 
 void Drawer::overText(double x, double y, std::string path)
@@ -503,18 +1339,10 @@ void Drawer::overText(double x, double y, std::string path)
 	int px = x/csize + IMG_ORIGIN_X;
 	int py =-y/csize + IMG_ORIGIN_Y;
 
-	cv::Mat img2 = cv::imread(path, cv::IMREAD_UNCHANGED);
-	cv::cvtColor(img2, img2, cv::COLOR_RGB2RGBA);
-
-	for (int i = 0; i < img2.rows; i++) {
-		for (int j = 0; j < img2.cols; j++) {
-			if (img2.at<cv::Vec4b>(i,j)[3] != 0) {
-				img.at<cv::Vec3b>(i + py, j + px)[0] = img2.at<cv::Vec4b>(i, j)[0];
-				img.at<cv::Vec3b>(i + py, j + px)[1] = img2.at<cv::Vec4b>(i, j)[1];
-				img.at<cv::Vec3b>(i + py, j + px)[2] = img2.at<cv::Vec4b>(i, j)[2];
-			}
-		}
-	}
+	std::shared_ptr<const Sprite> s = SpriteCache::instance().get(path);
+	if (s->empty()) return;
+	Layer &L = layers[current];
+	touch(blendSprite(blendKernel, L.pix, (current > 0) ? &L.alpha : nullptr, *s, px, py));
 }
 
 #endif
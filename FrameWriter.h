@@ -0,0 +1,233 @@
+/**
+ * @file FrameWriter.h
+ * @brief 画像を連番PNGまたは動画ファイルに書き出すクラス（書き出しは別スレッド）
+ * @author Kazumichi INOUE <k.inoue@oyama-ct.ac.jp>
+ *
+ * write() は画像を作業用のバッファにコピーして待ち行列に入れるだけで，
+ * PNG や動画への変換・書き込みは専用のスレッドが行う．
+ * コピー先のバッファは使い回すので，フレームごとにメモリを確保しない．
+ */
+
+#ifndef __FRAME_WRITER_H__
+#define __FRAME_WRITER_H__
+
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+#include "Probe.h"
+
+class FrameWriter
+{
+    public:
+        /**
+         * @brief コンストラクタ
+         * @param path 出力先．拡張子が .avi なら MJPG の動画1本，
+         *             % を含むなら連番の書式（例: out/frame_%05d.png．%d は1つだけで，他の % は %% に限る），
+         *             .png で終わるなら "名前_00000.png" の連番，それ以外はディレクトリとみなして
+         *             "path/frame_00000.png" の連番にする（ディレクトリは作らない）
+         * @param fps 動画のフレームレート
+         * @param capacity 書き出し待ちにできるフレーム数．超えると write() は空きを待つ
+         */
+        explicit FrameWriter(const std::string &path, double fps = 10.0, int capacity = 8);
+
+        /**
+         * @brief 書き出し待ちのフレームを全て書いてから終わる
+         */
+        ~FrameWriter();
+
+        /**
+         * @brief img のコピーを書き出し待ちに入れる（書き出せない出力先なら何もしない）
+         */
+        void write(const cv::Mat &img);
+
+        /**
+         * @brief 出力先に書き出せるか（書式が正しくない，または書き出しに失敗したら false）
+         */
+        bool isOpen() const;
+
+        /**
+         * @brief 連番の書式として使えるか（%[0-9]*d がちょうど1つで，他の % は %% だけ）
+         */
+        static bool checkPattern(const std::string &pattern);
+
+        /**
+         * @brief 書き出し待ちのフレームが全て書かれるまで待つ
+         */
+        void flush();
+
+        /**
+         * @brief これまでに書き出したフレーム数
+         */
+        long getFrameCount() const;
+
+    private:
+        std::string pattern;            //!< 連番PNGのファイル名の書式
+        std::string videoPath;          //!< 動画のファイル名（連番PNGなら空）
+        double fps;
+        size_t capacity;
+
+        cv::VideoWriter video;
+        bool failed;                    //!< 出力先に書き出せない（以降のフレームは捨てる）
+
+        mutable std::mutex m;
+        std::condition_variable cvWork;
+        std::condition_variable cvSpace;
+        std::deque<cv::Mat> queue;      //!< 書き出し待ち
+        std::vector<cv::Mat> spare;     //!< 使い終わったバッファ
+        bool busy;                      //!< スレッドがフレームを書いている途中か
+        bool quit;
+        long frameNo;
+        std::thread worker;
+
+        void run();
+        bool encode(const cv::Mat &img, long no);
+};
+
+FrameWriter::FrameWriter(const std::string &path, double fps_, int capacity_)
+    : fps(fps_), capacity(capacity_ < 1 ? 1 : capacity_), failed(false),
+      busy(false), quit(false), frameNo(0)
+{
+    std::string ext = (path.size() >= 4) ? path.substr(path.size() - 4) : "";
+    if (ext == ".avi") {
+        videoPath = path;
+    } else if (path.find('%') != std::string::npos) {
+        pattern = path;
+        if (!checkPattern(pattern)) {
+            std::cerr << "連番の書式が正しくありません（%d を1つだけ含めてください）: " << path << "\n";
+            failed = true;
+        }
+    } else if (ext == ".png") {
+        pattern = path.substr(0, path.size() - 4) + "_%05d.png";
+    } else {
+        pattern = path + "/frame_%05d.png";
+    }
+    worker = std::thread(&FrameWriter::run, this);
+}
+
+FrameWriter::~FrameWriter()
+{
+    {
+        std::lock_guard<std::mutex> lock(m);
+        quit = true;
+    }
+    cvWork.notify_all();
+    worker.join();
+    if (video.isOpened()) video.release();
+}
+
+void FrameWriter::write(const cv::Mat &img)
+{
+    std::unique_lock<std::mutex> lock(m);
+    if (failed) return;
+    cvSpace.wait(lock, [this] { return queue.size() < capacity; });
+
+    cv::Mat buf;
+    if (!spare.empty()) {
+        buf = spare.back();
+        spare.pop_back();
+    }
+    img.copyTo(buf);                    // 大きさが同じなら確保し直さない
+    queue.push_back(buf);
+    lock.unlock();
+    cvWork.notify_one();
+}
+
+void FrameWriter::flush()
+{
+    std::unique_lock<std::mutex> lock(m);
+    cvSpace.wait(lock, [this] { return queue.empty() && !busy; });
+}
+
+bool FrameWriter::isOpen() const
+{
+    std::lock_guard<std::mutex> lock(m);
+    return !failed;
+}
+
+bool FrameWriter::checkPattern(const std::string &pattern)
+{
+    int conv = 0;
+    for (size_t i = 0; i < pattern.size(); i++) {
+        if (pattern[i] != '%') continue;
+        i++;
+        if (i < pattern.size() && pattern[i] == '%') continue;
+        while (i < pattern.size() && '0' <= pattern[i] && pattern[i] <= '9') i++;
+        if (i >= pattern.size() || pattern[i] != 'd') return false;
+        conv++;
+    }
+    return conv == 1;
+}
+
+long FrameWriter::getFrameCount() const
+{
+    std::lock_guard<std::mutex> lock(m);
+    return frameNo;
+}
+
+void FrameWriter::run()
+{
+    std::unique_lock<std::mutex> lock(m);
+    while (true) {
+        cvWork.wait(lock, [this] { return quit || !queue.empty(); });
+        if (queue.empty()) return;      // quit で，書くものも残っていない
+
+        cv::Mat img = queue.front();
+        queue.pop_front();
+        busy = true;
+        long no = frameNo;
+        bool skip = failed;
+        lock.unlock();
+
+        bool written = !skip && encode(img, no);
+
+        lock.lock();
+        spare.push_back(img);
+        if (written) frameNo++;
+        busy = false;
+        cvSpace.notify_all();
+    }
+}
+
+bool FrameWriter::encode(const cv::Mat &img, long no)
+{
+    PROBE_SCOPE("encode");
+    // 書き出しのスレッドで例外を投げると止まるので，OpenCV の例外はここで止める．
+    // 書けなかったら（ディレクトリがない・ディスクが一杯など）以降のフレームも書けないので捨てる
+    bool ok = true;
+    try {
+        if (!videoPath.empty()) {
+            if (!video.isOpened()) {
+                video.open(videoPath, cv::VideoWriter::fourcc('M', 'J', 'P', 'G'), fps, img.size());
+                if (!video.isOpened()) {
+                    std::cerr << "動画ファイルを開けません: " << videoPath << "\n";
+                    ok = false;
+                }
+            }
+            if (ok) video.write(img);
+        } else {
+            char name[1024];
+            snprintf(name, sizeof(name), pattern.c_str(), (int)no);
+            if (!cv::imwrite(name, img)) {
+                std::cerr << "画像を書き出せません: " << name << "\n";
+                ok = false;
+            }
+        }
+    } catch (const cv::Exception &e) {
+        std::cerr << "フレームを書き出せません: " << e.what() << "\n";
+        ok = false;
+    }
+    if (!ok) {
+        std::lock_guard<std::mutex> lock(m);
+        failed = true;
+    }
+    return ok;
+}
+
+#endif
@@ -0,0 +1,208 @@
+/**
+ * @file KldSampling.h
+ * @brief KLD サンプリングで粒子数を決めるための格子と上限の式
+ * @author Kazumichi INOUE <k.inoue@oyama-ct.ac.jp>
+ *
+ * 姿勢の空間 (x, y, θ) を一定の大きさの格子に分け，粒子が1つ以上入っている格子の数 k を数える．
+ * 真の分布が k 個の格子に載っているとき，標本から作った分布との KL ダイバージェンスが
+ * 確率 1 - δ で ε 以下になる粒子数は，カイ2乗分布の Wilson-Hilferty 近似から
+ *   n = (k - 1) / (2ε) * (1 - 2 / (9(k - 1)) + sqrt(2 / (9(k - 1))) z)^3
+ * となる（z は標準正規分布の上側 δ 点）．雲がまとまっていれば k が小さく，少ない粒子で足りる．
+ * 格子は Drawer の密度表示と同じく座標を大きさで割って切り捨てた番号で決めるが，
+ * 範囲を決めずに済むよう，番号の組を開番地法のハッシュ表に入れて数える．
+ * 表は最大の粒子数に合わせて一度だけ確保し，数えるたびには消さずに世代番号で区別する．
+ */
+
+#ifndef __KLD_SAMPLING_H__
+#define __KLD_SAMPLING_H__
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+/**
+ * @brief KLD サンプリングの設定
+ */
+struct KldParam
+{
+    int minParticles;       //!< 粒子数の下限
+    int maxParticles;       //!< 粒子数の上限（作業領域はこの数で確保する）
+    double binXY;           //!< 位置の格子の大きさ [m]
+    double binTh;           //!< 向きの格子の大きさ [rad]
+    double epsilon;         //!< KL ダイバージェンスの許容値 ε
+    double z;               //!< 標準正規分布の上側 δ 点（既定は δ = 0.01）
+
+    KldParam()
+        : minParticles(100), maxParticles(100000), binXY(0.05), binTh(0.1), epsilon(0.05), z(2.326) {}
+
+    /**
+     * @brief 格子の数 k から必要な粒子数を求め，[minParticles, maxParticles] に収める
+     */
+    int getParticleCount(int k) const;
+};
+
+/**
+ * @brief 環境変数 KLD_PARTICLES="下限,上限" から粒子数の範囲を読む
+ * @return 指定されていて読めたら true（p の下限・上限を書き換える）
+ */
+bool getKldParamFromEnv(KldParam &p);
+
+/**
+ * @brief 粒子の入っている格子の数を数える
+ */
+class KldBins
+{
+    public:
+        explicit KldBins(const KldParam &p = KldParam());
+
+        void setParam(const KldParam &p);
+
+        /**
+         * @brief n 個の粒子を数えられるだけの表を確保する（すでに足りていれば何もしない）
+         */
+        void reserve(int n);
+
+        /**
+         * @brief 数え直す（表は消さない）
+         */
+        void clear();
+
+        /**
+         * @brief 姿勢の入る格子を数に加える
+         * @return 初めて入った格子なら true
+         */
+        bool insert(double x, double y, double th);
+
+        /**
+         * @brief これまでに入った格子の数
+         */
+        int count() const;
+
+    private:
+        struct Slot
+        {
+            int32_t ix, iy, ith;
+            uint32_t gen;       //!< この世代に使った格子か
+        };
+
+        KldParam param;
+        std::vector<Slot> table;        //!< 大きさは2のべき乗
+        uint32_t gen;
+        int k;
+
+        size_t find(int32_t ix, int32_t iy, int32_t ith) const;
+        void grow(size_t size);
+};
+
+int KldParam::getParticleCount(int k) const
+{
+    double n = minParticles;
+    if (k > 1) {
+        double a = 2.0 / (9.0 * (k - 1));
+        double b = 1.0 - a + sqrt(a) * z;
+        n = (k - 1) / (2.0 * epsilon) * b * b * b;
+    }
+    return (int)std::max<double>(minParticles, std::min<double>(maxParticles, ceil(n)));
+}
+
+bool getKldParamFromEnv(KldParam &p)
+{
+    const char *env = getenv("KLD_PARTICLES");
+    if (env == nullptr || *env == '\0') return false;
+    int lo, hi;
+    if (sscanf(env, "%d,%d", &lo, &hi) != 2 || lo < 1 || hi < lo) {
+        std::cerr << "KLD_PARTICLES は \"下限,上限\" で指定してください: " << env << "\n";
+        return false;
+    }
+    p.minParticles = lo;
+    p.maxParticles = hi;
+    return true;
+}
+
+KldBins::KldBins(const KldParam &p)
+    : param(p), gen(0), k(0)
+{
+}
+
+void KldBins::setParam(const KldParam &p)
+{
+    param = p;
+    clear();
+}
+
+void KldBins::reserve(int n)
+{
+    // 埋まるのは半分以下にする
+    size_t size = 16;
+    while (size < 2 * (size_t)n) size *= 2;
+    if (size > table.size()) grow(size);
+}
+
+// 表を大きくし，この世代の格子を入れ直す
+void KldBins::grow(size_t size)
+{
+    std::vector<Slot> old;
+    old.swap(table);
+    Slot empty = { 0, 0, 0, 0 };
+    table.assign(size, empty);
+    if (gen == 0) gen = 1;
+    for (const Slot &s: old) {
+        if (s.gen == gen) table[find(s.ix, s.iy, s.ith)] = s;
+    }
+}
+
+// 格子の入っている場所か，この世代でまだ使っていない場所
+size_t KldBins::find(int32_t ix, int32_t iy, int32_t ith) const
+{
+    uint64_t h = (uint64_t)(uint32_t)ix * 0x9e3779b97f4a7c15ULL
+               ^ (uint64_t)(uint32_t)iy * 0xc2b2ae3d27d4eb4fULL
+               ^ (uint64_t)(uint32_t)ith * 0x165667b19e3779f9ULL;
+    h ^= h >> 29;
+    size_t mask = table.size() - 1;
+    size_t i = h & mask;
+    while (table[i].gen == gen && !(table[i].ix == ix && table[i].iy == iy && table[i].ith == ith)) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+void KldBins::clear()
+{
+    k = 0;
+    if (++gen == 0) {
+        // 世代番号が一周したら表を消す
+        for (Slot &s: table) s.gen = 0;
+        gen = 1;
+    }
+}
+
+bool KldBins::insert(double x, double y, double th)
+{
+    if (2 * (size_t)(k + 1) > table.size()) reserve(2 * (k + 1));
+
+    // 向きは [-π, π) に直してから分ける
+    th -= 2.0 * M_PI * floor((th + M_PI) / (2.0 * M_PI));
+    int32_t ix  = (int32_t)floor(x / param.binXY);
+    int32_t iy  = (int32_t)floor(y / param.binXY);
+    int32_t ith = (int32_t)floor(th / param.binTh);
+
+    Slot &s = table[find(ix, iy, ith)];
+    if (s.gen == gen) return false;
+    s.ix = ix;
+    s.iy = iy;
+    s.ith = ith;
+    s.gen = gen;
+    k++;
+    return true;
+}
+
+int KldBins::count() const
+{
+    return k;
+}
+
+#endif
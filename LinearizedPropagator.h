@@ -0,0 +1,330 @@
+/**
+ * @file LinearizedPropagator.h
+ * @brief 速度動作モデルを線形化して姿勢の平均と共分散を伝播する（EKF の予測ステップ）
+ * @author Kazumichi INOUE <k.inoue@oyama-ct.ac.jp>
+ *
+ * RobotBatch が多数のロボットを動かして分布を求めるのに対し，こちらは平均と 3x3 の
+ * 共分散だけを持ち，1ステップ O(1) で更新する．
+ *   P' = G P G^T + V M V^T
+ * G は姿勢，V は (v, w, 最終回転) についての動作モデルのヤコビ行列，
+ * M = diag(sv^2, sw^2, sr^2) は MotionParam::getStd() から作る誤差の共分散．
+ * advance() と getStatistics() を持つので TimelineExecutor でそのまま動かせる．
+ *
+ * LinearizationCheck は RobotBatch と LinearizedPropagator を同じ指令で動かし，
+ * 2つの分布の食い違いを正規分布の KL ダイバージェンスで報告する．
+ */
+
+#ifndef __LINEARIZED_PROPAGATOR_H__
+#define __LINEARIZED_PROPAGATOR_H__
+
+#include <cmath>
+
+#include "Noise.h"
+#include "PoseStatistics.h"
+#include "RobotBatch.h"
+
+class LinearizedPropagator
+{
+    public:
+        /**
+         * @brief コンストラクタ．原点・向き0，共分散0で始める
+         */
+        LinearizedPropagator();
+
+        /**
+         * @brief 姿勢をセットし，共分散を0にする
+         */
+        void set(double x_, double y_, double th_);
+
+        /**
+         * @brief 姿勢の共分散をセットする
+         */
+        void setCov(const double cov[3][3]);
+
+        /**
+         * @brief 速度指令 (v, w) で dt だけ進める
+         */
+        void move(double v, double w, double dt);
+
+        /**
+         * @brief 速度指令 (v, w) で nsteps ステップ進める
+         */
+        void advance(double v, double w, double dt, long nsteps);
+
+        /**
+         * @brief advance() と同じく進め，進めた後の分布を stat に入れる
+         */
+        void advance(double v, double w, double dt, long nsteps, PoseStatistics &stat);
+
+        /**
+         * @brief 現在の分布を stat に入れる（PoseStatistics::setGaussian()）
+         */
+        void getStatistics(PoseStatistics &stat) const;
+
+        void setParam(const MotionParam &p);
+        const MotionParam &getParam() const;
+
+        double getX() const;
+        double getY() const;
+        double getTh() const;
+        double getCov(int i, int j) const;
+
+    private:
+        double x, y, th;
+        double P[3][3];
+        MotionParam param;
+
+        // sin(u)/u とその導関数
+        static void sinc(double u, double &s, double &ds);
+};
+
+LinearizedPropagator::LinearizedPropagator()
+{
+    set(0.0, 0.0, 0.0);
+}
+
+void LinearizedPropagator::set(double x_, double y_, double th_)
+{
+    x = x_;
+    y = y_;
+    th = th_;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) P[i][j] = 0.0;
+    }
+}
+
+void LinearizedPropagator::setCov(const double cov[3][3])
+{
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) P[i][j] = cov[i][j];
+    }
+}
+
+void LinearizedPropagator::move(double v, double w, double dt)
+{
+    double sv, sw, sr;
+    param.getStd(v, w, sv, sw, sr);
+
+    // 円弧の式を u = w dt / 2 で書き直したもの（TranslationPolicy と同じ）．w = 0 でも割り算しない
+    //   x' = x + v dt sinc(u) cos(th + u),  y' = y + v dt sinc(u) sin(th + u),  th' = th + w dt + r dt
+    double u = 0.5 * w * dt;
+    double s, ds;
+    sinc(u, s, ds);
+    double c1 = cos(th + u);
+    double s1 = sin(th + u);
+    double d = v * dt * s;
+
+    // 姿勢についてのヤコビ行列 G（対角以外で0でないのは (0,2), (1,2) だけ）
+    double g02 = -d * s1;
+    double g12 =  d * c1;
+
+    // 指令 (v, w, r) についてのヤコビ行列 V
+    double V[3][3] = {
+        { dt * s * c1, 0.5 * dt * v * dt * (ds * c1 - s * s1), 0.0 },
+        { dt * s * s1, 0.5 * dt * v * dt * (ds * s1 + s * c1), 0.0 },
+        { 0.0,         dt,                                      dt  },
+    };
+    double M[3] = { sv * sv, sw * sw, sr * sr };
+
+    // A = G P G^T
+    double GP[3][3];
+    for (int j = 0; j < 3; j++) {
+        GP[0][j] = P[0][j] + g02 * P[2][j];
+        GP[1][j] = P[1][j] + g12 * P[2][j];
+        GP[2][j] = P[2][j];
+    }
+    double A[3][3];
+    for (int i = 0; i < 3; i++) {
+        A[i][0] = GP[i][0] + GP[i][2] * g02;
+        A[i][1] = GP[i][1] + GP[i][2] * g12;
+        A[i][2] = GP[i][2];
+    }
+
+    // P' = A + V M V^T
+    for (int i = 0; i < 3; i++) {
+        for (int j = i; j < 3; j++) {
+            double q = 0.0;
+            for (int k = 0; k < 3; k++) q += V[i][k] * M[k] * V[j][k];
+            P[i][j] = 0.5 * (A[i][j] + A[j][i]) + q;
+            P[j][i] = P[i][j];
+        }
+    }
+
+    x += d * c1;
+    y += d * s1;
+    th += w * dt;
+}
+
+void LinearizedPropagator::advance(double v, double w, double dt, long nsteps)
+{
+    for (long k = 0; k < nsteps; k++) move(v, w, dt);
+}
+
+void LinearizedPropagator::advance(double v, double w, double dt, long nsteps, PoseStatistics &stat)
+{
+    advance(v, w, dt, nsteps);
+    getStatistics(stat);
+}
+
+void LinearizedPropagator::getStatistics(PoseStatistics &stat) const
+{
+    stat.setGaussian(x, y, th, P);
+}
+
+void LinearizedPropagator::setParam(const MotionParam &p)
+{
+    param = p;
+}
+
+const MotionParam &LinearizedPropagator::getParam() const
+{
+    return param;
+}
+
+double LinearizedPropagator::getX() const  { return x; }
+double LinearizedPropagator::getY() const  { return y; }
+double LinearizedPropagator::getTh() const { return th; }
+
+double LinearizedPropagator::getCov(int i, int j) const
+{
+    return P[i][j];
+}
+
+void LinearizedPropagator::sinc(double u, double &s, double &ds)
+{
+    if (fabs(u) < 1e-3) {
+        double u2 = u * u;
+        s  = 1.0 - u2 / 6.0 + u2 * u2 / 120.0;
+        ds = u * (-1.0 / 3.0 + u2 / 30.0);
+    } else {
+        s  = sin(u) / u;
+        ds = (cos(u) - s) / u;
+    }
+}
+
+/**
+ * @brief 2つの姿勢の分布を正規分布とみなしたときの KL ダイバージェンス KL(p || q)
+ * @details 向きの平均の差は (-π, π] に折り返す．共分散には eps を足してから計算するので，
+ *          動き始める前（共分散0）どうしでも 0 になる
+ */
+inline double gaussianKL(const PoseStatistics &p, const PoseStatistics &q, double eps = 1e-12)
+{
+    double S0[3][3], S1[3][3];
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            S0[i][j] = p.getCov(i, j) + (i == j ? eps : 0.0);
+            S1[i][j] = q.getCov(i, j) + (i == j ? eps : 0.0);
+        }
+    }
+
+    // S1 の逆行列（余因子）
+    double C[3][3];
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            int i1 = (i + 1) % 3, i2 = (i + 2) % 3;
+            int j1 = (j + 1) % 3, j2 = (j + 2) % 3;
+            C[j][i] = S1[i1][j1] * S1[i2][j2] - S1[i1][j2] * S1[i2][j1];
+        }
+    }
+    double det1 = S1[0][0] * C[0][0] + S1[0][1] * C[1][0] + S1[0][2] * C[2][0];
+    double det0 = S0[0][0] * (S0[1][1] * S0[2][2] - S0[1][2] * S0[2][1])
+                - S0[0][1] * (S0[1][0] * S0[2][2] - S0[1][2] * S0[2][0])
+                + S0[0][2] * (S0[1][0] * S0[2][1] - S0[1][1] * S0[2][0]);
+
+    double dm[3] = {
+        q.getMeanX() - p.getMeanX(),
+        q.getMeanY() - p.getMeanY(),
+        remainder(q.getMeanTh() - p.getMeanTh(), 2.0 * M_PI),
+    };
+
+    double tr = 0.0;
+    double maha = 0.0;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            tr   += C[i][j] * S0[j][i];
+            maha += dm[i] * C[i][j] * dm[j];
+        }
+    }
+    return 0.5 * ((tr + maha) / det1 - 3.0 + log(det1 / det0));
+}
+
+/**
+ * @brief モンテカルロ（RobotBatch）と線形化（LinearizedPropagator）を並べて動かす
+ * @details TimelineExecutor で動かせる．統計の観測者に渡る統計はモンテカルロ側のもの
+ */
+class LinearizationCheck
+{
+    public:
+        LinearizationCheck(RobotBatch &mc_, LinearizedPropagator &lin_);
+
+        void advance(double v, double w, double dt, long nsteps);
+        void advance(double v, double w, double dt, long nsteps, PoseStatistics &stat);
+        void getStatistics(PoseStatistics &stat);
+
+        /**
+         * @brief 現在の KL(モンテカルロ || 線形化)
+         * @details 直前の advance() で統計を求めていればそれを使い，集合を読み直さない
+         */
+        double getDivergence();
+
+        RobotBatch &getMonteCarlo();
+        LinearizedPropagator &getLinearized();
+
+    private:
+        RobotBatch &mc;
+        LinearizedPropagator &lin;
+        PoseStatistics mcStat;
+        bool fresh;             //!< mcStat が現在の集合の統計か
+};
+
+LinearizationCheck::LinearizationCheck(RobotBatch &mc_, LinearizedPropagator &lin_)
+    : mc(mc_), lin(lin_), fresh(false)
+{
+}
+
+void LinearizationCheck::advance(double v, double w, double dt, long nsteps)
+{
+    mc.advance(v, w, dt, nsteps);
+    lin.advance(v, w, dt, nsteps);
+    fresh = false;
+}
+
+void LinearizationCheck::advance(double v, double w, double dt, long nsteps, PoseStatistics &stat)
+{
+    mc.advance(v, w, dt, nsteps, mcStat);
+    lin.advance(v, w, dt, nsteps);
+    fresh = true;
+    stat = mcStat;
+}
+
+void LinearizationCheck::getStatistics(PoseStatistics &stat)
+{
+    if (!fresh) {
+        mc.getStatistics(mcStat);
+        fresh = true;
+    }
+    stat = mcStat;
+}
+
+double LinearizationCheck::getDivergence()
+{
+    if (!fresh) {
+        mc.getStatistics(mcStat);
+        fresh = true;
+    }
+    PoseStatistics linStat;
+    lin.getStatistics(linStat);
+    return gaussianKL(mcStat, linStat);
+}
+
+RobotBatch &LinearizationCheck::getMonteCarlo()
+{
+    return mc;
+}
+
+LinearizedPropagator &LinearizationCheck::getLinearized()
+{
+    return lin;
+}
+
+#endif
@@ -0,0 +1,270 @@
+/**
+ * @file MotionKernel.h
+ * @brief 速度動作モデルの更新式をSIMDで計算するカーネルと，実行時の命令セット選択
+ * @author Kazumichi INOUE <k.inoue@oyama-ct.ac.jp>
+ *
+ * 計算式は Robot::move と同じ．誤差は呼び出し側が標準正規乱数の配列として渡し，
+ * カーネルの中で標準偏差を掛ける．
+ * SSE2/AVX2/AVX-512 版とスカラー版は同じテンプレートから作るので，
+ * どれが選ばれても同じ入力に対して同じ結果になる．
+ *
+ * 更新式は指令の種類に合わせた4つのポリシーから選ぶ（selectMotionPolicy()）．
+ * 誤差の入れ方はどれも同じで，違うのは計算の仕方だけ．
+ *  - ArcPolicy         一般の円弧．Robot::move と同じ式
+ *  - TranslationPolicy 1ステップの回転角が小さい場合．sin を1回にし，v_/w_ の割り算をしない
+ *  - RotationPolicy    その場回転（並進の誤差も0）．向きだけ更新する
+ *  - NoiseFreePolicy   誤差なし．乱数を使わない
+ */
+
+#ifndef __MOTION_KERNEL_H__
+#define __MOTION_KERNEL_H__
+
+#include <cstring>
+
+#include "SimdMath.h"
+
+/**
+ * @brief カーネルに渡す引数
+ */
+struct MoveArgs
+{
+    double *x, *y, *th;                 //!< 更新する姿勢の配列
+    const double *nv, *nw, *nr;         //!< 標準正規乱数（v, w, 最終回転の誤差用．NoiseFreePolicy では使わない）
+    int n;                              //!< 要素数
+    double v, w;                        //!< 速度指令
+    double sv, sw, sr;                  //!< 誤差の標準偏差
+    double dt;                          //!< 時間刻み [s]
+};
+
+typedef void (*MoveKernel)(const MoveArgs &a);
+
+/**
+ * @brief 更新式の種類
+ */
+enum MotionPolicy
+{
+    POLICY_ARC = 0,
+    POLICY_TRANSLATION,
+    POLICY_ROTATION,
+    POLICY_NOISE_FREE
+};
+
+/**
+ * @brief 速度指令と誤差の大きさから更新式を選ぶ
+ * @details 指令区間ごとに1回呼べばよい．ロボットごとの分岐はしない
+ */
+inline MotionPolicy selectMotionPolicy(double v, double w, double sv, double sw, double sr, double dt)
+{
+    if (sv == 0.0 && sw == 0.0 && sr == 0.0) return POLICY_NOISE_FREE;
+    if (v == 0.0 && sv == 0.0) return POLICY_ROTATION;
+
+    // 正規乱数はほぼ 8σ 以内なので，1ステップの回転角の半分が 0.1rad 未満に収まるなら
+    // TranslationPolicy の級数展開で倍精度の精度が出る（外れた場合もブロック単位で正確な式に切り替える）
+    if ((fabs(w) + 8.0 * sw) * fabs(dt) * 0.5 < 0.1) return POLICY_TRANSLATION;
+    return POLICY_ARC;
+}
+
+inline const char *motionPolicyName(MotionPolicy p)
+{
+    switch (p) {
+        case POLICY_TRANSLATION: return "translation";
+        case POLICY_ROTATION:    return "rotation";
+        case POLICY_NOISE_FREE:  return "noise-free";
+        default:                 return "arc";
+    }
+}
+
+namespace simd
+{
+    template <typename M> inline bool anyTrue(M m)
+    {
+        bool r = false;
+        for (unsigned k = 0; k < sizeof(M) / sizeof(m[0]); k++) r = r || (m[k] != 0);
+        return r;
+    }
+
+    // sin(u)/u．|u| < 0.1 は級数，それ以外は sin を計算する
+    template <typename V> inline V sinc(V u)
+    {
+        V u2 = u * u;
+        V s = 1.0 + u2 * (-1.0 / 6 + u2 * (1.0 / 120 + u2 * (-1.0 / 5040 + u2 * (1.0 / 362880))));
+        typename Traits<V>::M big = vabs(u) >= 0.1;
+        if (anyTrue(big)) {
+            V su, cu;
+            sincos(u, su, cu);
+            s = big ? su / u : s;
+        }
+        return s;
+    }
+
+    /**
+     * @brief 一般の円弧．Robot::move と同じ式
+     */
+    struct ArcPolicy
+    {
+        static const bool NOISE = true;
+
+        template <typename V>
+        static void apply(const MoveArgs &a, double *x, double *y, double *th,
+                const double *nv, const double *nw, const double *nr)
+        {
+            V v_ = a.v + a.sv * load<V>(nv);
+            V w_ = a.w + a.sw * load<V>(nw);
+            V r_ =       a.sr * load<V>(nr);
+
+            // |w_| が小さいときは 1e-6 にする（Robot::move と同じ扱いを分岐なしで）
+            w_ = vabs(w_) < 1e-6 ? broadcast<V>(1e-6) : w_;
+
+            V t = load<V>(th);
+            V s0, c0, s1, c1;
+            sincos(t, s0, c0);
+            sincos(t + w_ * a.dt, s1, c1);
+
+            V k = v_ / w_;
+            store(x,  load<V>(x) - k * s0 + k * s1);
+            store(y,  load<V>(y) + k * c0 - k * c1);
+            store(th, t + w_ * a.dt + r_ * a.dt);
+        }
+    };
+
+    /**
+     * @brief 1ステップの回転角が小さい場合の円弧
+     * @details u = w_ dt / 2 とすると円弧の式は
+     *          x2 = x + v_ dt cos(th + u) sin(u)/u,  y2 = y + v_ dt sin(th + u) sin(u)/u
+     *          と書ける．sin(u)/u は級数で求めるので，sin/cos は1回で済み w_ で割らない
+     */
+    struct TranslationPolicy
+    {
+        static const bool NOISE = true;
+
+        template <typename V>
+        static void apply(const MoveArgs &a, double *x, double *y, double *th,
+                const double *nv, const double *nw, const double *nr)
+        {
+            V v_ = a.v + a.sv * load<V>(nv);
+            V w_ = a.w + a.sw * load<V>(nw);
+            V r_ =       a.sr * load<V>(nr);
+
+            V t = load<V>(th);
+            V u = 0.5 * a.dt * w_;
+            V s, c;
+            sincos(t + u, s, c);
+
+            V d = v_ * a.dt * sinc(u);
+            store(x,  load<V>(x) + d * c);
+            store(y,  load<V>(y) + d * s);
+            store(th, t + w_ * a.dt + r_ * a.dt);
+        }
+    };
+
+    /**
+     * @brief その場回転．並進速度もその誤差も0なので位置は変わらない
+     */
+    struct RotationPolicy
+    {
+        static const bool NOISE = true;
+
+        template <typename V>
+        static void apply(const MoveArgs &a, double *, double *, double *th,
+                const double *, const double *nw, const double *nr)
+        {
+            V w_ = a.w + a.sw * load<V>(nw);
+            V r_ =       a.sr * load<V>(nr);
+            store(th, load<V>(th) + w_ * a.dt + r_ * a.dt);
+        }
+    };
+
+    /**
+     * @brief 誤差なし．全ロボットが同じ (v, w) で動く
+     */
+    struct NoiseFreePolicy
+    {
+        static const bool NOISE = false;
+
+        template <typename V>
+        static void apply(const MoveArgs &a, double *x, double *y, double *th,
+                const double *, const double *, const double *)
+        {
+            V t = load<V>(th);
+            V u = broadcast<V>(0.5 * a.dt * a.w);
+            V s, c;
+            sincos(t + u, s, c);
+
+            V d = a.v * a.dt * sinc(u);
+            store(x,  load<V>(x) + d * c);
+            store(y,  load<V>(y) + d * s);
+            store(th, t + a.w * a.dt);
+        }
+    };
+
+    template <typename P, typename V>
+    inline void moveKernel(const MoveArgs &a)
+    {
+        const int W = Traits<V>::W;
+        int i = 0;
+        for (; i + W <= a.n; i += W) {
+            if (P::NOISE) {
+                P::template apply<V>(a, a.x + i, a.y + i, a.th + i, a.nv + i, a.nw + i, a.nr + i);
+            } else {
+                P::template apply<V>(a, a.x + i, a.y + i, a.th + i, nullptr, nullptr, nullptr);
+            }
+        }
+
+        // 端数は作業領域に詰めて同じ計算をする（要素ごとの結果が分割の仕方に依存しないように）
+        int rest = a.n - i;
+        if (rest > 0) {
+            double buf[6][W];
+            memset(buf, 0, sizeof(buf));
+            memcpy(buf[0], a.x + i,  rest * sizeof(double));
+            memcpy(buf[1], a.y + i,  rest * sizeof(double));
+            memcpy(buf[2], a.th + i, rest * sizeof(double));
+            if (P::NOISE) {
+                memcpy(buf[3], a.nv + i, rest * sizeof(double));
+                memcpy(buf[4], a.nw + i, rest * sizeof(double));
+                memcpy(buf[5], a.nr + i, rest * sizeof(double));
+            }
+            P::template apply<V>(a, buf[0], buf[1], buf[2], buf[3], buf[4], buf[5]);
+            memcpy(a.x + i,  buf[0], rest * sizeof(double));
+            memcpy(a.y + i,  buf[1], rest * sizeof(double));
+            memcpy(a.th + i, buf[2], rest * sizeof(double));
+        }
+    }
+
+    // 命令セットごとに4つのポリシーの入口を作る
+#define MOTION_KERNEL_ENTRIES(NAME, ATTR, V)                                                \
+    ATTR inline void NAME##Arc(const MoveArgs &a)         { moveKernel<ArcPolicy, V>(a); }         \
+    ATTR inline void NAME##Translation(const MoveArgs &a) { moveKernel<TranslationPolicy, V>(a); } \
+    ATTR inline void NAME##Rotation(const MoveArgs &a)    { moveKernel<RotationPolicy, V>(a); }    \
+    ATTR inline void NAME##NoiseFree(const MoveArgs &a)   { moveKernel<NoiseFreePolicy, V>(a); }
+
+    MOTION_KERNEL_ENTRIES(moveScalar, __attribute__((flatten)), v1d)
+#ifdef SIMD_X86
+    MOTION_KERNEL_ENTRIES(moveSSE2,   SIMD_TARGET("sse2"),    v2d)
+    MOTION_KERNEL_ENTRIES(moveAVX2,   SIMD_TARGET("avx2"),    v4d)
+    MOTION_KERNEL_ENTRIES(moveAVX512, SIMD_TARGET("avx512f"), v8d)
+#endif
+#undef MOTION_KERNEL_ENTRIES
+}
+
+/**
+ * @brief 命令セットと更新式に対応するカーネルを返す
+ * @details 対応していない命令セットを指定した場合はスカラー版になる
+ */
+inline MoveKernel getMoveKernel(SimdIsa isa, MotionPolicy policy = POLICY_ARC)
+{
+    static const MoveKernel table[4][4] = {
+        { simd::moveScalarArc, simd::moveScalarTranslation, simd::moveScalarRotation, simd::moveScalarNoiseFree },
+#ifdef SIMD_X86
+        { simd::moveSSE2Arc,   simd::moveSSE2Translation,   simd::moveSSE2Rotation,   simd::moveSSE2NoiseFree },
+        { simd::moveAVX2Arc,   simd::moveAVX2Translation,   simd::moveAVX2Rotation,   simd::moveAVX2NoiseFree },
+        { simd::moveAVX512Arc, simd::moveAVX512Translation, simd::moveAVX512Rotation, simd::moveAVX512NoiseFree },
+#else
+        { simd::moveScalarArc, simd::moveScalarTranslation, simd::moveScalarRotation, simd::moveScalarNoiseFree },
+        { simd::moveScalarArc, simd::moveScalarTranslation, simd::moveScalarRotation, simd::moveScalarNoiseFree },
+        { simd::moveScalarArc, simd::moveScalarTranslation, simd::moveScalarRotation, simd::moveScalarNoiseFree },
+#endif
+    };
+    return table[isa][policy];
+}
+
+#endif
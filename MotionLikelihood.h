@@ -0,0 +1,287 @@
+/**
+ * @file MotionLikelihood.h
+ * @brief 速度動作モデルの尤度 p(x_t | u_t, x_{t-1}) をまとめて計算するカーネル
+ * @author Kazumichi INOUE <k.inoue@oyama-ct.ac.jp>
+ *
+ * Robot::move や RobotBatch::move（MotionKernel.h）はこのモデルから標本を作る．ここでは逆に，
+ * 移動前後の姿勢の組（SoA）と速度指令 (v, w, dt) から，その移動が起こる確率密度の対数を求める．
+ * 誤差の標準偏差は MotionParam::getStd() で決めるので，標本を作る側と定義が食い違わない．
+ *
+ * 移動前の向きから見た変位を f（前方），l（左方）とすると，円弧に沿って移動したときの
+ *   回転角 φ = 2 atan(l / f),  弧長 s = sign(f) sqrt(f^2 + l^2) / sinc(φ/2)
+ * となる．これから誤差を含んだ指令 v̂ = s/dt, ŵ = φ/dt と最終回転 γ̂ = (θ' - θ - φ)/dt が決まり，
+ *   log p = log N(v̂ - v; sv^2) + log N(ŵ - w; sw^2) + log N(γ̂; sr^2)
+ * を返す（Probabilistic Robotics の motion_model_velocity と同じ量．中心 (x*, y*) を経由せずに
+ * 求めるので，直進に近くても割り算が発散しない）．1ステップの回転角 |φ| は π 未満とする．
+ * 標準偏差が0の成分は，誤差がちょうど0なら0，それ以外は -∞ にする．
+ */
+
+#ifndef __MOTION_LIKELIHOOD_H__
+#define __MOTION_LIKELIHOOD_H__
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <memory>
+
+#include "MotionKernel.h"
+#include "Noise.h"
+#include "Probe.h"
+#include "SimdMath.h"
+#include "ThreadPool.h"
+
+/**
+ * @brief カーネルに渡す引数
+ */
+struct LikelihoodArgs
+{
+    const double *x0, *y0, *th0;        //!< 移動前の姿勢
+    const double *x1, *y1, *th1;        //!< 移動後の姿勢
+    double *out;                        //!< [出力] 対数尤度
+    int n;                              //!< 組の数
+    double v, w, dt;                    //!< 速度指令と時間刻み
+    double kv, kw, kr;                  //!< -1 / (2σ^2)（σ = 0 の成分は使わない）
+    bool dv, dw, dr;                    //!< σ = 0 の成分か
+    double c;                           //!< 正規化定数の対数の和
+};
+
+typedef void (*LikelihoodKernel)(const LikelihoodArgs &a);
+
+namespace simd
+{
+    // 正規分布の対数密度の指数部分．σ = 0 なら r = 0 のときだけ 0
+    template <typename V> inline V gaussExponent(V r, double k, bool delta)
+    {
+        if (delta) return r == 0 ? V{} : broadcast<V>(-INFINITY);
+        return k * r * r;
+    }
+
+    template <typename V>
+    inline void likelihoodBlock(const LikelihoodArgs &a, const double *x0, const double *y0, const double *th0,
+            const double *x1, const double *y1, const double *th1, double *out)
+    {
+        V t = load<V>(th0);
+        V s0, c0;
+        sincos(t, s0, c0);
+
+        V dx = load<V>(x1) - load<V>(x0);
+        V dy = load<V>(y1) - load<V>(y0);
+        V f = dx * c0 + dy * s0;
+        V l = dy * c0 - dx * s0;
+
+        // 後退（f < 0）も同じ式で扱えるよう，f を正にしてから角度を求める
+        V sg = f < 0 ? broadcast<V>(-1.0) : broadcast<V>(1.0);
+        V phi = 2.0 * atan2(l * sg, f * sg);
+        V s = sg * vsqrt(f * f + l * l) / sinc(0.5 * phi);
+
+        V vh = s / a.dt;
+        V wh = phi / a.dt;
+        V gh = wrapAngle(load<V>(th1) - t - phi) / a.dt;
+
+        store(out, a.c + gaussExponent(vh - a.v, a.kv, a.dv)
+                       + gaussExponent(wh - a.w, a.kw, a.dw)
+                       + gaussExponent(gh, a.kr, a.dr));
+    }
+
+    template <typename V>
+    inline void likelihoodKernel(const LikelihoodArgs &a)
+    {
+        const int W = Traits<V>::W;
+        int i = 0;
+        for (; i + W <= a.n; i += W) {
+            likelihoodBlock<V>(a, a.x0 + i, a.y0 + i, a.th0 + i, a.x1 + i, a.y1 + i, a.th1 + i, a.out + i);
+        }
+
+        // 端数は作業領域に詰めて同じ計算をする
+        int rest = a.n - i;
+        if (rest > 0) {
+            double buf[7][W];
+            memset(buf, 0, sizeof(buf));
+            memcpy(buf[0], a.x0 + i,  rest * sizeof(double));
+            memcpy(buf[1], a.y0 + i,  rest * sizeof(double));
+            memcpy(buf[2], a.th0 + i, rest * sizeof(double));
+            memcpy(buf[3], a.x1 + i,  rest * sizeof(double));
+            memcpy(buf[4], a.y1 + i,  rest * sizeof(double));
+            memcpy(buf[5], a.th1 + i, rest * sizeof(double));
+            likelihoodBlock<V>(a, buf[0], buf[1], buf[2], buf[3], buf[4], buf[5], buf[6]);
+            memcpy(a.out + i, buf[6], rest * sizeof(double));
+        }
+    }
+
+    __attribute__((flatten))
+    inline void likelihoodKernelScalar(const LikelihoodArgs &a) { likelihoodKernel<v1d>(a); }
+
+#ifdef SIMD_X86
+    SIMD_TARGET("sse2")
+    inline void likelihoodKernelSSE2(const LikelihoodArgs &a) { likelihoodKernel<v2d>(a); }
+
+    SIMD_TARGET("avx2")
+    inline void likelihoodKernelAVX2(const LikelihoodArgs &a) { likelihoodKernel<v4d>(a); }
+
+    SIMD_TARGET("avx512f")
+    inline void likelihoodKernelAVX512(const LikelihoodArgs &a) { likelihoodKernel<v8d>(a); }
+#endif
+}
+
+/**
+ * @brief 命令セットに対応する尤度のカーネルを返す
+ */
+inline LikelihoodKernel getLikelihoodKernel(SimdIsa isa)
+{
+#ifdef SIMD_X86
+    switch (isa) {
+        case ISA_SSE2:   return simd::likelihoodKernelSSE2;
+        case ISA_AVX2:   return simd::likelihoodKernelAVX2;
+        case ISA_AVX512: return simd::likelihoodKernelAVX512;
+        default:         break;
+    }
+#endif
+    return simd::likelihoodKernelScalar;
+}
+
+class MotionLikelihood
+{
+    public:
+        explicit MotionLikelihood(const MotionParam &p = MotionParam());
+
+        void setParam(const MotionParam &p);
+        const MotionParam &getParam() const;
+
+        /**
+         * @brief 使う命令セットを指定する（既定値は detectSimdIsa() の結果）
+         */
+        void setSimdIsa(SimdIsa isa_);
+
+        /**
+         * @brief 組が多いときに BLOCK 組ずつ分担させるスレッドプール（nullptr なら1スレッド）
+         */
+        void setThreadPool(std::shared_ptr<ThreadPool> p);
+
+        /**
+         * @brief n 組の姿勢について log p(x1 | v, w, x0) を out に求める
+         * @param dt 時間刻み [s]（0 より大きいこと）
+         */
+        void evaluate(double v, double w, double dt,
+                      const double *x0, const double *y0, const double *th0,
+                      const double *x1, const double *y1, const double *th1, int n, double *out) const;
+
+        /**
+         * @brief 移動前後の集合（RobotBatch や Snapshot）の同じ番号どうしの対数尤度
+         */
+        template <typename T>
+        void evaluate(double v, double w, double dt, const T &before, const T &after, double *out) const;
+
+        /**
+         * @brief 1組だけの対数尤度
+         */
+        double evaluate(double v, double w, double dt,
+                        double x0, double y0, double th0, double x1, double y1, double th1) const;
+
+    private:
+        static const int BLOCK = 4096;      //!< スレッドに分ける単位
+
+        MotionParam param;
+        LikelihoodKernel kernel;
+        std::shared_ptr<ThreadPool> pool;
+
+        LikelihoodArgs makeArgs(double v, double w, double dt) const;
+};
+
+MotionLikelihood::MotionLikelihood(const MotionParam &p)
+    : param(p)
+{
+    setSimdIsa(detectSimdIsa());
+}
+
+void MotionLikelihood::setParam(const MotionParam &p)
+{
+    param = p;
+}
+
+const MotionParam &MotionLikelihood::getParam() const
+{
+    return param;
+}
+
+void MotionLikelihood::setSimdIsa(SimdIsa isa_)
+{
+    kernel = getLikelihoodKernel(isa_);
+}
+
+void MotionLikelihood::setThreadPool(std::shared_ptr<ThreadPool> p)
+{
+    pool = p;
+}
+
+// 指令ごとに決まる定数（誤差の標準偏差は標本を作る側と同じ getStd() から）
+LikelihoodArgs MotionLikelihood::makeArgs(double v, double w, double dt) const
+{
+    LikelihoodArgs a;
+    a.v = v;
+    a.w = w;
+    a.dt = dt;
+
+    double sd[3];
+    param.getStd(v, w, sd[0], sd[1], sd[2]);
+    double k[3];
+    bool delta[3];
+    a.c = 0.0;
+    for (int j = 0; j < 3; j++) {
+        delta[j] = (sd[j] == 0.0);
+        k[j] = delta[j] ? 0.0 : -0.5 / (sd[j] * sd[j]);
+        if (!delta[j]) a.c -= log(sd[j]) + 0.5 * log(2.0 * M_PI);
+    }
+    a.kv = k[0];
+    a.kw = k[1];
+    a.kr = k[2];
+    a.dv = delta[0];
+    a.dw = delta[1];
+    a.dr = delta[2];
+    return a;
+}
+
+void MotionLikelihood::evaluate(double v, double w, double dt,
+                                const double *x0, const double *y0, const double *th0,
+                                const double *x1, const double *y1, const double *th1, int n, double *out) const
+{
+    if (n <= 0) return;
+    PROBE_SCOPE("likelihood");
+    LikelihoodArgs a = makeArgs(v, w, dt);
+
+    auto block = [&](int k, int) {
+        LikelihoodArgs b = a;
+        int i0 = k * BLOCK;
+        b.n = std::min(BLOCK, n - i0);
+        b.x0 = x0 + i0;
+        b.y0 = y0 + i0;
+        b.th0 = th0 + i0;
+        b.x1 = x1 + i0;
+        b.y1 = y1 + i0;
+        b.th1 = th1 + i0;
+        b.out = out + i0;
+        kernel(b);
+    };
+    int nBlock = (n + BLOCK - 1) / BLOCK;
+    if (pool && nBlock > 1) {
+        pool->parallelFor(nBlock, block);
+    } else {
+        for (int k = 0; k < nBlock; k++) block(k, 0);
+    }
+}
+
+template <typename T>
+void MotionLikelihood::evaluate(double v, double w, double dt, const T &before, const T &after, double *out) const
+{
+    evaluate(v, w, dt, before.getXData(), before.getYData(), before.getThData(),
+             after.getXData(), after.getYData(), after.getThData(), std::min(before.size(), after.size()), out);
+}
+
+double MotionLikelihood::evaluate(double v, double w, double dt,
+                                  double x0, double y0, double th0, double x1, double y1, double th1) const
+{
+    double out;
+    evaluate(v, w, dt, &x0, &y0, &th0, &x1, &y1, &th1, 1, &out);
+    return out;
+}
+
+#endif
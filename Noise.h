@@ -0,0 +1,429 @@
+/**
+ * @file Noise.h
+ * @brief 動作モデルの誤差（正規乱数）をまとめて生成する
+ * @author Kazumichi INOUE <k.inoue@oyama-ct.ac.jp>
+ *
+ * Robot.h の sample() は一様乱数を12個足して正規乱数の近似を1つ作る．
+ * ここでは配列単位で標準正規乱数を作り，分散は呼び出し側（カーネル）で掛ける．
+ * 生成方法は Ziggurat 法，Box-Muller 法（SIMD），従来の12個和の3通り．
+ *
+ * 一様乱数の元はカウンタ方式の Philox4x32-10 で，(種, ロボット番号, ステップ数) から
+ * 直接計算する．状態を持たないので，スレッドやSIMDのレーンへの割り振り方が
+ * 変わっても各ロボットの誤差は同じになり，同じ種なら結果は毎回一致する．
+ */
+
+#ifndef __NOISE_H__
+#define __NOISE_H__
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+
+#include "SimdMath.h"
+
+/**
+ * @brief 速度動作モデルの誤差パラメータ
+ * @details Robot，RobotBatch（標本を作る側）と MotionLikelihood（尤度を求める側）で共通に使う
+ */
+struct MotionParam
+{
+    double a1;
+    double a2;
+    double a3;
+    double a4;
+    double a5;
+    double a6;
+
+    MotionParam() : a1(0.1), a2(0.01), a3(0.001), a4(0.01), a5(0.05), a6(0.01) {}
+
+    /**
+     * @brief 速度指令 (v, w) に対する誤差の分散（Robot.h の sample() に渡す値）
+     * @param vv 並進速度の誤差  a1 v^2 + a2 w^2
+     * @param vw 角速度の誤差    a3 v^2 + a4 w^2
+     * @param vr 最終回転の誤差  a5 v^2 + a6 w^2
+     */
+    void getVariance(double v, double w, double &vv, double &vw, double &vr) const
+    {
+        vv = a1 * v * v + a2 * w * w;
+        vw = a3 * v * v + a4 * w * w;
+        vr = a5 * v * v + a6 * w * w;
+    }
+
+    /**
+     * @brief 速度指令 (v, w) に対する誤差の標準偏差（getVariance() の平方根）
+     * @details 標本を作る側（Robot, RobotBatch）も尤度を求める側（MotionLikelihood）もこれを使う
+     */
+    void getStd(double v, double w, double &sv, double &sw, double &sr) const
+    {
+        getVariance(v, w, sv, sw, sr);
+        sv = sqrt(sv);
+        sw = sqrt(sw);
+        sr = sqrt(sr);
+    }
+};
+
+/**
+ * @brief 正規乱数の生成方法
+ */
+enum NoiseMode
+{
+    NOISE_ZIGGURAT = 0,     //!< Ziggurat 法
+    NOISE_BOX_MULLER,       //!< Box-Muller 法．変換部分をSIMDで計算する（既定）
+    NOISE_LEGACY            //!< Robot.h の sample() と同じ一様乱数12個の和
+};
+
+/**
+ * @brief Philox4x32-10 の1ブロック（32bit × 4）を計算する
+ * @details Salmon et al., "Parallel random numbers: as easy as 1, 2, 3" (SC'11)
+ */
+inline void philox4x32(const uint32_t ctr[4], const uint32_t key[2], uint32_t out[4])
+{
+    uint32_t c0 = ctr[0], c1 = ctr[1], c2 = ctr[2], c3 = ctr[3];
+    uint32_t k0 = key[0], k1 = key[1];
+    for (int r = 0; r < 10; r++) {
+        uint64_t p0 = (uint64_t)c0 * 0xD2511F53u;
+        uint64_t p1 = (uint64_t)c2 * 0xCD9E8D57u;
+        uint32_t n0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+        uint32_t n2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+        c1 = (uint32_t)p1;
+        c3 = (uint32_t)p0;
+        c0 = n0;
+        c2 = n2;
+        k0 += 0x9E3779B9u;
+        k1 += 0xBB67AE85u;
+    }
+    out[0] = c0; out[1] = c1; out[2] = c2; out[3] = c3;
+}
+
+/**
+ * @brief 1台・1ステップぶんの乱数列
+ * @details カウンタは (ロボット番号, ブロック番号, ステップ数の下位, 上位)．
+ *          Ziggurat 法や12個和のように必要な数が決まっていない生成方法で使う
+ */
+class PhiloxStream
+{
+    private:
+        uint32_t key[2];
+        uint32_t ctr[4];
+        uint32_t buf[4];
+        int pos;
+
+    public:
+        PhiloxStream(uint64_t seed, uint32_t index, uint64_t step)
+        {
+            key[0] = (uint32_t)seed;
+            key[1] = (uint32_t)(seed >> 32);
+            ctr[0] = index;
+            ctr[1] = 0;
+            ctr[2] = (uint32_t)step;
+            ctr[3] = (uint32_t)(step >> 32);
+            pos = 4;
+        }
+
+        uint32_t next()
+        {
+            if (pos == 4) {
+                philox4x32(ctr, key, buf);
+                ctr[1]++;
+                pos = 0;
+            }
+            return buf[pos++];
+        }
+
+        // (0, 1) の一様乱数
+        double uniform()
+        {
+            return (next() + 0.5) * (1.0 / 4294967296.0);
+        }
+};
+
+/**
+ * @brief 正規乱数カーネルに渡す引数
+ */
+struct NoiseArgs
+{
+    uint64_t seed;
+    uint64_t step;          //!< ステップ数
+    uint32_t index0;        //!< 先頭のロボット番号
+    int n;                  //!< 台数
+    double *n0, *n1, *n2;   //!< 1台あたり3つの標準正規乱数の出力先
+};
+
+typedef void (*NoiseKernel)(const NoiseArgs &a);
+
+namespace simd
+{
+    // 各レーンに32bit値を入れて Philox4x32-10 を計算する
+    template <typename U>
+    inline void philox(U &c0, U &c1, U &c2, U &c3, uint32_t k0, uint32_t k1)
+    {
+        for (int r = 0; r < 10; r++) {
+            U p0 = c0 * 0xD2511F53u;
+            U p1 = c2 * 0xCD9E8D57u;
+            U n0 = (p1 >> 32) ^ c1 ^ k0;
+            U n2 = (p0 >> 32) ^ c3 ^ k1;
+            c1 = p1 & 0xffffffffu;
+            c3 = p0 & 0xffffffffu;
+            c0 = n0;
+            c2 = n2;
+            k0 += 0x9E3779B9u;
+            k1 += 0xBB67AE85u;
+        }
+    }
+
+    // 32bit 整数 k から (0, 1) の一様乱数 (k + 0.5) / 2^32 を作る
+    template <typename V>
+    inline V toUniform(typename Traits<V>::U k)
+    {
+        typedef typename Traits<V>::U U;
+        V d = (V)(k | (U{} + 0x4330000000000000ULL)) - 4503599627370496.0;   // 2^52 を使った整数→実数変換
+        return (d + 0.5) * (1.0 / 4294967296.0);
+    }
+
+    // W 台ぶんの正規乱数を Box-Muller 法で作る．1台につき Philox 1ブロック（一様乱数4つ）を使う
+    template <typename V>
+    inline void noiseBlock(const NoiseArgs &a, int i, double *n0, double *n1, double *n2)
+    {
+        typedef typename Traits<V>::U U;
+
+        U c0, c1, c2, c3;
+        for (int k = 0; k < Traits<V>::W; k++) c0[k] = (uint32_t)(a.index0 + i + k);
+        c1 = U{};
+        c2 = U{} + (uint32_t)a.step;
+        c3 = U{} + (uint32_t)(a.step >> 32);
+        philox(c0, c1, c2, c3, (uint32_t)a.seed, (uint32_t)(a.seed >> 32));
+
+        V r1 = vsqrt(-2.0 * log(toUniform<V>(c0)));
+        V r2 = vsqrt(-2.0 * log(toUniform<V>(c2)));
+        V s1, co1, s2, co2;
+        sincos(2.0 * M_PI * toUniform<V>(c1), s1, co1);
+        sincos(2.0 * M_PI * toUniform<V>(c3), s2, co2);
+        store(n0, r1 * co1);
+        store(n1, r1 * s1);
+        store(n2, r2 * co2);
+    }
+
+    template <typename V>
+    inline void noiseKernel(const NoiseArgs &a)
+    {
+        const int W = Traits<V>::W;
+        int i = 0;
+        for (; i + W <= a.n; i += W) {
+            noiseBlock<V>(a, i, a.n0 + i, a.n1 + i, a.n2 + i);
+        }
+
+        int rest = a.n - i;
+        if (rest > 0) {
+            double buf[3][W];
+            noiseBlock<V>(a, i, buf[0], buf[1], buf[2]);
+            memcpy(a.n0 + i, buf[0], rest * sizeof(double));
+            memcpy(a.n1 + i, buf[1], rest * sizeof(double));
+            memcpy(a.n2 + i, buf[2], rest * sizeof(double));
+        }
+    }
+
+    __attribute__((flatten))
+    inline void noiseKernelScalar(const NoiseArgs &a) { noiseKernel<v1d>(a); }
+
+#ifdef SIMD_X86
+    SIMD_TARGET("sse2")
+    inline void noiseKernelSSE2(const NoiseArgs &a) { noiseKernel<v2d>(a); }
+
+    SIMD_TARGET("avx2")
+    inline void noiseKernelAVX2(const NoiseArgs &a) { noiseKernel<v4d>(a); }
+
+    SIMD_TARGET("avx512f")
+    inline void noiseKernelAVX512(const NoiseArgs &a) { noiseKernel<v8d>(a); }
+#endif
+}
+
+/**
+ * @brief 命令セットに対応する Box-Muller カーネルを返す
+ */
+inline NoiseKernel getNoiseKernel(SimdIsa isa)
+{
+#ifdef SIMD_X86
+    switch (isa) {
+        case ISA_SSE2:   return simd::noiseKernelSSE2;
+        case ISA_AVX2:   return simd::noiseKernelAVX2;
+        case ISA_AVX512: return simd::noiseKernelAVX512;
+        default:         break;
+    }
+#endif
+    return simd::noiseKernelScalar;
+}
+
+/**
+ * @brief Ziggurat 法の表（Doornik の ZIGNOR, 128層）
+ */
+struct ZigguratTable
+{
+    static const int C = 128;
+    double X[C + 1];
+    double R[C];
+
+    ZigguratTable()
+    {
+        const double r = 3.442619855899;        // 最下層の右端
+        const double v = 9.91256303526217e-3;   // 各層の面積
+        double f = exp(-0.5 * r * r);
+        X[0] = v / f;
+        X[1] = r;
+        X[C] = 0.0;
+        for (int i = 2; i < C; i++) {
+            X[i] = sqrt(-2.0 * log(v / X[i - 1] + f));
+            f = exp(-0.5 * X[i] * X[i]);
+        }
+        for (int i = 0; i < C; i++) R[i] = X[i + 1] / X[i];
+    }
+
+    static const ZigguratTable &get()
+    {
+        static const ZigguratTable table;
+        return table;
+    }
+};
+
+/**
+ * @brief 動作モデル用の標準正規乱数を配列単位で生成するクラス
+ * @details 1台・1ステップにつき3つ（v, w, 最終回転）の乱数を作る．
+ *          値は (種, ロボット番号, ステップ数) だけで決まる
+ */
+class GaussianNoise
+{
+    public:
+        /**
+         * @brief コンストラクタ．時刻から種を決める
+         */
+        GaussianNoise();
+
+        /**
+         * @brief 乱数の種を設定する
+         */
+        void seed(uint64_t s);
+        uint64_t getSeed() const;
+
+        void setMode(NoiseMode m);
+        NoiseMode getMode() const;
+
+        /**
+         * @brief Box-Muller 法の計算に使う命令セットを指定する
+         */
+        void setSimdIsa(SimdIsa isa);
+
+        /**
+         * @brief ロボット index0 〜 index0+n-1 の step 番目の乱数を作る
+         * @param n0, n1, n2 出力先（それぞれ n 個）
+         */
+        void fill(uint64_t step, uint32_t index0, int n, double *n0, double *n1, double *n2) const;
+
+    private:
+        uint64_t seed_;
+        NoiseMode mode;
+        NoiseKernel kernel;     //!< Box-Muller 法のカーネル
+
+        static double ziggurat(PhiloxStream &r);
+        static double legacy(PhiloxStream &r);
+};
+
+GaussianNoise::GaussianNoise()
+{
+    mode = NOISE_BOX_MULLER;
+    setSimdIsa(detectSimdIsa());
+    seed(std::chrono::steady_clock::now().time_since_epoch().count());
+}
+
+void GaussianNoise::seed(uint64_t s)
+{
+    seed_ = s;
+}
+
+uint64_t GaussianNoise::getSeed() const
+{
+    return seed_;
+}
+
+void GaussianNoise::setMode(NoiseMode m)
+{
+    mode = m;
+}
+
+NoiseMode GaussianNoise::getMode() const
+{
+    return mode;
+}
+
+void GaussianNoise::setSimdIsa(SimdIsa isa)
+{
+    kernel = getNoiseKernel(isa);
+}
+
+double GaussianNoise::ziggurat(PhiloxStream &r)
+{
+    const ZigguratTable &z = ZigguratTable::get();
+    for (;;) {
+        uint32_t b0 = r.next();
+        uint32_t b1 = r.next();
+        int i = b0 & 0x7f;                                          // 層の番号（下位7bit）
+        uint64_t m = ((uint64_t)b1 << 21) | (b0 >> 11);             // 残りの53bit
+        double u = 2.0 * (m * (1.0 / 9007199254740992.0)) - 1.0;
+
+        if (fabs(u) < z.R[i]) return u * z.X[i];
+
+        if (i == 0) {
+            // 裾の部分
+            double x, y;
+            do {
+                x = log(r.uniform()) / z.X[1];
+                y = log(r.uniform());
+            } while (-2.0 * y < x * x);
+            return (u < 0) ? x - z.X[1] : z.X[1] - x;
+        }
+
+        double x = u * z.X[i];
+        double f0 = exp(-0.5 * (z.X[i] * z.X[i] - x * x));
+        double f1 = exp(-0.5 * (z.X[i + 1] * z.X[i + 1] - x * x));
+        if (f1 + r.uniform() * (f0 - f1) < 1.0) return x;
+    }
+}
+
+double GaussianNoise::legacy(PhiloxStream &r)
+{
+    // sample(1.0) と同じ．(-1, 1) の一様乱数12個の和の半分は分散1になる
+    double sum = 0.0;
+    for (int i = 0; i < 12; i++) {
+        sum += 2.0 * r.uniform() - 1.0;
+    }
+    return 0.5 * sum;
+}
+
+void GaussianNoise::fill(uint64_t step, uint32_t index0, int n, double *n0, double *n1, double *n2) const
+{
+    if (mode == NOISE_BOX_MULLER) {
+        NoiseArgs a;
+        a.seed = seed_;
+        a.step = step;
+        a.index0 = index0;
+        a.n = n;
+        a.n0 = n0;
+        a.n1 = n1;
+        a.n2 = n2;
+        kernel(a);
+        return;
+    }
+
+    for (int i = 0; i < n; i++) {
+        PhiloxStream r(seed_, index0 + i, step);
+        if (mode == NOISE_ZIGGURAT) {
+            n0[i] = ziggurat(r);
+            n1[i] = ziggurat(r);
+            n2[i] = ziggurat(r);
+        } else {
+            n0[i] = legacy(r);
+            n1[i] = legacy(r);
+            n2[i] = legacy(r);
+        }
+    }
+}
+
+#endif
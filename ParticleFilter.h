@@ -0,0 +1,508 @@
+/**
+ * @file ParticleFilter.h
+ * @brief RobotBatch に重みと再標本化（リサンプリング）を加えたパーティクルフィルタ
+ * @author Kazumichi INOUE <k.inoue@oyama-ct.ac.jp>
+ *
+ * 予測は getParticles() の RobotBatch を move() / advance() で進める．観測や動作モデルの
+ * 尤度（MotionLikelihood）は対数のまま addLogWeight() で重みに足し，normalize() で
+ * log-sum-exp により正規化する．そのとき有効サンプル数（ESS）も求める．
+ *
+ * 再標本化は系統（低分散）サンプリングで行う．u を [0, 1) の一様乱数1つとして
+ * j 番目の標本を (j + u) / N の位置で選ぶと，i 番目の粒子の複製数は累積重み c_i から
+ *   K(c) = ceil(N c - u),  n_i = K(c_i) - K(c_{i-1})
+ * と粒子ごとに独立に決まる．累積重みは塊（BLOCK 個）ごとの部分和の前置和（prefix sum）で並列に求める．
+ * 複製は配列の中で行う．複製数1以上の粒子はその場に残し，余った複製を複製数0の粒子の場所に
+ * 書き込むので，読む場所と書く場所が重ならず，並列に書いても結果は同じになる．
+ * 作業用の配列は粒子数を変えたときだけ確保し直し，更新のたびには確保しない．
+ * 粒子の並び順は変わる．乱数は種と再標本化の回数で決まるので，結果はスレッド数によらない．
+ *
+ * enableAdaptive() を呼ぶと，再標本化のたびに粒子数を KLD サンプリング（KldSampling.h）で決め直す．
+ * 今の粒子数で再標本化したときに残る粒子の格子の数 k から粒子数 M を求め，M 個を引き直す．
+ * 出力先を先頭の M 個とし，M 個より後ろに残る粒子は全ての複製を前の空き場所に書くので，
+ * 増やすときも減らすときも同じ手順で配列の中で済む．配列は上限の数で先に確保しておく．
+ */
+
+#ifndef __PARTICLE_FILTER_H__
+#define __PARTICLE_FILTER_H__
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "KldSampling.h"
+#include "Noise.h"
+#include "Probe.h"
+#include "RobotBatch.h"
+#include "ThreadPool.h"
+
+class ParticleFilter
+{
+    public:
+        /**
+         * @brief コンストラクタ
+         * @param n 粒子数．全員原点・向き0，重みは一様
+         */
+        explicit ParticleFilter(int n = 0);
+
+        /**
+         * @brief 粒子数を変更する．重みは一様に戻す
+         */
+        void resize(int n);
+        int size() const;
+
+        /**
+         * @brief 粒子の集合（予測はこれを move() / advance() で進める）
+         */
+        RobotBatch &getParticles();
+        const RobotBatch &getParticles() const;
+
+        /**
+         * @brief 正規化と再標本化を分担するスレッドプール（粒子の集合にも同じものを渡す）
+         */
+        void setThreadPool(std::shared_ptr<ThreadPool> p);
+
+        /**
+         * @brief 乱数の種を設定する（粒子の集合の種も同じ値にする）
+         */
+        void seed(uint64_t s);
+
+        /**
+         * @brief 全粒子の重みを一様にする（w = 1/N, logw = -log N）
+         */
+        void resetWeights();
+
+        /**
+         * @brief 対数尤度を重みに足す（logw[i] += logL[i]）
+         */
+        void addLogWeight(const double *logL);
+
+        /**
+         * @brief 対数の重みの配列（直接書き換えたら normalize() を呼ぶこと）
+         */
+        double *getLogWeightData();
+        const double *getLogWeightData() const;
+
+        /**
+         * @brief 正規化した重みの配列（和が1．normalize() の後で有効）
+         */
+        const double *getWeightData() const;
+        double getWeight(int i) const;
+
+        /**
+         * @brief 重みを log-sum-exp で正規化し，有効サンプル数を求める
+         * @return 正規化する前の重みの和の対数（前回正規化してから足した尤度の周辺化）
+         * @details 全ての重みが -∞ のときは一様に戻して -∞ を返す
+         */
+        double normalize();
+
+        /**
+         * @brief 有効サンプル数 1 / Σ w_i^2（normalize() の後で有効）
+         */
+        double getEss() const;
+
+        /**
+         * @brief 系統サンプリングで再標本化し，重みを一様にする
+         */
+        void resample();
+
+        /**
+         * @brief 有効サンプル数が粒子数の ratio 倍を下回っていれば再標本化する
+         * @return 再標本化したか
+         */
+        bool resampleIfNeeded(double ratio = 0.5);
+
+        /**
+         * @brief これまでに再標本化した回数
+         */
+        uint64_t getResampleCount() const;
+
+        /**
+         * @brief 再標本化のたびに粒子数を KLD サンプリングで決め直す
+         * @details 粒子と作業領域は p.maxParticles 個ぶん確保し，以後は確保し直さない．
+         *          重みが一様なら（尤度を足していなければ）分布を変えずに粒子数だけを変える
+         */
+        void enableAdaptive(const KldParam &p);
+
+        /**
+         * @brief 粒子数を固定に戻す
+         */
+        void disableAdaptive();
+        bool isAdaptive() const;
+
+        /**
+         * @brief 最後に粒子数を決めたときの格子の数
+         */
+        int getNumBins() const;
+
+    private:
+        static const int BLOCK = 4096;      //!< 並列に処理する単位
+
+        typedef RobotBatch::Array Array;
+
+        RobotBatch particles;
+        Array logw;             //!< 対数の重み
+        Array w;                //!< 正規化した重み
+        double ess;
+        bool normalized;        //!< w が logw に対応しているか
+
+        uint64_t resampleSeed;
+        uint64_t resampleCount;
+
+        std::shared_ptr<ThreadPool> pool;
+
+        bool adaptive;
+        KldParam kld;
+        KldBins bins;
+
+        // 作業領域（粒子数を変えたときだけ確保し直す）
+        std::vector<int> copies;            //!< 粒子ごとの複製数
+        std::vector<int> freeSlot;          //!< 複製数0の粒子の番号（書き込み先）
+        std::vector<double> blockMax, blockSum, blockSum2;
+        std::vector<int> blockFree, blockExtra;
+
+        int numBlocks(int n) const;
+        template <typename F> void forEachBlock(int n, const F &f);
+        void reserve(int n);
+        void countCopies(int n, int m, double u);
+        int countBins(int n);
+};
+
+ParticleFilter::ParticleFilter(int n)
+    : particles(n), ess(n), normalized(true), resampleSeed(0), resampleCount(0), adaptive(false)
+{
+    resize(n);
+}
+
+void ParticleFilter::resize(int n)
+{
+    particles.resize(n);
+    logw.resize(n);
+    w.resize(n);
+    reserve(n);
+    resetWeights();
+}
+
+// n 個まで作業領域を確保し直さずに済むようにする
+void ParticleFilter::reserve(int n)
+{
+    particles.reserve(n);
+    logw.reserve(n);
+    w.reserve(n);
+    if ((int)copies.size() < n) {
+        copies.resize(n);
+        freeSlot.resize(n);
+    }
+    int nb = numBlocks(n);
+    if ((int)blockMax.size() >= nb) return;
+    blockMax.resize(nb);
+    blockSum.resize(nb);
+    blockSum2.resize(nb);
+    blockFree.resize(nb);
+    blockExtra.resize(nb);
+}
+
+int ParticleFilter::size() const
+{
+    return particles.size();
+}
+
+RobotBatch &ParticleFilter::getParticles()
+{
+    return particles;
+}
+
+const RobotBatch &ParticleFilter::getParticles() const
+{
+    return particles;
+}
+
+void ParticleFilter::setThreadPool(std::shared_ptr<ThreadPool> p)
+{
+    pool = p;
+    if (p) particles.setThreadPool(p);
+    else   particles.setNumThreads(1);
+}
+
+void ParticleFilter::seed(uint64_t s)
+{
+    particles.seed(s);
+    resampleSeed = s;
+    resampleCount = 0;
+}
+
+void ParticleFilter::resetWeights()
+{
+    int n = size();
+    std::fill(logw.begin(), logw.end(), n > 0 ? -log((double)n) : 0.0);
+    std::fill(w.begin(), w.end(), n > 0 ? 1.0 / n : 0.0);
+    ess = n;
+    normalized = true;
+}
+
+void ParticleFilter::addLogWeight(const double *logL)
+{
+    int n = size();
+    for (int i = 0; i < n; i++) logw[i] += logL[i];
+    normalized = false;
+}
+
+double *ParticleFilter::getLogWeightData()
+{
+    normalized = false;
+    return logw.data();
+}
+
+const double *ParticleFilter::getLogWeightData() const
+{
+    return logw.data();
+}
+
+const double *ParticleFilter::getWeightData() const
+{
+    return w.data();
+}
+
+double ParticleFilter::getWeight(int i) const
+{
+    return w[i];
+}
+
+int ParticleFilter::numBlocks(int n) const
+{
+    return (n + BLOCK - 1) / BLOCK;
+}
+
+// [0, n) を塊に分けて f(塊の番号, 先頭, 末尾) を呼ぶ．プールがあれば並列に（f はコピーしない）
+template <typename F>
+void ParticleFilter::forEachBlock(int n, const F &f)
+{
+    int nb = numBlocks(n);
+    auto block = [&](int b, int) { f(b, b * BLOCK, std::min(n, (b + 1) * BLOCK)); };
+    if (pool && nb > 1) {
+        pool->parallelFor(nb, block);
+    } else {
+        for (int b = 0; b < nb; b++) block(b, 0);
+    }
+}
+
+double ParticleFilter::normalize()
+{
+    int n = size();
+    if (n == 0) return 0.0;
+    PROBE_SCOPE("normalize");
+    int nb = numBlocks(n);
+
+    // 最大値（exp のあふれを防ぐ）
+    forEachBlock(n, [&](int b, int i0, int i1) {
+        double m = -INFINITY;
+        for (int i = i0; i < i1; i++) m = std::max(m, logw[i]);
+        blockMax[b] = m;
+    });
+    double m = -INFINITY;
+    for (int b = 0; b < nb; b++) m = std::max(m, blockMax[b]);
+    if (!(m > -INFINITY)) {
+        resetWeights();
+        return -INFINITY;
+    }
+
+    // exp(logw - m) とその和・2乗和（塊の順に足すのでスレッド数によらず同じ値）
+    forEachBlock(n, [&](int b, int i0, int i1) {
+        double s = 0.0, s2 = 0.0;
+        for (int i = i0; i < i1; i++) {
+            double e = exp(logw[i] - m);
+            w[i] = e;
+            s += e;
+            s2 += e * e;
+        }
+        blockSum[b] = s;
+        blockSum2[b] = s2;
+    });
+    double sum = 0.0, sum2 = 0.0;
+    for (int b = 0; b < nb; b++) {
+        sum += blockSum[b];
+        sum2 += blockSum2[b];
+    }
+
+    double logSum = m + log(sum);
+    double inv = 1.0 / sum;
+    forEachBlock(n, [&](int, int i0, int i1) {
+        for (int i = i0; i < i1; i++) {
+            w[i] *= inv;
+            logw[i] -= logSum;
+        }
+    });
+    ess = sum * sum / sum2;
+    normalized = true;
+    return logSum;
+}
+
+double ParticleFilter::getEss() const
+{
+    return ess;
+}
+
+bool ParticleFilter::resampleIfNeeded(double ratio)
+{
+    if (!normalized) normalize();
+    if (ess >= ratio * size()) return false;
+    resample();
+    return true;
+}
+
+uint64_t ParticleFilter::getResampleCount() const
+{
+    return resampleCount;
+}
+
+void ParticleFilter::enableAdaptive(const KldParam &p)
+{
+    kld = p;
+    bins.setParam(p);
+    bins.reserve(p.maxParticles);
+    reserve(std::max(size(), p.maxParticles));
+    adaptive = true;
+}
+
+void ParticleFilter::disableAdaptive()
+{
+    adaptive = false;
+}
+
+bool ParticleFilter::isAdaptive() const
+{
+    return adaptive;
+}
+
+int ParticleFilter::getNumBins() const
+{
+    return bins.count();
+}
+
+// n 個の粒子から m 個を引くときの複製数．blockSum に塊の手前までの重みの和が入っていること．
+// K(c) = ceil(m c - u) を [0, m] に収め，最後の粒子の累積は m とする．
+// 累積は「塊の手前までの和 + 塊の中の和」で求めるので，塊の末尾と次の塊の先頭で一致する．
+// 先頭 m 個のうち複製数0の場所（n 個より後ろを含む）が書き込み先になり，
+// 先頭 m 個の粒子は1つをその場に残し，後ろの粒子は全ての複製を書き込み先に移す
+void ParticleFilter::countCopies(int n, int m, double u)
+{
+    auto K = [&](double c) {
+        double k = ceil(m * c - u);
+        return (int)std::min<double>(m, std::max(0.0, k));
+    };
+    forEachBlock(std::max(n, m), [&](int b, int i0, int i1) {
+        double s = 0.0;
+        int prev = (i0 < n) ? K(blockSum[b]) : m;
+        int nFree = 0, nExtra = 0;
+        for (int i = i0; i < i1; i++) {
+            int c = 0;
+            if (i < n) {
+                s += w[i];
+                int k = (i == n - 1) ? m : K(blockSum[b] + s);
+                c = k - prev;
+                prev = k;
+            }
+            copies[i] = c;
+            if (c == 0) {
+                if (i < m) nFree++;
+            } else {
+                nExtra += (i < m) ? c - 1 : c;
+            }
+        }
+        blockFree[b] = nFree;
+        blockExtra[b] = nExtra;
+    });
+}
+
+// 複製数1以上の粒子が入っている格子の数（表は1つなので1スレッドで数える）
+int ParticleFilter::countBins(int n)
+{
+    PROBE_SCOPE("kld_bins");
+    const double *x = particles.getXData();
+    const double *y = particles.getYData();
+    const double *th = particles.getThData();
+    bins.clear();
+    for (int i = 0; i < n; i++) {
+        if (copies[i] > 0) bins.insert(x[i], y[i], th[i]);
+    }
+    return bins.count();
+}
+
+void ParticleFilter::resample()
+{
+    int n = size();
+    if (n == 0) return;
+    if (!normalized) normalize();
+    PROBE_SCOPE("resample");
+
+    // 位置のずらし u は種と回数で決める（番号 0xffffffff は粒子の乱数と重ならない）
+    PhiloxStream rng(resampleSeed, 0xffffffffu, resampleCount);
+    double u = rng.uniform();
+    resampleCount++;
+
+    // 1. 塊ごとの重みの和の前置和
+    forEachBlock(n, [&](int b, int i0, int i1) {
+        double s = 0.0;
+        for (int i = i0; i < i1; i++) s += w[i];
+        blockSum[b] = s;
+    });
+    double off = 0.0;
+    for (int b = 0; b < numBlocks(n); b++) {
+        double s = blockSum[b];
+        blockSum[b] = off;              // 塊の手前までの和
+        off += s;
+    }
+
+    // 2. 複製数．粒子数を決め直すときは，今の数で引いたときに残る粒子の格子から数を決めて引き直す
+    int m = n;
+    countCopies(n, m, u);
+    if (adaptive) {
+        m = kld.getParticleCount(countBins(n));
+        if (m != n) {
+            reserve(m);
+            countCopies(n, m, u);
+        }
+    }
+    int len = std::max(n, m);
+    int accFree = 0, accExtra = 0;
+    for (int b = 0; b < numBlocks(len); b++) {
+        int f = blockFree[b], e = blockExtra[b];
+        blockFree[b] = accFree;
+        blockExtra[b] = accExtra;
+        accFree += f;
+        accExtra += e;
+    }
+    if (m > n) particles.resize(m);
+    double *x = particles.getXData();
+    double *y = particles.getYData();
+    double *th = particles.getThData();
+
+    // 3. 書き込み先（先頭 m 個のうち複製数0の場所）の一覧
+    forEachBlock(len, [&](int b, int i0, int i1) {
+        int k = blockFree[b];
+        for (int i = i0; i < std::min(i1, m); i++) {
+            if (copies[i] == 0) freeSlot[k++] = i;
+        }
+    });
+
+    // 4. 複製を書き込む．読むのは複製数1以上，書くのは複製数0の場所なので重ならない
+    forEachBlock(len, [&](int b, int i0, int i1) {
+        int k = blockExtra[b];
+        for (int i = i0; i < i1; i++) {
+            for (int r = (i < m) ? 1 : 0; r < copies[i]; r++) {
+                int d = freeSlot[k++];
+                x[d] = x[i];
+                y[d] = y[i];
+                th[d] = th[i];
+            }
+        }
+    });
+
+    if (m < n) particles.resize(m);
+    logw.resize(m);
+    w.resize(m);
+    resetWeights();
+}
+
+#endif
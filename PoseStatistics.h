@@ -0,0 +1,415 @@
+/**
+ * @file PoseStatistics.h
+ * @brief 姿勢 (x, y, θ) の平均と共分散を1パスで求める集計器
+ * @author Kazumichi INOUE <k.inoue@oyama-ct.ac.jp>
+ *
+ * Welford 法で1台ずつ，または配列の塊ごとに足し込み，塊どうしは Chan の式で合成する．
+ * 合成できるので，スレッドごと・塊ごとに集計して最後にまとめればよい．
+ * 向き θ は角度なので，平均は cos/sin の和から求め（円周統計），分散・共分散は
+ * 基準の向きとの差を (-π, π] に折り返した値で計算する．
+ *
+ * 塊の集計は SIMD カーネルで行う．部分和は命令セットによらず8本に分けて同じ順序で
+ * 足すので，どの命令セットでも結果は一致する．
+ */
+
+#ifndef __POSE_STATISTICS_H__
+#define __POSE_STATISTICS_H__
+
+#include <cmath>
+
+#include "Probe.h"
+#include "SimdMath.h"
+
+/**
+ * @brief 塊の集計カーネルに渡す引数と結果
+ */
+struct MomentArgs
+{
+    const double *x, *y, *th;           //!< 姿勢の配列
+    int n;                              //!< 要素数（1以上）
+    double ref;                         //!< θ の差をとる基準の向き
+    double sum[5];                      //!< [出力] x, y, θ-ref, cos θ, sin θ の和
+    double m2[6];                       //!< [出力] 平均からの偏差の積の和 xx, xy, xθ, yy, yθ, θθ
+};
+
+typedef void (*MomentKernel)(MomentArgs &a);
+
+namespace simd
+{
+    // 8本の部分和を決まった順序で足す
+    template <typename V> inline double reduce8(const V (&s)[8 / Traits<V>::W])
+    {
+        double r = 0.0;
+        for (int l = 0; l < 8 / Traits<V>::W; l++) {
+            for (int k = 0; k < Traits<V>::W; k++) r += s[l][k];
+        }
+        return r;
+    }
+
+    // 要素 i を i % 8 番目の部分和に足すように，W 個ずつの塊を順に処理する．
+    // 端数は 0 で埋めた作業領域で計算し，余った要素は mask で 0 にする
+    template <typename V, typename F>
+    inline void forEachBlock(const MomentArgs &a, F f)
+    {
+        typedef typename Traits<V>::M M;
+        const int W = Traits<V>::W;
+        const int L = 8 / W;
+
+        M all = M{} == 0;
+        int i = 0;
+        int l = 0;
+        for (; i + W <= a.n; i += W) {
+            f(a.x + i, a.y + i, a.th + i, all, l);
+            l = (l + 1) % L;
+        }
+
+        int rest = a.n - i;
+        if (rest > 0) {
+            double buf[3][W];
+            memset(buf, 0, sizeof(buf));
+            memcpy(buf[0], a.x + i,  rest * sizeof(double));
+            memcpy(buf[1], a.y + i,  rest * sizeof(double));
+            memcpy(buf[2], a.th + i, rest * sizeof(double));
+            M valid;
+            for (int k = 0; k < W; k++) valid[k] = (k < rest) ? -1 : 0;
+            f(buf[0], buf[1], buf[2], valid, l);
+        }
+    }
+
+    template <typename V>
+    inline void momentKernel(MomentArgs &a)
+    {
+        typedef typename Traits<V>::M M;
+        const int L = 8 / Traits<V>::W;
+        const V zero = V{};
+
+        // 1回目: 和（平均）
+        V s[5][L];
+        for (int j = 0; j < 5; j++) for (int l = 0; l < L; l++) s[j][l] = zero;
+        forEachBlock<V>(a, [&](const double *x, const double *y, const double *th, M valid, int l) {
+            V t = load<V>(th);
+            V sn, cs;
+            sincos(t, sn, cs);
+            s[0][l] += valid ? load<V>(x) : zero;
+            s[1][l] += valid ? load<V>(y) : zero;
+            s[2][l] += valid ? wrapAngle(t - a.ref) : zero;
+            s[3][l] += valid ? cs : zero;
+            s[4][l] += valid ? sn : zero;
+        });
+        for (int j = 0; j < 5; j++) a.sum[j] = reduce8<V>(s[j]);
+
+        // 2回目: 偏差の積．塊は L1 に載っているのでメモリからは読み直さない
+        double mx = a.sum[0] / a.n;
+        double my = a.sum[1] / a.n;
+        double md = a.sum[2] / a.n;
+        V m[6][L];
+        for (int j = 0; j < 6; j++) for (int l = 0; l < L; l++) m[j][l] = zero;
+        forEachBlock<V>(a, [&](const double *x, const double *y, const double *th, M valid, int l) {
+            V dx = valid ? load<V>(x) - mx : zero;
+            V dy = valid ? load<V>(y) - my : zero;
+            V dd = valid ? wrapAngle(load<V>(th) - a.ref) - md : zero;
+            m[0][l] += dx * dx;
+            m[1][l] += dx * dy;
+            m[2][l] += dx * dd;
+            m[3][l] += dy * dy;
+            m[4][l] += dy * dd;
+            m[5][l] += dd * dd;
+        });
+        for (int j = 0; j < 6; j++) a.m2[j] = reduce8<V>(m[j]);
+    }
+
+    __attribute__((flatten))
+    inline void momentKernelScalar(MomentArgs &a) { momentKernel<v1d>(a); }
+
+#ifdef SIMD_X86
+    SIMD_TARGET("sse2")
+    inline void momentKernelSSE2(MomentArgs &a) { momentKernel<v2d>(a); }
+
+    SIMD_TARGET("avx2")
+    inline void momentKernelAVX2(MomentArgs &a) { momentKernel<v4d>(a); }
+
+    SIMD_TARGET("avx512f")
+    inline void momentKernelAVX512(MomentArgs &a) { momentKernel<v8d>(a); }
+#endif
+}
+
+/**
+ * @brief 命令セットに対応する集計カーネルを返す
+ */
+inline MomentKernel getMomentKernel(SimdIsa isa)
+{
+#ifdef SIMD_X86
+    switch (isa) {
+        case ISA_SSE2:   return simd::momentKernelSSE2;
+        case ISA_AVX2:   return simd::momentKernelAVX2;
+        case ISA_AVX512: return simd::momentKernelAVX512;
+        default:         break;
+    }
+#endif
+    return simd::momentKernelScalar;
+}
+
+/**
+ * @brief 姿勢の平均と共分散の集計器
+ * @details 共分散は母分散（n で割る）．添字は 0: x, 1: y, 2: θ
+ */
+class PoseStatistics
+{
+    public:
+        PoseStatistics();
+
+        /**
+         * @brief 集計を空にする
+         */
+        void clear();
+
+        /**
+         * @brief 塊の集計に使う命令セットを指定する
+         */
+        void setSimdIsa(SimdIsa isa);
+
+        /**
+         * @brief 1台分の姿勢を足し込む
+         */
+        void add(double x, double y, double th);
+
+        /**
+         * @brief n 台分の姿勢の配列を足し込む
+         * @details 塊の中は2パスで計算し，これまでの集計と合成する
+         */
+        void add(const double *x, const double *y, const double *th, int n);
+
+        /**
+         * @brief 別の集計器の結果を合成する
+         */
+        void merge(const PoseStatistics &o);
+
+        /**
+         * @brief 平均 (x, y, th)，共分散 cov の正規分布を表す集計にする
+         * @details 線形化した伝播（LinearizedPropagator）の結果を同じ形で渡すために使う．
+         *          count() は 1 になり，合成ベクトル長は exp(-σθ²/2) になる
+         */
+        void setGaussian(double x, double y, double th, const double cov[3][3]);
+
+        long count() const;
+        double getMeanX() const;
+        double getMeanY() const;
+
+        /**
+         * @brief 向きの平均（円周平均）(-π, π]
+         */
+        double getMeanTh() const;
+
+        /**
+         * @brief 共分散
+         * @param i, j 0: x, 1: y, 2: θ
+         */
+        double getCov(int i, int j) const;
+
+        /**
+         * @brief 向きの平均合成ベクトル長 (0〜1)．1 に近いほど向きが揃っている
+         */
+        double getResultantLength() const;
+
+        /**
+         * @brief (x, y) の共分散行列の最大固有値と，その単位固有ベクトル (u, v)
+         */
+        void getPrincipalAxis(double &u, double &v, double &lambda) const;
+
+    private:
+        long n;
+        double ref;             //!< θ の差をとる基準の向き（最初に足した姿勢の向き）
+        double mean[3];         //!< x, y, θ-ref の平均
+        double m2[6];           //!< 偏差の積の和 xx, xy, xθ, yy, yθ, θθ
+        double sc, ss;          //!< cos θ, sin θ の和
+        MomentKernel kernel;
+
+        void merge(long n_, double ref_, const double *mean_, const double *m2_, double sc_, double ss_);
+
+        static int index(int i, int j);
+        static double wrap(double a);
+};
+
+PoseStatistics::PoseStatistics()
+{
+    clear();
+    setSimdIsa(detectSimdIsa());
+}
+
+void PoseStatistics::clear()
+{
+    n = 0;
+    ref = 0.0;
+    for (int i = 0; i < 3; i++) mean[i] = 0.0;
+    for (int i = 0; i < 6; i++) m2[i] = 0.0;
+    sc = ss = 0.0;
+}
+
+void PoseStatistics::setSimdIsa(SimdIsa isa)
+{
+    kernel = getMomentKernel(isa);
+}
+
+void PoseStatistics::add(double x, double y, double th)
+{
+    if (n == 0) ref = th;
+    double v[3] = {x, y, wrap(th - ref)};
+
+    n++;
+    double delta[3];
+    for (int i = 0; i < 3; i++) {
+        delta[i] = v[i] - mean[i];
+        mean[i] += delta[i] / n;
+    }
+    for (int i = 0; i < 3; i++) {
+        for (int j = i; j < 3; j++) m2[index(i, j)] += delta[i] * (v[j] - mean[j]);
+    }
+    sc += cos(th);
+    ss += sin(th);
+}
+
+void PoseStatistics::add(const double *x, const double *y, const double *th, int n_)
+{
+    if (n_ <= 0) return;
+    PROBE_SCOPE("statistics");
+
+    MomentArgs a;
+    a.x = x;
+    a.y = y;
+    a.th = th;
+    a.n = n_;
+    a.ref = (n > 0) ? ref : th[0];
+    kernel(a);
+
+    double m[3];
+    for (int i = 0; i < 3; i++) m[i] = a.sum[i] / n_;
+    merge(n_, a.ref, m, a.m2, a.sum[3], a.sum[4]);
+}
+
+void PoseStatistics::merge(const PoseStatistics &o)
+{
+    merge(o.n, o.ref, o.mean, o.m2, o.sc, o.ss);
+}
+
+// Chan の式で (n_, mean_, m2_) の集計を合成する
+void PoseStatistics::merge(long n_, double ref_, const double *mean_, const double *m2_, double sc_, double ss_)
+{
+    if (n_ == 0) return;
+    if (n == 0) {
+        n = n_;
+        ref = ref_;
+        for (int i = 0; i < 3; i++) mean[i] = mean_[i];
+        for (int i = 0; i < 6; i++) m2[i] = m2_[i];
+        sc = sc_;
+        ss = ss_;
+        return;
+    }
+
+    // 相手の θ の平均をこちらの基準からの差に直す
+    double om[3] = {mean_[0], mean_[1], mean_[2] + wrap(ref_ - ref)};
+
+    long nn = n + n_;
+    double f = (double)n * n_ / nn;
+    double delta[3];
+    for (int i = 0; i < 3; i++) delta[i] = om[i] - mean[i];
+    for (int i = 0; i < 3; i++) {
+        for (int j = i; j < 3; j++) m2[index(i, j)] += m2_[index(i, j)] + delta[i] * delta[j] * f;
+    }
+    for (int i = 0; i < 3; i++) mean[i] += delta[i] * n_ / nn;
+    sc += sc_;
+    ss += ss_;
+    n = nn;
+}
+
+void PoseStatistics::setGaussian(double x, double y, double th, const double cov[3][3])
+{
+    n = 1;
+    ref = th;
+    mean[0] = x;
+    mean[1] = y;
+    mean[2] = 0.0;
+    for (int i = 0; i < 3; i++) {
+        for (int j = i; j < 3; j++) m2[index(i, j)] = cov[i][j];
+    }
+    double r = exp(-0.5 * cov[2][2]);
+    sc = r * cos(th);
+    ss = r * sin(th);
+}
+
+long PoseStatistics::count() const
+{
+    return n;
+}
+
+double PoseStatistics::getMeanX() const
+{
+    return mean[0];
+}
+
+double PoseStatistics::getMeanY() const
+{
+    return mean[1];
+}
+
+double PoseStatistics::getMeanTh() const
+{
+    return atan2(ss, sc);
+}
+
+double PoseStatistics::getCov(int i, int j) const
+{
+    return (n > 0) ? m2[index(i, j)] / n : 0.0;
+}
+
+double PoseStatistics::getResultantLength() const
+{
+    return (n > 0) ? sqrt(sc * sc + ss * ss) / n : 0.0;
+}
+
+void PoseStatistics::getPrincipalAxis(double &u, double &v, double &lambda) const
+{
+    double a = getCov(0, 0);
+    double b = getCov(0, 1);
+    double c = getCov(1, 1);
+
+    // 2x2 対称行列の固有値は閉じた式で求まる
+    double h = 0.5 * (a - c);
+    lambda = 0.5 * (a + c) + sqrt(h * h + b * b);
+
+    if (b == 0.0) {
+        u = (a >= c) ? 1.0 : 0.0;
+        v = (a >= c) ? 0.0 : 1.0;
+        return;
+    }
+    // (λ - c, b) と (b, λ - a) はどちらも固有ベクトル．桁落ちの少ない方を使う
+    double p = lambda - c;
+    double q = lambda - a;
+    if (fabs(p) >= fabs(q)) {
+        u = p;
+        v = b;
+    } else {
+        u = b;
+        v = q;
+    }
+    double k = sqrt(u * u + v * v);
+    u /= k;
+    v /= k;
+}
+
+int PoseStatistics::index(int i, int j)
+{
+    if (i > j) {
+        int t = i;
+        i = j;
+        j = t;
+    }
+    static const int table[3][3] = { {0, 1, 2}, {1, 3, 4}, {2, 4, 5} };
+    return table[i][j];
+}
+
+double PoseStatistics::wrap(double a)
+{
+    return a - 2.0 * M_PI * floor(a / (2.0 * M_PI) + 0.5);
+}
+
+#endif
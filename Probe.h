@@ -0,0 +1,330 @@
+/**
+ * @file Probe.h
+ * @brief 処理の区間ごとの時間を記録する計測点（プローブ）
+ * @author Kazumichi INOUE <k.inoue@oyama-ct.ac.jp>
+ *
+ * 関数の中に PROBE_SCOPE("名前") と書くと，その行からブロックの終わりまでの時間を記録する．
+ * ENABLE_PROBE を定義してコンパイルしたときだけ記録し，定義しなければ何も残らない
+ * （cmake -DENABLE_PROBE=ON）．
+ * 記録はスレッドごとのバッファに入れるので，記録するときに排他制御はしない．
+ * バッファは新しい方から setCapacity() 個の区間を残し（古いものから上書き），
+ * 区間の名前ごとの回数・合計・最小・最大は全て数える．
+ * 結果は CSV（区間の一覧），JSON（名前ごとの集計），Chrome の trace 形式
+ * （chrome://tracing や Perfetto で開ける）で書き出せる．
+ * 環境変数 PROBE_OUTPUT に名前を指定しておくと，終了時に
+ * 名前.csv, 名前.json, 名前.trace.json を書き出す．
+ * 時刻は std::chrono::steady_clock で測る．
+ */
+
+#ifndef __PROBE_H__
+#define __PROBE_H__
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#ifdef ENABLE_PROBE
+#define PROBE_CONCAT2(a, b) a##b
+#define PROBE_CONCAT(a, b) PROBE_CONCAT2(a, b)
+#define PROBE_SCOPE(name) ProbeScope PROBE_CONCAT(probeScope_, __LINE__)(name)
+#else
+#define PROBE_SCOPE(name) ((void)0)
+#endif
+
+/**
+ * @brief 記録した1区間
+ */
+struct ProbeEvent
+{
+    const char *name;       //!< 区間の名前（文字列リテラル）
+    int64_t start;          //!< 開始時刻 [ns]（Probe を作った時刻から）
+    int64_t dur;            //!< 長さ [ns]
+};
+
+/**
+ * @brief 区間の名前ごとの集計
+ */
+struct ProbeTotal
+{
+    const char *name;
+    long count;
+    int64_t total, min, max;        //!< [ns]
+};
+
+/**
+ * @brief 1スレッド分の記録
+ */
+class ProbeBuffer
+{
+    public:
+        ProbeBuffer(int tid_, int capacity) : tid(tid_), ring(capacity), count(0) {}
+
+        void record(const char *name, int64_t start, int64_t dur);
+
+        int tid;                            //!< 登録した順の番号
+        std::vector<ProbeEvent> ring;       //!< 新しい方から ring.size() 個の区間
+        uint64_t count;                     //!< これまでに記録した区間の数
+        std::vector<ProbeTotal> totals;     //!< 名前ごとの集計（名前の種類は少ないので順に探す）
+};
+
+class Probe
+{
+    public:
+        /**
+         * @brief プログラム全体で共有する記録
+         */
+        static Probe &instance();
+
+        /**
+         * @brief 現在の時刻 [ns]（Probe を作った時刻から）
+         */
+        int64_t now() const;
+
+        /**
+         * @brief 呼び出したスレッドのバッファ．初めてなら作る
+         */
+        ProbeBuffer &buffer();
+
+        /**
+         * @brief スレッドごとに残す区間の数（これから作るバッファに効く．既定は 65536）
+         */
+        void setCapacity(int n);
+
+        /**
+         * @brief 記録を全て消す
+         * @details 他のスレッドが記録していない間に呼ぶこと（書き出しも同じ）
+         */
+        void clear();
+
+        /**
+         * @brief 全スレッドを合わせた名前ごとの集計（合計時間の長い順）
+         */
+        std::vector<ProbeTotal> getTotals() const;
+
+        /**
+         * @brief 残っている区間を thread,name,start_us,duration_us の CSV で書き出す
+         */
+        bool writeCsv(const std::string &path) const;
+
+        /**
+         * @brief 名前ごとの集計を JSON で書き出す
+         */
+        bool writeJson(const std::string &path) const;
+
+        /**
+         * @brief 残っている区間を Chrome の trace 形式（JSON）で書き出す
+         */
+        bool writeTrace(const std::string &path) const;
+
+        /**
+         * @brief PROBE_OUTPUT が指定されていれば書き出す
+         */
+        ~Probe();
+
+    private:
+        Probe();
+
+        mutable std::mutex m;
+        std::vector<std::unique_ptr<ProbeBuffer> > buffers;
+        int capacity;
+        std::chrono::steady_clock::time_point epoch;
+
+        // 時刻の順に並べた，残っている区間
+        template <typename F> void forEachEvent(F f) const;
+};
+
+/**
+ * @brief 作ってから壊すまでの時間を記録する（PROBE_SCOPE から使う）
+ */
+class ProbeScope
+{
+    public:
+        explicit ProbeScope(const char *name_) : name(name_), start(Probe::instance().now()) {}
+
+        ~ProbeScope()
+        {
+            Probe &p = Probe::instance();
+            int64_t end = p.now();
+            p.buffer().record(name, start, end - start);
+        }
+
+    private:
+        const char *name;
+        int64_t start;
+};
+
+void ProbeBuffer::record(const char *name, int64_t start, int64_t dur)
+{
+    ProbeEvent &e = ring[count % ring.size()];
+    e.name = name;
+    e.start = start;
+    e.dur = dur;
+    count++;
+
+    for (ProbeTotal &t: totals) {
+        if (t.name == name) {
+            t.count++;
+            t.total += dur;
+            t.min = std::min(t.min, dur);
+            t.max = std::max(t.max, dur);
+            return;
+        }
+    }
+    ProbeTotal t = { name, 1, dur, dur, dur };
+    totals.push_back(t);
+}
+
+Probe &Probe::instance()
+{
+    static Probe probe;
+    return probe;
+}
+
+Probe::Probe()
+    : capacity(65536), epoch(std::chrono::steady_clock::now())
+{
+}
+
+Probe::~Probe()
+{
+    const char *env = getenv("PROBE_OUTPUT");
+    if (env == nullptr || *env == '\0' || buffers.empty()) return;
+    std::string base = env;
+    writeCsv(base + ".csv");
+    writeJson(base + ".json");
+    writeTrace(base + ".trace.json");
+}
+
+int64_t Probe::now() const
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+}
+
+ProbeBuffer &Probe::buffer()
+{
+    static thread_local ProbeBuffer *local = nullptr;
+    if (local == nullptr) {
+        std::lock_guard<std::mutex> lock(m);
+        buffers.emplace_back(new ProbeBuffer(buffers.size(), capacity));
+        local = buffers.back().get();
+    }
+    return *local;
+}
+
+void Probe::setCapacity(int n)
+{
+    std::lock_guard<std::mutex> lock(m);
+    capacity = std::max(1, n);
+}
+
+void Probe::clear()
+{
+    std::lock_guard<std::mutex> lock(m);
+    for (auto &b: buffers) {
+        b->count = 0;
+        b->totals.clear();
+    }
+}
+
+std::vector<ProbeTotal> Probe::getTotals() const
+{
+    std::lock_guard<std::mutex> lock(m);
+    std::vector<ProbeTotal> all;
+    for (auto &b: buffers) {
+        for (const ProbeTotal &t: b->totals) {
+            // 同じ名前でも翻訳単位が違えばポインタが異なりうるので，文字列で比べる
+            auto it = std::find_if(all.begin(), all.end(), [&](const ProbeTotal &a) { return strcmp(a.name, t.name) == 0; });
+            if (it == all.end()) {
+                all.push_back(t);
+            } else {
+                it->count += t.count;
+                it->total += t.total;
+                it->min = std::min(it->min, t.min);
+                it->max = std::max(it->max, t.max);
+            }
+        }
+    }
+    std::sort(all.begin(), all.end(), [](const ProbeTotal &a, const ProbeTotal &b) { return a.total > b.total; });
+    return all;
+}
+
+template <typename F>
+void Probe::forEachEvent(F f) const
+{
+    std::lock_guard<std::mutex> lock(m);
+    std::vector<std::pair<int, const ProbeEvent *> > ev;
+    for (auto &b: buffers) {
+        uint64_t n = std::min<uint64_t>(b->count, b->ring.size());
+        for (uint64_t k = b->count - n; k < b->count; k++) ev.push_back(std::make_pair(b->tid, &b->ring[k % b->ring.size()]));
+    }
+    std::stable_sort(ev.begin(), ev.end(), [](const std::pair<int, const ProbeEvent *> &a, const std::pair<int, const ProbeEvent *> &b) {
+        return a.second->start < b.second->start;
+    });
+    for (auto &e: ev) f(e.first, *e.second);
+}
+
+bool Probe::writeCsv(const std::string &path) const
+{
+    std::ofstream f(path);
+    if (!f) {
+        std::cerr << "ファイルを開けません: " << path << "\n";
+        return false;
+    }
+    f << std::fixed << std::setprecision(3);
+    f << "thread,name,start_us,duration_us\n";
+    forEachEvent([&](int tid, const ProbeEvent &e) {
+        f << tid << "," << e.name << "," << e.start * 1e-3 << "," << e.dur * 1e-3 << "\n";
+    });
+    return true;
+}
+
+bool Probe::writeJson(const std::string &path) const
+{
+    std::ofstream f(path);
+    if (!f) {
+        std::cerr << "ファイルを開けません: " << path << "\n";
+        return false;
+    }
+    std::vector<ProbeTotal> all = getTotals();
+    f << "{\n  \"phases\": [";
+    for (size_t i = 0; i < all.size(); i++) {
+        const ProbeTotal &t = all[i];
+        f << (i ? ",\n" : "\n");
+        f << "    {\"name\": \"" << t.name << "\", \"count\": " << t.count
+          << ", \"total_ms\": " << t.total * 1e-6 << ", \"mean_us\": " << t.total * 1e-3 / t.count
+          << ", \"min_us\": " << t.min * 1e-3 << ", \"max_us\": " << t.max * 1e-3 << "}";
+    }
+    f << "\n  ]\n}\n";
+    return true;
+}
+
+bool Probe::writeTrace(const std::string &path) const
+{
+    std::ofstream f(path);
+    if (!f) {
+        std::cerr << "ファイルを開けません: " << path << "\n";
+        return false;
+    }
+    f << std::fixed << std::setprecision(3);
+    f << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+    bool first = true;
+    forEachEvent([&](int tid, const ProbeEvent &e) {
+        f << (first ? "\n" : ",\n");
+        f << "{\"name\": \"" << e.name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << tid
+          << ", \"ts\": " << e.start * 1e-3 << ", \"dur\": " << e.dur * 1e-3 << "}";
+        first = false;
+    });
+    f << "\n]}\n";
+    return true;
+}
+
+#endif
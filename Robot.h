@@ -3,6 +3,8 @@
 
 #include <opencv2/opencv.hpp>
 
+#include "Noise.h"
+
 // 乱数初期化
 cv::RNG rng(cv::getTickCount());
 
@@ -23,13 +25,8 @@ class Robot
     private:
         double x, y, th;
 
-        // 動作モデルのパラメータ
-        double a1 = 0.1;
-        double a2 = 0.01;
-        double a3 = 0.001;
-        double a4 = 0.01;
-        double a5 = 0.05;
-        double a6 = 0.01;
+        // 動作モデルのパラメータ（a1〜a6．RobotBatch や MotionLikelihood と同じ定義）
+        MotionParam param;
 
     public:
         Robot();        // デフォルトコンストラクタ
@@ -37,6 +34,9 @@ class Robot
         void move(double v, double w, double dt);
         void print();
 
+        void setParam(const MotionParam &p);
+        const MotionParam &getParam() const;
+
         double getX();
         double getY();
         double getTh();
@@ -58,9 +58,11 @@ void Robot::set(double x_, double y_, double th_)
 
 void Robot::move(double v, double w, double dt)
 {
-    double v_ = v + sample(a1 * v * v + a2 * w * w);
-    double w_ = w + sample(a3 * v * v + a4 * w * w);
-    double r_ =     sample(a5 * v * v + a6 * w * w);
+    double bv, bw, br;
+    param.getVariance(v, w, bv, bw, br);
+    double v_ = v + sample(bv);
+    double w_ = w + sample(bw);
+    double r_ =     sample(br);
 
     if (fabs(w_) < 1e-6) w_ = 1e-6;
 
@@ -78,6 +80,16 @@ void Robot::print()
     std::cout << x << " " << y << " " << th << "\n";
 }
 
+void Robot::setParam(const MotionParam &p)
+{
+    param = p;
+}
+
+const MotionParam &Robot::getParam() const
+{
+    return param;
+}
+
 double Robot::getX()
 {
     return x;
@@ -0,0 +1,474 @@
+/**
+ * @file RobotBatch.h
+ * @brief 多数のロボット（パーティクル）をまとめて扱う速度動作モデル
+ * @author Kazumichi INOUE <k.inoue@oyama-ct.ac.jp>
+ *
+ * std::vector<Robot> の代わりに使う．姿勢 x, y, th をそれぞれ連続した
+ * 配列（Structure of Arrays）に格納し，動作モデルのパラメータは全体で1つだけ持つ．
+ * move() を1回呼ぶと集合全体が1ステップ進む．更新式の計算は MotionKernel.h の
+ * SIMDカーネルで行い，命令セットは実行時にCPUを見て選ぶ．
+ * 誤差の正規乱数は Noise.h の GaussianNoise でまとめて作る．
+ * setNumThreads() でスレッド数を指定すると，CHUNK 台ずつの塊を ThreadPool で分担する．
+ * 乱数はロボット番号とステップ数で決まるので，結果はスレッド数によらない．
+ * 姿勢の平均・共分散（PoseStatistics）は advance() の最後のステップに続けて
+ * 塊ごとに集計できるので，統計をとるために集合をもう一度読み直さずに済む．
+ */
+
+#ifndef __ROBOT_BATCH_H__
+#define __ROBOT_BATCH_H__
+
+#include <cmath>
+#include <cstddef>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <vector>
+
+#include "MotionKernel.h"
+#include "Noise.h"
+#include "PoseStatistics.h"
+#include "Probe.h"
+#include "ThreadPool.h"
+
+/**
+ * @brief 指定バイト境界に揃えてメモリを確保するアロケータ
+ * @details キャッシュライン(64byte)に揃えておくとSIMD命令で読み書きしやすい
+ */
+template <typename T, std::size_t Align = 64>
+class AlignedAllocator
+{
+    public:
+        typedef T value_type;
+
+        template <typename U> struct rebind { typedef AlignedAllocator<U, Align> other; };
+
+        AlignedAllocator() {}
+        template <typename U> AlignedAllocator(const AlignedAllocator<U, Align> &) {}
+
+        T *allocate(std::size_t n)
+        {
+            void *p = nullptr;
+            if (posix_memalign(&p, Align, n * sizeof(T)) != 0) throw std::bad_alloc();
+            return static_cast<T *>(p);
+        }
+
+        void deallocate(T *p, std::size_t)
+        {
+            free(p);
+        }
+};
+
+template <typename T, typename U, std::size_t A>
+bool operator==(const AlignedAllocator<T, A> &, const AlignedAllocator<U, A> &) { return true; }
+template <typename T, typename U, std::size_t A>
+bool operator!=(const AlignedAllocator<T, A> &, const AlignedAllocator<U, A> &) { return false; }
+
+class RobotBatch
+{
+    public:
+        typedef std::vector<double, AlignedAllocator<double> > Array;
+
+        /**
+         * @brief 集合内の1台分の姿勢を読み出すための軽量な参照
+         * @details getX(), getY(), getTh() を持つので Drawer::drawing<T> にそのまま渡せる
+         */
+        class Pose
+        {
+            private:
+                const RobotBatch *rb;
+                int i;
+
+            public:
+                Pose(const RobotBatch *rb_, int i_) : rb(rb_), i(i_) {}
+                double getX() const  { return rb->x[i]; }
+                double getY() const  { return rb->y[i]; }
+                double getTh() const { return rb->th[i]; }
+        };
+
+        /**
+         * @brief 範囲for文で Pose を順に取り出すためのイテレータ
+         */
+        class const_iterator
+        {
+            private:
+                const RobotBatch *rb;
+                int i;
+
+            public:
+                const_iterator(const RobotBatch *rb_, int i_) : rb(rb_), i(i_) {}
+                Pose operator*() const { return Pose(rb, i); }
+                const_iterator &operator++() { ++i; return *this; }
+                bool operator!=(const const_iterator &o) const { return i != o.i; }
+        };
+
+        /**
+         * @brief コンストラクタ
+         * @param n ロボットの台数．全員原点・向き0で初期化する
+         */
+        explicit RobotBatch(int n = 0);
+
+        /**
+         * @brief 台数を変更する．増えた分は原点・向き0で初期化する
+         * @param n ロボットの台数
+         */
+        void resize(int n);
+
+        /**
+         * @brief n 台まで確保し直さずに resize() できるよう，配列を先に確保しておく
+         */
+        void reserve(int n);
+
+        int size() const;
+
+        /**
+         * @brief 全ロボットの姿勢を同じ値にセットする
+         */
+        void set(double x_, double y_, double th_);
+
+        /**
+         * @brief i番目のロボットの姿勢をセットする
+         */
+        void set(int i, double x_, double y_, double th_);
+
+        /**
+         * @brief 全ロボットを速度指令 (v, w) で dt だけ動かす
+         * @param v 並進速度 [m/s]
+         * @param w 角速度 [rad/s]
+         * @param dt 時間刻み [s]
+         * @details 誤差の入れ方は Robot::move と同じ．
+         *          更新式は指令ごとに selectMotionPolicy() で選ぶ
+         */
+        void move(double v, double w, double dt);
+
+        /**
+         * @brief 全ロボットを同じ速度指令で nsteps ステップ進める
+         * @details move() を nsteps 回呼ぶのと同じ結果になる．
+         *          CHUNK 台ずつの塊（L1キャッシュに収まる）ごとに nsteps ステップ全てを進めてから
+         *          次の塊に移るので，集合がキャッシュより大きくてもメモリとの往復はほぼ1回で済む
+         */
+        void advance(double v, double w, double dt, long nsteps);
+
+        /**
+         * @brief advance() と同じく進め，進めた後の姿勢の統計を stat に求める
+         * @details 統計は各塊の最後のステップの直後に（キャッシュに載っている間に）集計する．
+         *          塊ごとの結果は塊の順に合成するので，スレッド数によらず同じ値になる
+         */
+        void advance(double v, double w, double dt, long nsteps, PoseStatistics &stat);
+
+        /**
+         * @brief 現在の姿勢の統計を stat に求める
+         */
+        void getStatistics(PoseStatistics &stat);
+
+        /**
+         * @brief 速度指令 (v, w) に対して move() が使う更新式
+         */
+        MotionPolicy getPolicy(double v, double w, double dt) const;
+
+        void setParam(const MotionParam &p);
+        const MotionParam &getParam() const;
+
+        /**
+         * @brief 更新に使う命令セットを指定する
+         * @details 既定値は detectSimdIsa() の結果
+         */
+        void setSimdIsa(SimdIsa isa_);
+        SimdIsa getSimdIsa() const;
+
+        /**
+         * @brief 乱数の種を設定し，ステップ数を0に戻す
+         * @details 同じ種・同じ指令列なら，スレッド数や命令セットによらず毎回同じ結果になる
+         */
+        void seed(uint64_t s);
+        uint64_t getSeed() const;
+
+        /**
+         * @brief これまでに move() した回数（乱数のカウンタに使う）
+         */
+        uint64_t getStep() const;
+
+        /**
+         * @brief 正規乱数の生成方法を指定する
+         * @details NOISE_LEGACY にすると Robot::move と同じ12個和になる
+         */
+        void setNoiseMode(NoiseMode m);
+        NoiseMode getNoiseMode() const;
+
+        /**
+         * @brief move() に使うスレッド数を指定する
+         * @param n 1 なら呼び出し元だけで計算する（既定）．0 ならCPUのコア数
+         */
+        void setNumThreads(int n);
+
+        /**
+         * @brief 他の RobotBatch と同じスレッドプールを使う
+         */
+        void setThreadPool(std::shared_ptr<ThreadPool> p);
+        int getNumThreads() const;
+
+        double getX(int i) const;
+        double getY(int i) const;
+        double getTh(int i) const;
+
+        // 配列への直接アクセス
+        double *getXData();
+        double *getYData();
+        double *getThData();
+        const double *getXData() const;
+        const double *getYData() const;
+        const double *getThData() const;
+
+        Pose operator[](int i) const;
+        const_iterator begin() const;
+        const_iterator end() const;
+
+    private:
+        static const int CHUNK = 512;   //!< 乱数を作ってからカーネルに渡す単位（L1に収まる大きさ）
+
+        Array x, y, th;         //!< 姿勢（SoA）
+        MotionParam param;      //!< 全ロボットで共有する動作モデルのパラメータ
+
+        SimdIsa isa;            //!< 使用する命令セット
+        GaussianNoise noise;    //!< 正規乱数の生成器
+        uint64_t step;          //!< move() した回数
+
+        // スレッドごとの作業領域（CHUNK 個ぶんの標準正規乱数）
+        struct Scratch
+        {
+            Array nv, nw, nr;
+            Scratch() : nv(CHUNK), nw(CHUNK), nr(CHUNK) {}
+        };
+        std::vector<Scratch> scratch;
+        std::shared_ptr<ThreadPool> pool;
+
+        std::vector<PoseStatistics> chunkStat;     //!< 塊ごとの統計（advance() で統計をとるときに使う）
+
+        void propagate(double v, double w, double dt, long nsteps, PoseStatistics *stat);
+        void moveChunk(int i0, long nsteps, MoveArgs a, MoveKernel kernel, bool useNoise, Scratch &s, PoseStatistics *stat);
+};
+
+RobotBatch::RobotBatch(int n)
+    : step(0), scratch(1)
+{
+    resize(n);
+    setSimdIsa(detectSimdIsa());
+}
+
+void RobotBatch::resize(int n)
+{
+    x.resize(n, 0.0);
+    y.resize(n, 0.0);
+    th.resize(n, 0.0);
+}
+
+void RobotBatch::reserve(int n)
+{
+    x.reserve(n);
+    y.reserve(n);
+    th.reserve(n);
+}
+
+int RobotBatch::size() const
+{
+    return x.size();
+}
+
+void RobotBatch::set(double x_, double y_, double th_)
+{
+    for (int i = 0; i < size(); i++) set(i, x_, y_, th_);
+}
+
+void RobotBatch::set(int i, double x_, double y_, double th_)
+{
+    x[i] = x_;
+    y[i] = y_;
+    th[i]= th_;
+}
+
+void RobotBatch::move(double v, double w, double dt)
+{
+    advance(v, w, dt, 1);
+}
+
+void RobotBatch::advance(double v, double w, double dt, long nsteps)
+{
+    propagate(v, w, dt, nsteps, nullptr);
+}
+
+void RobotBatch::advance(double v, double w, double dt, long nsteps, PoseStatistics &stat)
+{
+    propagate(v, w, dt, nsteps, &stat);
+}
+
+void RobotBatch::getStatistics(PoseStatistics &stat)
+{
+    propagate(0.0, 0.0, 0.0, 0, &stat);
+}
+
+// nsteps ステップ進める．stat が nullptr でなければ進めた後の統計も求める
+void RobotBatch::propagate(double v, double w, double dt, long nsteps, PoseStatistics *stat)
+{
+    if (nsteps <= 0 && stat == nullptr) return;
+    if (nsteps < 0) nsteps = 0;
+    PROBE_SCOPE("propagate");
+
+    // 誤差の分散は指令値だけで決まるので全ロボットで共通
+    MoveArgs a;
+    a.v  = v;
+    a.w  = w;
+    param.getStd(v, w, a.sv, a.sw, a.sr);
+    a.dt = dt;
+
+    // 更新式は指令ごとに1回だけ選ぶ
+    MotionPolicy policy = selectMotionPolicy(v, w, a.sv, a.sw, a.sr, dt);
+    MoveKernel kernel = getMoveKernel(isa, policy);
+    bool useNoise = (policy != POLICY_NOISE_FREE);
+
+    int nChunk = (size() + CHUNK - 1) / CHUNK;
+    if (stat && (int)chunkStat.size() < nChunk) {
+        chunkStat.resize(nChunk);
+        for (PoseStatistics &s: chunkStat) s.setSimdIsa(isa);
+    }
+    auto chunk = [&](int k, int worker) {
+        moveChunk(k * CHUNK, nsteps, a, kernel, useNoise, scratch[worker], stat ? &chunkStat[k] : nullptr);
+    };
+    if (pool && nChunk > 1) {
+        pool->parallelFor(nChunk, chunk);
+    } else {
+        for (int k = 0; k < nChunk; k++) chunk(k, 0);
+    }
+    step += nsteps;
+
+    if (stat) {
+        stat->clear();
+        for (int k = 0; k < nChunk; k++) stat->merge(chunkStat[k]);
+    }
+}
+
+MotionPolicy RobotBatch::getPolicy(double v, double w, double dt) const
+{
+    double sv, sw, sr;
+    param.getStd(v, w, sv, sw, sr);
+    return selectMotionPolicy(v, w, sv, sw, sr, dt);
+}
+
+// i0 番目から最大 CHUNK 台を nsteps ステップ動かす
+void RobotBatch::moveChunk(int i0, long nsteps, MoveArgs a, MoveKernel kernel, bool useNoise, Scratch &s, PoseStatistics *stat)
+{
+    a.n  = (size() - i0 < CHUNK) ? size() - i0 : CHUNK;
+    a.x  = x.data() + i0;
+    a.y  = y.data() + i0;
+    a.th = th.data() + i0;
+    a.nv = s.nv.data();
+    a.nw = s.nw.data();
+    a.nr = s.nr.data();
+    for (long k = 0; k < nsteps; k++) {
+        if (useNoise) {
+            PROBE_SCOPE("noise");
+            noise.fill(step + k, i0, a.n, s.nv.data(), s.nw.data(), s.nr.data());
+        }
+        PROBE_SCOPE("kernel");
+        kernel(a);
+    }
+    if (stat) {
+        stat->clear();
+        stat->add(a.x, a.y, a.th, a.n);
+    }
+}
+
+void RobotBatch::setParam(const MotionParam &p)
+{
+    param = p;
+}
+
+const MotionParam &RobotBatch::getParam() const
+{
+    return param;
+}
+
+void RobotBatch::setSimdIsa(SimdIsa isa_)
+{
+    isa = isa_;
+    noise.setSimdIsa(isa);
+    for (PoseStatistics &s: chunkStat) s.setSimdIsa(isa);
+}
+
+SimdIsa RobotBatch::getSimdIsa() const
+{
+    return isa;
+}
+
+void RobotBatch::seed(uint64_t s)
+{
+    noise.seed(s);
+    step = 0;
+}
+
+uint64_t RobotBatch::getSeed() const
+{
+    return noise.getSeed();
+}
+
+uint64_t RobotBatch::getStep() const
+{
+    return step;
+}
+
+void RobotBatch::setNoiseMode(NoiseMode m)
+{
+    noise.setMode(m);
+}
+
+NoiseMode RobotBatch::getNoiseMode() const
+{
+    return noise.getMode();
+}
+
+void RobotBatch::setNumThreads(int n)
+{
+    if (n == 1) {
+        pool.reset();
+        scratch.resize(1);
+    } else {
+        setThreadPool(std::make_shared<ThreadPool>(n));
+    }
+}
+
+void RobotBatch::setThreadPool(std::shared_ptr<ThreadPool> p)
+{
+    pool = p;
+    scratch.resize(pool ? pool->size() : 1);
+}
+
+int RobotBatch::getNumThreads() const
+{
+    return pool ? pool->size() : 1;
+}
+
+double RobotBatch::getX(int i) const  { return x[i]; }
+double RobotBatch::getY(int i) const  { return y[i]; }
+double RobotBatch::getTh(int i) const { return th[i]; }
+
+double *RobotBatch::getXData()  { return x.data(); }
+double *RobotBatch::getYData()  { return y.data(); }
+double *RobotBatch::getThData() { return th.data(); }
+const double *RobotBatch::getXData() const  { return x.data(); }
+const double *RobotBatch::getYData() const  { return y.data(); }
+const double *RobotBatch::getThData() const { return th.data(); }
+
+RobotBatch::Pose RobotBatch::operator[](int i) const
+{
+    return Pose(this, i);
+}
+
+RobotBatch::const_iterator RobotBatch::begin() const
+{
+    return const_iterator(this, 0);
+}
+
+RobotBatch::const_iterator RobotBatch::end() const
+{
+    return const_iterator(this, size());
+}
+
+#endif
@@ -0,0 +1,306 @@
+/**
+ * @file SimdMath.h
+ * @brief GCC/Clang のベクトル拡張を使ったSIMD用の数学関数
+ * @author Kazumichi INOUE <k.inoue@oyama-ct.ac.jp>
+ *
+ * double を 1, 2, 4, 8 個並べたベクトル型を用意し，それぞれに同じテンプレートで
+ * 計算を書く．1要素の型はスカラー版として使い，どの幅でも同じ演算順序になるので
+ * 結果は幅によらず一致する．
+ * 命令セット（SSE2/AVX2/AVX-512）は呼び出し側の関数に target 属性を付けて選ぶ．
+ */
+
+#ifndef __SIMD_MATH_H__
+#define __SIMD_MATH_H__
+
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+// カーネルの入口に付ける属性．中の関数を全て展開し，FMA への置き換えを禁止して
+// どの命令セットでも丸め方を揃える
+#if defined(__clang__)
+#define SIMD_TARGET(isa) __attribute__((target(isa), flatten))
+#pragma clang fp contract(off)
+#else
+#define SIMD_TARGET(isa) __attribute__((target(isa), flatten, optimize("fp-contract=off")))
+#endif
+
+// 256/512bit のベクトル型を AVX 無効の翻訳単位で使うとABIの注意が出るが，
+// 実際に使うのは target 属性付きの関数の中で全て展開された後なので問題ない．
+// テンプレートの実体化は翻訳単位の末尾で行われるので push/pop はしない
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wpsabi"
+#endif
+
+/**
+ * @brief 使用する命令セット
+ */
+enum SimdIsa
+{
+    ISA_SCALAR = 0,
+    ISA_SSE2,
+    ISA_AVX2,
+    ISA_AVX512
+};
+
+/**
+ * @brief 命令セットの名前
+ */
+inline const char *simdIsaName(SimdIsa isa)
+{
+    switch (isa) {
+        case ISA_SSE2:   return "sse2";
+        case ISA_AVX2:   return "avx2";
+        case ISA_AVX512: return "avx512";
+        default:         return "scalar";
+    }
+}
+
+/**
+ * @brief CPUが対応している中で最も広い命令セットを返す
+ * @details 環境変数 SIMD_ISA (scalar/sse2/avx2/avx512) で上限を指定できる
+ */
+inline SimdIsa detectSimdIsa()
+{
+    SimdIsa isa = ISA_SCALAR;
+#ifdef SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))    isa = ISA_SSE2;
+    if (__builtin_cpu_supports("avx2"))    isa = ISA_AVX2;
+    if (__builtin_cpu_supports("avx512f")) isa = ISA_AVX512;
+#endif
+
+    const char *env = getenv("SIMD_ISA");
+    if (env != nullptr) {
+        std::string s(env);
+        SimdIsa limit = isa;
+        if (s == "scalar")      limit = ISA_SCALAR;
+        else if (s == "sse2")   limit = ISA_SSE2;
+        else if (s == "avx2")   limit = ISA_AVX2;
+        else if (s == "avx512") limit = ISA_AVX512;
+        if (limit < isa) isa = limit;
+    }
+    return isa;
+}
+
+namespace simd
+{
+    typedef double  v1d  __attribute__((vector_size(8)));
+    typedef double  v2d  __attribute__((vector_size(16)));
+    typedef double  v4d  __attribute__((vector_size(32)));
+    typedef double  v8d  __attribute__((vector_size(64)));
+    typedef int64_t v1l  __attribute__((vector_size(8)));
+    typedef int64_t v2l  __attribute__((vector_size(16)));
+    typedef int64_t v4l  __attribute__((vector_size(32)));
+    typedef int64_t v8l  __attribute__((vector_size(64)));
+    typedef uint64_t v1u __attribute__((vector_size(8)));
+    typedef uint64_t v2u __attribute__((vector_size(16)));
+    typedef uint64_t v4u __attribute__((vector_size(32)));
+    typedef uint64_t v8u __attribute__((vector_size(64)));
+    typedef int32_t v1i  __attribute__((vector_size(4)));
+    typedef int32_t v2i  __attribute__((vector_size(8)));
+    typedef int32_t v4i  __attribute__((vector_size(16)));
+    typedef int32_t v8i  __attribute__((vector_size(32)));
+
+    /**
+     * @brief ベクトル型ごとの付随情報
+     * @details W: 要素数，M: 比較結果（マスク）の型，U: 64bit符号なし整数ベクトルの型，I: 32bit整数ベクトルの型
+     */
+    template <typename V> struct Traits;
+    template <> struct Traits<v1d> { enum { W = 1 }; typedef v1l M; typedef v1u U; typedef v1i I; };
+    template <> struct Traits<v2d> { enum { W = 2 }; typedef v2l M; typedef v2u U; typedef v2i I; };
+    template <> struct Traits<v4d> { enum { W = 4 }; typedef v4l M; typedef v4u U; typedef v4i I; };
+    template <> struct Traits<v8d> { enum { W = 8 }; typedef v8l M; typedef v8u U; typedef v8i I; };
+
+    template <typename V> inline V load(const double *p)
+    {
+        V v;
+        memcpy(&v, p, sizeof(V));
+        return v;
+    }
+
+    template <typename V> inline void store(double *p, V v)
+    {
+        memcpy(p, &v, sizeof(V));
+    }
+
+    template <typename V> inline V broadcast(double a)
+    {
+        return V{} + a;
+    }
+
+    template <typename V> inline V vabs(V a)
+    {
+        return a < 0 ? -a : a;
+    }
+
+    // 平方根．sqrt は正しく丸められるので，どの命令セットでも結果は同じ
+    template <typename V> inline V vsqrt(V a)
+    {
+        for (int k = 0; k < Traits<V>::W; k++) a[k] = std::sqrt(a[k]);
+        return a;
+    }
+
+#ifdef SIMD_X86
+    __attribute__((target("sse2")))
+    inline v2d vsqrt(v2d a) { return (v2d)_mm_sqrt_pd((__m128d)a); }
+
+    __attribute__((target("avx")))
+    inline v4d vsqrt(v4d a) { return (v4d)_mm256_sqrt_pd((__m256d)a); }
+
+    __attribute__((target("avx512f")))
+    inline v8d vsqrt(v8d a) { return (v8d)_mm512_mask_sqrt_pd((__m512d)a, 0xff, (__m512d)a); }
+#endif
+
+    /**
+     * @brief 自然対数
+     * @details Cephes の log と同じ多項式．引数は正の正規化数であること
+     */
+    template <typename V> inline V log(V x)
+    {
+        typedef typename Traits<V>::M M;
+
+        // x = m * 2^e, m は [0.5, 1)
+        M bits = (M)x;
+        M e = ((bits >> 52) & 0x7ff) - 1022;
+        V m = (V)((bits & 0x800fffffffffffffLL) | 0x3fe0000000000000LL);
+        V fe = __builtin_convertvector(e, V);
+
+        M small = m < 0.70710678118654752440;
+        fe = small ? fe - 1.0 : fe;
+        m = small ? m + m - 1.0 : m - 1.0;
+
+        V z = m * m;
+        V p = broadcast<V>(1.01875663804580931796E-4);
+        p = p * m + 4.97494994976747001425E-1;
+        p = p * m + 4.70579119878881725854E0;
+        p = p * m + 1.44989225341610930846E1;
+        p = p * m + 1.79368678507819816313E1;
+        p = p * m + 7.70838733755885391666E0;
+        V q = m + 1.12873587189167450590E1;
+        q = q * m + 4.52279145837532221105E1;
+        q = q * m + 8.29875266912776603211E1;
+        q = q * m + 7.11544750618563894466E1;
+        q = q * m + 2.31251620126765340583E1;
+
+        V y = m * (z * p / q);
+        y = y - fe * 2.121944400546905827679e-4;
+        y = y - 0.5 * z;
+        return m + y + fe * 0.693359375;
+    }
+
+    /**
+     * @brief sin と cos を同時に求める
+     * @details Cephes の sin/cos と同じ π/4 単位の引数縮約と多項式．|x| < 1e9 程度で倍精度の精度がある
+     */
+    template <typename V> inline void sincos(V x, V &s, V &c)
+    {
+        typedef typename Traits<V>::M M;
+        typedef typename Traits<V>::I I;
+
+        const double FOPI = 1.27323954473516268615;     // 4/π
+        const double DP1 = 7.85398125648498535156E-1;   // π/4 を3つに分けたもの
+        const double DP2 = 3.77489470793079817668E-8;
+        const double DP3 = 2.69515142907905952645E-15;
+
+        M xneg = x < 0;
+        V ax = vabs(x);
+
+        // 何番目の π/4 区間かを求め，偶数に切り上げる
+        I j = __builtin_convertvector(ax * FOPI, I);
+        j = (j + 1) & ~1;
+        V y = __builtin_convertvector(j, V);
+
+        V z = ((ax - y * DP1) - y * DP2) - y * DP3;
+        V zz = z * z;
+
+        V ps = broadcast<V>(1.58962301576546568060E-10);
+        ps = ps * zz - 2.50507477628578072866E-8;
+        ps = ps * zz + 2.75573136213857245213E-6;
+        ps = ps * zz - 1.98412698295895385996E-4;
+        ps = ps * zz + 8.33333333332211858878E-3;
+        ps = ps * zz - 1.66666666666666307295E-1;
+        ps = z + z * zz * ps;
+
+        V pc = broadcast<V>(-1.13585365213876817300E-11);
+        pc = pc * zz + 2.08757008419747316778E-9;
+        pc = pc * zz - 2.75573141792967388112E-7;
+        pc = pc * zz + 2.48015872888517045348E-5;
+        pc = pc * zz - 1.38888888888730564116E-3;
+        pc = pc * zz + 4.16666666666665929218E-2;
+        pc = 1.0 - 0.5 * zz + zz * zz * pc;
+
+        // 区間に応じて sin/cos の多項式を入れ替え，符号を決める
+        M swap = __builtin_convertvector((j & 2) != 0, M);
+        M half = __builtin_convertvector((j & 4) != 0, M);
+        V s_ = swap ? pc : ps;
+        V c_ = swap ? ps : pc;
+        s = (half ^ xneg) ? -s_ : s_;
+        c = (half ^ swap) ? -c_ : c_;
+    }
+
+    /**
+     * @brief 逆正接
+     * @details Cephes の atan と同じ引数縮約と有理式
+     */
+    template <typename V> inline V atan(V x)
+    {
+        typedef typename Traits<V>::M M;
+
+        M neg = x < 0;
+        V ax = vabs(x);
+
+        // tan(3π/8) より大きければ π/2 - atan(1/x)，0.66 より大きければ π/4 + atan((x-1)/(x+1))
+        M big = ax > 2.41421356237309504880;
+        M mid = (ax > 0.66) & ~big;
+        V y0 = big ? broadcast<V>(M_PI_2) : (mid ? broadcast<V>(M_PI_4) : V{});
+        V more = big ? broadcast<V>(6.123233995736765886130E-17) : (mid ? broadcast<V>(3.061616997868382943065E-17) : V{});
+        V t = big ? -1.0 / ax : (mid ? (ax - 1.0) / (ax + 1.0) : ax);
+
+        V z = t * t;
+        V p = broadcast<V>(-8.750608600031904122785E-1);
+        p = p * z - 1.615753718733365076637E1;
+        p = p * z - 7.500855792314704667340E1;
+        p = p * z - 1.228866684490136173410E2;
+        p = p * z - 6.485021904942025371773E1;
+        V q = z + 2.485846490142306297962E1;
+        q = q * z + 1.650270098316988542046E2;
+        q = q * z + 4.328810604912902668951E2;
+        q = q * z + 4.853903996359136964868E2;
+        q = q * z + 1.945506571482613964425E2;
+
+        V r = y0 + (t * (z * p / q) + t + more);
+        return neg ? -r : r;
+    }
+
+    /**
+     * @brief atan2(y, x)．x = y = 0 なら 0
+     */
+    template <typename V> inline V atan2(V y, V x)
+    {
+        typedef typename Traits<V>::M M;
+
+        M zero = (x == 0) & (y == 0);
+        V r = atan(zero ? V{} : y / x);
+        V w = (y < 0) ? broadcast<V>(-M_PI) : broadcast<V>(M_PI);
+        return (x < 0) ? r + w : r;
+    }
+
+    // 角度を (-π, π] 付近に折り返す
+    template <typename V> inline V wrapAngle(V d)
+    {
+        typedef typename Traits<V>::I I;
+        V h = d < 0 ? broadcast<V>(-0.5) : broadcast<V>(0.5);
+        I k = __builtin_convertvector(d * (0.5 / M_PI) + h, I);
+        return d - __builtin_convertvector(k, V) * (2.0 * M_PI);
+    }
+}
+
+#endif
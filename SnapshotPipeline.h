@@ -0,0 +1,248 @@
+/**
+ * @file SnapshotPipeline.h
+ * @brief シミュレーションと描画を並行させるためのスナップショットの受け渡し
+ * @author Kazumichi INOUE <k.inoue@oyama-ct.ac.jp>
+ *
+ * submit() は集合の姿勢を使い回しのバッファ（スナップショット）にコピーして待ち行列に入れ，
+ * すぐに戻る．描画などの処理は専用のスレッドが待ち行列から順に取り出して行う．
+ * バッファの数（depth）が待ち行列の上限になる．描画が追いつかずバッファが空いていないときは
+ *  - BACKPRESSURE_BLOCK       空くまで待つ（全てのスナップショットを処理する）
+ *  - BACKPRESSURE_DROP_OLDEST まだ処理していない最も古いスナップショットを捨てて使う
+ */
+
+#ifndef __SNAPSHOT_PIPELINE_H__
+#define __SNAPSHOT_PIPELINE_H__
+
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "PoseStatistics.h"
+#include "Probe.h"
+#include "RobotBatch.h"
+
+/**
+ * @brief 描画が追いつかないときの振る舞い
+ */
+enum Backpressure
+{
+    BACKPRESSURE_BLOCK = 0,
+    BACKPRESSURE_DROP_OLDEST
+};
+
+/**
+ * @brief ある時刻の集合の姿勢のコピー
+ */
+struct Snapshot
+{
+    double t;                   //!< 時刻 [s]
+    uint64_t step;              //!< RobotBatch::getStep()
+    int n;                      //!< ロボットの数
+    RobotBatch::Array x, y, th;
+    PoseStatistics stat;        //!< 統計（hasStat のときだけ有効）
+    bool hasStat;
+
+    const double *getXData() const { return x.data(); }
+    const double *getYData() const { return y.data(); }
+    const double *getThData() const { return th.data(); }
+    int size() const { return n; }
+};
+
+class SnapshotPipeline
+{
+    public:
+        /**
+         * @brief スナップショットを処理する関数．専用のスレッドで呼ばれる
+         */
+        typedef std::function<void(const Snapshot &s)> Renderer;
+
+        /**
+         * @brief コンストラクタ
+         * @param r スナップショットを処理する関数
+         * @param depth バッファの数（2 ならダブルバッファ）
+         * @param policy バッファが空いていないときの振る舞い
+         */
+        explicit SnapshotPipeline(const Renderer &r, int depth = 2, Backpressure policy = BACKPRESSURE_BLOCK);
+
+        /**
+         * @brief 残りのスナップショットを処理してから終わる
+         */
+        ~SnapshotPipeline();
+
+        /**
+         * @brief rb の姿勢をコピーして処理を頼む
+         */
+        void submit(const RobotBatch &rb, double t);
+
+        /**
+         * @brief rb の姿勢と統計 s をコピーして処理を頼む
+         */
+        void submit(const RobotBatch &rb, const PoseStatistics &s, double t);
+
+        /**
+         * @brief 頼んだスナップショットが全て処理されるまで待つ
+         */
+        void flush();
+
+        /**
+         * @brief 処理したスナップショットの数
+         */
+        long getRendered() const;
+
+        /**
+         * @brief BACKPRESSURE_DROP_OLDEST で捨てたスナップショットの数
+         */
+        long getDropped() const;
+
+    private:
+        Renderer renderer;
+        Backpressure policy;
+
+        std::vector<std::unique_ptr<Snapshot> > buffers;
+        std::vector<Snapshot *> spare;      //!< 空いているバッファ
+        std::deque<Snapshot *> ready;       //!< 処理待ち（古い順）
+
+        mutable std::mutex m;
+        std::condition_variable cvReady;
+        std::condition_variable cvSpare;
+        bool busy;                          //!< 処理中のスナップショットがあるか
+        bool quit;
+        long rendered;
+        long dropped;
+        std::thread worker;
+
+        Snapshot *acquire();
+        void copy(Snapshot *s, const RobotBatch &rb, double t);
+        void post(Snapshot *s);
+        void run();
+};
+
+SnapshotPipeline::SnapshotPipeline(const Renderer &r, int depth, Backpressure policy_)
+    : renderer(r), policy(policy_), busy(false), quit(false), rendered(0), dropped(0)
+{
+    if (depth < 1) depth = 1;
+    for (int i = 0; i < depth; i++) {
+        buffers.push_back(std::unique_ptr<Snapshot>(new Snapshot()));
+        spare.push_back(buffers.back().get());
+    }
+    worker = std::thread(&SnapshotPipeline::run, this);
+}
+
+SnapshotPipeline::~SnapshotPipeline()
+{
+    {
+        std::lock_guard<std::mutex> lock(m);
+        quit = true;
+    }
+    cvReady.notify_all();
+    worker.join();
+}
+
+void SnapshotPipeline::submit(const RobotBatch &rb, double t)
+{
+    Snapshot *s = acquire();
+    copy(s, rb, t);
+    s->hasStat = false;
+    post(s);
+}
+
+void SnapshotPipeline::submit(const RobotBatch &rb, const PoseStatistics &st, double t)
+{
+    Snapshot *s = acquire();
+    copy(s, rb, t);
+    s->stat = st;
+    s->hasStat = true;
+    post(s);
+}
+
+void SnapshotPipeline::flush()
+{
+    std::unique_lock<std::mutex> lock(m);
+    cvSpare.wait(lock, [this] { return ready.empty() && !busy; });
+}
+
+long SnapshotPipeline::getRendered() const
+{
+    std::lock_guard<std::mutex> lock(m);
+    return rendered;
+}
+
+long SnapshotPipeline::getDropped() const
+{
+    std::lock_guard<std::mutex> lock(m);
+    return dropped;
+}
+
+// 書き込むバッファを1つ確保する
+Snapshot *SnapshotPipeline::acquire()
+{
+    PROBE_SCOPE("snapshot_wait");
+    std::unique_lock<std::mutex> lock(m);
+    if (spare.empty() && policy == BACKPRESSURE_DROP_OLDEST && !ready.empty()) {
+        Snapshot *s = ready.front();
+        ready.pop_front();
+        dropped++;
+        return s;
+    }
+    cvSpare.wait(lock, [this] { return !spare.empty(); });
+    Snapshot *s = spare.back();
+    spare.pop_back();
+    return s;
+}
+
+// 姿勢をバッファにコピーする．大きさが同じならバッファは確保し直さない
+void SnapshotPipeline::copy(Snapshot *s, const RobotBatch &rb, double t)
+{
+    PROBE_SCOPE("snapshot_copy");
+    int n = rb.size();
+    s->t = t;
+    s->step = rb.getStep();
+    s->n = n;
+    s->x.resize(n);
+    s->y.resize(n);
+    s->th.resize(n);
+    memcpy(s->x.data(),  rb.getXData(),  n * sizeof(double));
+    memcpy(s->y.data(),  rb.getYData(),  n * sizeof(double));
+    memcpy(s->th.data(), rb.getThData(), n * sizeof(double));
+}
+
+void SnapshotPipeline::post(Snapshot *s)
+{
+    {
+        std::lock_guard<std::mutex> lock(m);
+        ready.push_back(s);
+    }
+    cvReady.notify_one();
+}
+
+void SnapshotPipeline::run()
+{
+    std::unique_lock<std::mutex> lock(m);
+    while (true) {
+        cvReady.wait(lock, [this] { return quit || !ready.empty(); });
+        if (ready.empty()) return;      // quit で，処理するものも残っていない
+
+        Snapshot *s = ready.front();
+        ready.pop_front();
+        busy = true;
+        lock.unlock();
+
+        {
+            PROBE_SCOPE("snapshot_render");
+            renderer(*s);
+        }
+
+        lock.lock();
+        spare.push_back(s);
+        rendered++;
+        busy = false;
+        cvSpare.notify_all();
+    }
+}
+
+#endif
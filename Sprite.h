@@ -0,0 +1,273 @@
+/**
+ * @file Sprite.h
+ * @brief 重ねて描く画像（スプライト）の読み込みの使い回しと，アルファ合成
+ * @author Kazumichi INOUE <k.inoue@oyama-ct.ac.jp>
+ *
+ * SpriteCache はファイルを一度だけ読み込み，alpha を掛けた色（premultiplied）に直して
+ * パスごとに持っておく．ロゴや記号のように毎フレーム重ねる画像を，そのたびに
+ * ファイルから読み直さずに済む．
+ * 合成は dst = src + dst (255 - alpha) / 255 をバイトごとに行う．alpha を画素の3チャネル分
+ * 並べておくので，色の並びを気にせずベクトル演算できる．
+ */
+
+#ifndef __SPRITE_H__
+#define __SPRITE_H__
+
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <opencv2/opencv.hpp>
+
+#include "SimdMath.h"
+
+/**
+ * @brief 読み込んだ画像
+ */
+struct Sprite
+{
+    cv::Mat bgr;        //!< 読み込んだままの色（alpha を掛けていない，CV_8UC3）
+    cv::Mat pix;        //!< alpha を掛けた色（CV_8UC3）
+    cv::Mat alpha;      //!< 不透明度（CV_8UC1）
+    cv::Mat alpha3;     //!< 不透明度を色の3チャネル分並べたもの（CV_8UC3）
+    bool opaque;        //!< 全ての画素が不透明か
+
+    int cols() const { return bgr.cols; }
+    int rows() const { return bgr.rows; }
+    bool empty() const { return bgr.empty(); }
+};
+
+/**
+ * @brief n バイトを合成する dst[i] = src[i] + dst[i] (255 - alpha[i]) / 255（四捨五入）
+ */
+typedef void (*BlendKernel)(unsigned char *dst, const unsigned char *src, const unsigned char *alpha, int n);
+
+namespace simd
+{
+    typedef uint8_t  v16b __attribute__((vector_size(16)));
+    typedef uint8_t  v32b __attribute__((vector_size(32)));
+    typedef uint16_t v16w __attribute__((vector_size(32)));
+    typedef uint16_t v32w __attribute__((vector_size(64)));
+
+    // x / 255 の四捨五入（0 <= x <= 255 * 255 で正確）
+    template <typename W>
+    inline W div255(W x)
+    {
+        x = x + 128;
+        return (x + (x >> 8)) >> 8;
+    }
+
+    template <typename B, typename W>
+    inline void blendBlock(unsigned char *dst, const unsigned char *src, const unsigned char *alpha)
+    {
+        B d, s, a;
+        memcpy(&d, dst, sizeof(B));
+        memcpy(&s, src, sizeof(B));
+        memcpy(&a, alpha, sizeof(B));
+        W dw = __builtin_convertvector(d, W);
+        W sw = __builtin_convertvector(s, W);
+        W aw = __builtin_convertvector(a, W);
+        B out = __builtin_convertvector(sw + div255<W>(dw * (255 - aw)), B);
+        memcpy(dst, &out, sizeof(B));
+    }
+
+    inline void blendKernelScalar(unsigned char *dst, const unsigned char *src, const unsigned char *alpha, int n)
+    {
+        for (int i = 0; i < n; i++) {
+            unsigned x = dst[i] * (255u - alpha[i]) + 128;
+            dst[i] = src[i] + ((x + (x >> 8)) >> 8);
+        }
+    }
+
+    template <typename B, typename W>
+    inline void blendKernel(unsigned char *dst, const unsigned char *src, const unsigned char *alpha, int n)
+    {
+        const int L = sizeof(B);
+        int i = 0;
+        for (; i + L <= n; i += L) blendBlock<B, W>(dst + i, src + i, alpha + i);
+        blendKernelScalar(dst + i, src + i, alpha + i, n - i);
+    }
+
+#ifdef SIMD_X86
+    SIMD_TARGET("sse2")
+    inline void blendKernelSSE2(unsigned char *dst, const unsigned char *src, const unsigned char *alpha, int n)
+    {
+        blendKernel<v16b, v16w>(dst, src, alpha, n);
+    }
+
+    SIMD_TARGET("avx2")
+    inline void blendKernelAVX2(unsigned char *dst, const unsigned char *src, const unsigned char *alpha, int n)
+    {
+        blendKernel<v32b, v32w>(dst, src, alpha, n);
+    }
+#endif
+}
+
+/**
+ * @brief 命令セットに対応する合成カーネルを返す
+ * @details 512bit の16bit整数演算は AVX-512BW が要るので，AVX-512 でも AVX2 版を使う
+ */
+inline BlendKernel getBlendKernel(SimdIsa isa)
+{
+#ifdef SIMD_X86
+    switch (isa) {
+        case ISA_SSE2:   return simd::blendKernelSSE2;
+        case ISA_AVX2:
+        case ISA_AVX512: return simd::blendKernelAVX2;
+        default:         break;
+    }
+#endif
+    return simd::blendKernelScalar;
+}
+
+/**
+ * @brief sprite を dst の (px, py) を左上にして合成する．dst からはみ出す所は描かない
+ * @param dstAlpha dst の不透明度（CV_8UC1）．nullptr でなければこちらにも合成する
+ * @return 描いた範囲（dst の座標）
+ */
+inline cv::Rect blendSprite(BlendKernel kernel, cv::Mat &dst, cv::Mat *dstAlpha, const Sprite &s, int px, int py)
+{
+    cv::Rect r = cv::Rect(px, py, s.cols(), s.rows()) & cv::Rect(0, 0, dst.cols, dst.rows);
+    if (r.empty()) return r;
+    int sx = r.x - px, sy = r.y - py;
+
+    for (int i = 0; i < r.height; i++) {
+        unsigned char *d = dst.ptr<unsigned char>(r.y + i) + r.x * 3;
+        if (s.opaque) {
+            memcpy(d, s.pix.ptr<unsigned char>(sy + i) + sx * 3, r.width * 3);
+        } else {
+            kernel(d, s.pix.ptr<unsigned char>(sy + i) + sx * 3, s.alpha3.ptr<unsigned char>(sy + i) + sx * 3, r.width * 3);
+        }
+        if (dstAlpha) {
+            unsigned char *da = dstAlpha->ptr<unsigned char>(r.y + i) + r.x;
+            const unsigned char *sa = s.alpha.ptr<unsigned char>(sy + i) + sx;
+            if (s.opaque) memset(da, 255, r.width);
+            else          kernel(da, sa, sa, r.width);
+        }
+    }
+    return r;
+}
+
+/**
+ * @brief パスごとに読み込んだ画像を持っておく
+ * @details 複数のスレッドから呼んでよい．読み込んだ画像は clear() するまで持ち続ける
+ */
+class SpriteCache
+{
+    public:
+        /**
+         * @brief プログラム全体で共有するキャッシュ
+         */
+        static SpriteCache &instance();
+
+        /**
+         * @brief path の画像を返す．初めてなら読み込む
+         * @return 読み込めなかった場合は空の Sprite（次に呼んだときにもう一度読む）
+         */
+        std::shared_ptr<const Sprite> get(const std::string &path);
+
+        /**
+         * @brief 画像から Sprite を作る（CV_8UC1, CV_8UC3, CV_8UC4）
+         */
+        static std::shared_ptr<Sprite> make(const cv::Mat &src);
+
+        void clear();
+        int size() const;
+
+    private:
+        mutable std::mutex m;
+        std::unordered_map<std::string, std::shared_ptr<const Sprite> > sprites;
+};
+
+SpriteCache &SpriteCache::instance()
+{
+    static SpriteCache cache;
+    return cache;
+}
+
+std::shared_ptr<const Sprite> SpriteCache::get(const std::string &path)
+{
+    {
+        std::lock_guard<std::mutex> lock(m);
+        auto it = sprites.find(path);
+        if (it != sprites.end()) return it->second;
+    }
+
+    // 読み込みは排他制御の外で行う（同時に読んだ場合は先に入れた方を使う）
+    cv::Mat src = cv::imread(path, cv::IMREAD_UNCHANGED);
+    if (src.empty()) {
+        std::cerr << "画像を読み込めません: " << path << "\n";
+        return std::make_shared<Sprite>();
+    }
+    std::shared_ptr<const Sprite> s = make(src);
+
+    std::lock_guard<std::mutex> lock(m);
+    auto r = sprites.insert(std::make_pair(path, s));
+    return r.first->second;
+}
+
+std::shared_ptr<Sprite> SpriteCache::make(const cv::Mat &src)
+{
+    std::shared_ptr<Sprite> s = std::make_shared<Sprite>();
+    int n = src.channels();
+    cv::Mat bgra;
+    if (n == 4) {
+        bgra = src;
+        cv::cvtColor(src, s->bgr, cv::COLOR_BGRA2BGR);
+    } else if (n == 1) {
+        cv::cvtColor(src, s->bgr, cv::COLOR_GRAY2BGR);
+    } else {
+        s->bgr = src;
+    }
+
+    s->alpha = cv::Mat(s->bgr.size(), CV_8UC1, cv::Scalar(255));
+    s->opaque = true;
+    if (!bgra.empty()) {
+        for (int i = 0; i < bgra.rows; i++) {
+            const unsigned char *p = bgra.ptr<unsigned char>(i);
+            unsigned char *a = s->alpha.ptr<unsigned char>(i);
+            for (int j = 0; j < bgra.cols; j++) {
+                a[j] = p[4 * j + 3];
+                if (a[j] != 255) s->opaque = false;
+            }
+        }
+    }
+
+    if (s->opaque) {
+        s->pix = s->bgr;
+        s->alpha3 = cv::Mat(s->bgr.size(), CV_8UC3, cv::Scalar(255, 255, 255));
+        return s;
+    }
+
+    s->pix = cv::Mat(s->bgr.size(), CV_8UC3);
+    s->alpha3 = cv::Mat(s->bgr.size(), CV_8UC3);
+    for (int i = 0; i < s->rows(); i++) {
+        const unsigned char *c = s->bgr.ptr<unsigned char>(i);
+        const unsigned char *a = s->alpha.ptr<unsigned char>(i);
+        unsigned char *p = s->pix.ptr<unsigned char>(i);
+        unsigned char *a3 = s->alpha3.ptr<unsigned char>(i);
+        for (int j = 0; j < s->cols(); j++) {
+            for (int ch = 0; ch < 3; ch++) {
+                p[3 * j + ch] = (c[3 * j + ch] * a[j] + 127) / 255;
+                a3[3 * j + ch] = a[j];
+            }
+        }
+    }
+    return s;
+}
+
+void SpriteCache::clear()
+{
+    std::lock_guard<std::mutex> lock(m);
+    sprites.clear();
+}
+
+int SpriteCache::size() const
+{
+    std::lock_guard<std::mutex> lock(m);
+    return sprites.size();
+}
+
+#endif
@@ -0,0 +1,217 @@
+/**
+ * @file ThreadPool.h
+ * @brief ワークスティーリング方式のスレッドプール
+ * @author Kazumichi INOUE <k.inoue@oyama-ct.ac.jp>
+ *
+ * スレッドは最初に作ったものを使い回し，ステップごとに作ったり壊したりしない．
+ * parallelFor() に渡した仕事（0〜n-1 の番号）は最初に各スレッドへ連続した範囲で
+ * 割り振り，自分の分が終わったスレッドは他のスレッドの残りの後ろ半分を盗んで手伝う．
+ * 渡した関数は std::function に包まずに，関数オブジェクトへのポインタと呼び出し用の関数で
+ * 各スレッドへ渡すので，parallelFor() を呼ぶたびにメモリを確保しない．
+ */
+
+#ifndef __THREAD_POOL_H__
+#define __THREAD_POOL_H__
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool
+{
+    public:
+        /**
+         * @brief 仕事の関数．task は仕事の番号，worker は実行するスレッドの番号（0〜size()-1）
+         */
+        typedef std::function<void(int task, int worker)> Task;
+
+        /**
+         * @brief コンストラクタ
+         * @param n 呼び出し元を含めたスレッド数．0 ならCPUのコア数
+         */
+        explicit ThreadPool(int n = 0);
+        ~ThreadPool();
+
+        /**
+         * @brief スレッド数（呼び出し元を含む）
+         */
+        int size() const;
+
+        /**
+         * @brief 0〜nTask-1 の仕事を全スレッドで分担して実行し，全て終わるまで待つ
+         * @param fn fn(task, worker) と呼べる関数オブジェクト（ラムダ式や Task）．コピーせずに使う
+         * @details 呼び出し元のスレッドも worker 0 として仕事をする
+         */
+        template <typename F>
+        void parallelFor(int nTask, const F &fn);
+
+    private:
+        // スレッドごとの未処理の範囲 [begin, end)
+        struct Queue
+        {
+            std::mutex m;
+            int begin;
+            int end;
+            Queue() : begin(0), end(0) {}
+        };
+
+        int nWorker;
+        std::vector<std::thread> threads;
+        std::vector<Queue> queues;
+
+        std::mutex m;
+        std::condition_variable cvStart;
+        std::condition_variable cvDone;
+        const void *job;                //!< 実行中の仕事（parallelFor() に渡した関数オブジェクト）
+        void (*call)(const void *job, int task, int worker);    //!< job を呼ぶ関数
+        unsigned long generation;       //!< parallelFor() を呼んだ回数
+        int running;                    //!< 仕事中のスレッド数
+        bool quit;
+
+        template <typename F>
+        static void invoke(const void *job, int task, int worker);
+
+        void run(int nTask, const void *fn, void (*fnCall)(const void *, int, int));
+        void workerLoop(int id);
+        void work(int id);
+        bool pop(int id, int &task);
+        bool steal(int id, int &task);
+};
+
+ThreadPool::ThreadPool(int n)
+    : job(nullptr), call(nullptr), generation(0), running(0), quit(false)
+{
+    if (n <= 0) n = std::thread::hardware_concurrency();
+    if (n <= 0) n = 1;
+    nWorker = n;
+    queues = std::vector<Queue>(n);
+    for (int i = 1; i < n; i++) {
+        threads.push_back(std::thread(&ThreadPool::workerLoop, this, i));
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m);
+        quit = true;
+    }
+    cvStart.notify_all();
+    for (std::thread &t: threads) t.join();
+}
+
+int ThreadPool::size() const
+{
+    return nWorker;
+}
+
+template <typename F>
+void ThreadPool::parallelFor(int nTask, const F &fn)
+{
+    if (nTask <= 0) return;
+    if (nWorker == 1 || nTask == 1) {
+        for (int i = 0; i < nTask; i++) fn(i, 0);
+        return;
+    }
+    run(nTask, &fn, &ThreadPool::invoke<F>);
+}
+
+template <typename F>
+void ThreadPool::invoke(const void *job, int task, int worker)
+{
+    (*static_cast<const F *>(job))(task, worker);
+}
+
+void ThreadPool::run(int nTask, const void *fn, void (*fnCall)(const void *, int, int))
+{
+    // 仕事を連続した範囲で均等に配る
+    for (int i = 0; i < nWorker; i++) {
+        std::lock_guard<std::mutex> lock(queues[i].m);
+        queues[i].begin = (long)nTask * i / nWorker;
+        queues[i].end   = (long)nTask * (i + 1) / nWorker;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m);
+        job = fn;
+        call = fnCall;
+        running = nWorker;
+        generation++;
+    }
+    cvStart.notify_all();
+
+    work(0);
+
+    std::unique_lock<std::mutex> lock(m);
+    cvDone.wait(lock, [this] { return running == 0; });
+    job = nullptr;
+    call = nullptr;
+}
+
+void ThreadPool::workerLoop(int id)
+{
+    unsigned long seen = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(m);
+            cvStart.wait(lock, [&] { return quit || generation != seen; });
+            if (quit) return;
+            seen = generation;
+        }
+        work(id);
+    }
+}
+
+void ThreadPool::work(int id)
+{
+    int task;
+    while (pop(id, task) || steal(id, task)) {
+        call(job, task, id);
+    }
+
+    std::lock_guard<std::mutex> lock(m);
+    if (--running == 0) cvDone.notify_all();
+}
+
+// 自分の範囲の先頭を1つ取る
+bool ThreadPool::pop(int id, int &task)
+{
+    Queue &q = queues[id];
+    std::lock_guard<std::mutex> lock(q.m);
+    if (q.begin >= q.end) return false;
+    task = q.begin++;
+    return true;
+}
+
+// 他のスレッドの残りの後ろ半分をもらい，その先頭を1つ取る
+bool ThreadPool::steal(int id, int &task)
+{
+    for (int k = 1; k < nWorker; k++) {
+        int victim = (id + k) % nWorker;
+        int b, e;
+        {
+            Queue &q = queues[victim];
+            std::lock_guard<std::mutex> lock(q.m);
+            int rest = q.end - q.begin;
+            if (rest <= 0) continue;
+            int half = (rest + 1) / 2;
+            e = q.end;
+            b = q.end - half;
+            q.end = b;
+        }
+        {
+            Queue &q = queues[id];
+            std::lock_guard<std::mutex> lock(q.m);
+            q.begin = b + 1;
+            q.end = e;
+        }
+        task = b;
+        return true;
+    }
+    return false;
+}
+
+#endif
@@ -0,0 +1,477 @@
+/**
+ * @file TiledCanvas.h
+ * @brief 広い領域を描くための，必要な所だけ画像を確保するキャンバス
+ * @author Kazumichi INOUE <k.inoue@oyama-ct.ac.jp>
+ *
+ * Drawer は描画領域全体を1枚の画像として確保する．200m 四方を 5mm/pixel で描くと
+ * 40000x40000 画素（約 4.8GB）になる．TiledCanvas は描画領域を TILE x TILE 画素の
+ * タイルに分け，何かを描いたタイルだけを確保する．座標の決め方（csize, 原点）と
+ * 描画関数（drawing, drawPoints, line, circle, text）は Drawer と同じ．
+ * 見るときは，一部を切り出す（crop()）か，全体を縮小して並べる（mosaic()）．
+ */
+
+#ifndef __TILED_CANVAS_H__
+#define __TILED_CANVAS_H__
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <opencv2/opencv.hpp>
+
+class TiledCanvas
+{
+    public:
+        static const int TILE = 256;    //!< タイルの一辺 [pixel]
+
+        /**
+         * @brief デフォルトコンストラクタ．Drawer と同じ初期設定（600x600 画素，5mm/pixel）
+         */
+        TiledCanvas();
+
+        /**
+         * @brief タイルを全て捨て，座標軸だけを描き直す．画像サイズは現時点のものを引き継ぐ
+         */
+        void reset();
+
+        // 描画領域の設定（Drawer と同じ）
+        void setCsize(double val);
+        void setImgWidth(double val);
+        void setImgHight(double val);
+        void setOriginXfromLeft(double val);
+        void setOriginYfromBottom(double val);
+
+        /**
+         * @brief 何も描いていない所の色
+         */
+        void setBackground(cv::Scalar c);
+
+        void setPointColor(cv::Scalar c);
+        void setLineColor(cv::Scalar c);
+        void setLineWidth(int w);
+
+        int getWidth() const;
+        int getHight() const;
+
+        /**
+         * @brief 確保したタイルの数
+         */
+        int getTileCount() const;
+
+        /**
+         * @brief 確保したタイルの画素が使うメモリ [byte]
+         */
+        size_t getBytes() const;
+
+        /**
+         * @brief 実座標をピクセル座標に変換する（Drawer と同じく小数点以下を切り捨てる）
+         */
+        cv::Point toPixel(double x, double y) const;
+
+        /**
+         * @brief a の位置に点を打つ（Drawer::drawing() と同じ）
+         */
+        template <typename T> void drawing(T &a);
+
+        /**
+         * @brief x[i], y[i] (i = 0〜n-1) の位置にまとめて点を打つ
+         * @details 直前に書いたタイルを覚えておき，続く点が同じタイルなら探し直さない
+         */
+        void drawPoints(const double *x, const double *y, int n);
+
+        /**
+         * @brief 集合の全ロボットの位置に点を打つ
+         * @details getXData(), getYData(), size() を持つクラス（RobotBatch など）
+         */
+        template <typename T> void drawPoints(const T &batch);
+
+        /**
+         * @brief 2点を結ぶ直線（ピクセル座標系）
+         * @details 線が通るタイルだけを確保して描く
+         */
+        void line(cv::Point p1, cv::Point p2);
+
+        /**
+         * @brief 2点を結ぶ直線（実座標系）．描画領域の外は切り落とす
+         */
+        void line(double x1, double y1, double x2, double y2);
+
+        void lineRA(double x1, double y1, double r, double angle);
+        void lineRA2(double x1, double y1, double r, double angle);
+
+        void circle(cv::Point p, int radius, bool fill = true);
+        void circle(double x1, double y1, double radius, bool fill = true);
+
+        void text(double x, double y, std::string text);
+
+        /**
+         * @brief ピクセル座標系の矩形 r を切り出した画像
+         * @details 確保していないタイルの所は背景色になる．描画領域の外は背景色で埋める
+         */
+        cv::Mat crop(cv::Rect r) const;
+
+        /**
+         * @brief 実座標系の矩形 (x1, y1)-(x2, y2) を切り出した画像
+         */
+        cv::Mat crop(double x1, double y1, double x2, double y2) const;
+
+        /**
+         * @brief 描画領域全体を 1/factor に縮小した画像
+         * @details タイルごとに縮小して並べる．確保していないタイルは縮小せずに背景色で埋める
+         */
+        cv::Mat mosaic(int factor) const;
+
+        /**
+         * @brief 描画領域全体を幅 maxWidth・高さ maxHight に収まるよう整数分の1に縮小した画像
+         */
+        cv::Mat mosaic(int maxWidth, int maxHight) const;
+
+    private:
+        int IMG_WIDTH;      //!< 描画領域の幅 [pixel]
+        int IMG_HIGHT;      //!< 描画領域の高さ [pixel]
+        int IMG_ORIGIN_X;   //!< 原点のX座標 [pixel]
+        int IMG_ORIGIN_Y;   //!< 原点のY座標 [pixel]
+        double csize;       //!< 解像度 [m/pixel]
+
+        cv::Scalar background;
+        cv::Scalar point_color;
+        cv::Scalar line_color;
+        int line_width;
+
+        int tilesX;         //!< 横のタイルの数
+        int tilesY;         //!< 縦のタイルの数
+        std::unordered_map<int64_t, cv::Mat> tiles;
+
+        int64_t key(int tx, int ty) const;
+        cv::Mat *find(int tx, int ty);
+        const cv::Mat *find(int tx, int ty) const;
+        cv::Mat &tile(int tx, int ty);
+
+        // ピクセル座標系の矩形 r（描画領域で切り取る）にかかるタイルの範囲
+        bool tileRange(cv::Rect r, int &tx0, int &ty0, int &tx1, int &ty1) const;
+};
+
+TiledCanvas::TiledCanvas()
+{
+    IMG_WIDTH = 600;
+    IMG_HIGHT = 600;
+    IMG_ORIGIN_X = IMG_WIDTH / 2;
+    IMG_ORIGIN_Y = IMG_HIGHT * (1.0 - 1.0/ 6);
+    csize = 0.005;
+    background = cv::Scalar(182, 182, 182);
+    reset();
+}
+
+void TiledCanvas::reset()
+{
+    tiles.clear();
+    tilesX = (IMG_WIDTH + TILE - 1) / TILE;
+    tilesY = (IMG_HIGHT + TILE - 1) / TILE;
+
+    point_color = cv::Scalar(0, 0, 0);
+    line_color = cv::Scalar(200, 0, 0);
+    line_width = 1;
+
+    // 座標軸（通るタイルだけ確保される）
+    line_color = cv::Scalar(0, 0, 0);
+    line(cv::Point(0, IMG_ORIGIN_Y), cv::Point(IMG_WIDTH, IMG_ORIGIN_Y));
+    line(cv::Point(IMG_ORIGIN_X, 0), cv::Point(IMG_ORIGIN_X, IMG_HIGHT));
+    line_color = cv::Scalar(200, 0, 0);
+}
+
+void TiledCanvas::setCsize(double val)
+{
+    csize = val;
+    reset();
+}
+
+void TiledCanvas::setImgWidth(double val)
+{
+    IMG_WIDTH = val/csize;
+    reset();
+}
+
+void TiledCanvas::setImgHight(double val)
+{
+    IMG_HIGHT = val/csize;
+    reset();
+}
+
+void TiledCanvas::setOriginXfromLeft(double val)
+{
+    IMG_ORIGIN_X = val/csize;
+    reset();
+}
+
+void TiledCanvas::setOriginYfromBottom(double val)
+{
+    IMG_ORIGIN_Y = IMG_HIGHT - val/csize;
+    reset();
+}
+
+void TiledCanvas::setBackground(cv::Scalar c)
+{
+    background = c;
+}
+
+void TiledCanvas::setPointColor(cv::Scalar c)
+{
+    point_color = c;
+}
+
+void TiledCanvas::setLineColor(cv::Scalar c)
+{
+    line_color = c;
+}
+
+void TiledCanvas::setLineWidth(int w)
+{
+    line_width = w;
+}
+
+int TiledCanvas::getWidth() const { return IMG_WIDTH; }
+int TiledCanvas::getHight() const { return IMG_HIGHT; }
+
+int TiledCanvas::getTileCount() const
+{
+    return tiles.size();
+}
+
+size_t TiledCanvas::getBytes() const
+{
+    return tiles.size() * (size_t)TILE * TILE * 3;
+}
+
+cv::Point TiledCanvas::toPixel(double x, double y) const
+{
+    // 遠くの点でも int からあふれないように丸めておく
+    double px = std::max(-1e9, std::min(1e9, x / csize + IMG_ORIGIN_X));
+    double py = std::max(-1e9, std::min(1e9,-y / csize + IMG_ORIGIN_Y));
+    return cv::Point((int)px, (int)py);
+}
+
+int64_t TiledCanvas::key(int tx, int ty) const
+{
+    return (int64_t)ty * tilesX + tx;
+}
+
+cv::Mat *TiledCanvas::find(int tx, int ty)
+{
+    auto it = tiles.find(key(tx, ty));
+    return (it == tiles.end()) ? nullptr : &it->second;
+}
+
+const cv::Mat *TiledCanvas::find(int tx, int ty) const
+{
+    auto it = tiles.find(key(tx, ty));
+    return (it == tiles.end()) ? nullptr : &it->second;
+}
+
+cv::Mat &TiledCanvas::tile(int tx, int ty)
+{
+    cv::Mat &t = tiles[key(tx, ty)];
+    if (t.empty()) t = cv::Mat(cv::Size(TILE, TILE), CV_8UC3, background);
+    return t;
+}
+
+bool TiledCanvas::tileRange(cv::Rect r, int &tx0, int &ty0, int &tx1, int &ty1) const
+{
+    r &= cv::Rect(0, 0, IMG_WIDTH, IMG_HIGHT);
+    if (r.empty()) return false;
+    tx0 = r.x / TILE;
+    ty0 = r.y / TILE;
+    tx1 = (r.x + r.width - 1) / TILE;
+    ty1 = (r.y + r.height - 1) / TILE;
+    return true;
+}
+
+template <typename T>
+void TiledCanvas::drawing(T &a)
+{
+    double x = a.getX();
+    double y = a.getY();
+    drawPoints(&x, &y, 1);
+}
+
+void TiledCanvas::drawPoints(const double *x, const double *y, int n)
+{
+    unsigned char c0 = point_color[0];
+    unsigned char c1 = point_color[1];
+    unsigned char c2 = point_color[2];
+
+    int lastX = -1, lastY = -1;
+    cv::Mat *t = nullptr;
+    for (int i = 0; i < n; i++) {
+        int ix = x[i] / csize + IMG_ORIGIN_X;
+        int iy =-y[i] / csize + IMG_ORIGIN_Y;
+        if (ix < 0 || ix >= IMG_WIDTH || iy < 0 || iy >= IMG_HIGHT) continue;
+
+        int tx = ix / TILE, ty = iy / TILE;
+        if (tx != lastX || ty != lastY) {
+            t = &tile(tx, ty);
+            lastX = tx;
+            lastY = ty;
+        }
+        unsigned char *p = t->ptr<unsigned char>(iy - ty * TILE) + (ix - tx * TILE) * 3;
+        p[0] = c0;
+        p[1] = c1;
+        p[2] = c2;
+    }
+}
+
+template <typename T>
+void TiledCanvas::drawPoints(const T &batch)
+{
+    drawPoints(batch.getXData(), batch.getYData(), batch.size());
+}
+
+void TiledCanvas::line(cv::Point p1, cv::Point p2)
+{
+    // 描画領域で切り落としてから，線が通るタイルだけに描く
+    if (!cv::clipLine(cv::Rect(0, 0, IMG_WIDTH, IMG_HIGHT), p1, p2)) return;
+
+    int m = line_width + 1;     // 線の太さと AA のにじみの分だけタイルを広げて判定する
+    cv::Rect box(std::min(p1.x, p2.x) - m, std::min(p1.y, p2.y) - m,
+                 std::abs(p1.x - p2.x) + 2 * m + 1, std::abs(p1.y - p2.y) + 2 * m + 1);
+    int tx0, ty0, tx1, ty1;
+    if (!tileRange(box, tx0, ty0, tx1, ty1)) return;
+
+    for (int ty = ty0; ty <= ty1; ty++) {
+        for (int tx = tx0; tx <= tx1; tx++) {
+            cv::Point o(tx * TILE, ty * TILE);
+            cv::Point q1 = p1, q2 = p2;
+            if (!cv::clipLine(cv::Rect(o.x - m, o.y - m, TILE + 2 * m, TILE + 2 * m), q1, q2)) continue;
+            cv::line(tile(tx, ty), cv::Point(p1.x - o.x, p1.y - o.y), cv::Point(p2.x - o.x, p2.y - o.y),
+                     line_color, line_width, cv::LINE_AA, 0);
+        }
+    }
+}
+
+void TiledCanvas::line(double x1, double y1, double x2, double y2)
+{
+    line(toPixel(x1, y1), toPixel(x2, y2));
+}
+
+void TiledCanvas::lineRA(double x1, double y1, double r, double angle)
+{
+    line(x1, y1, x1 + r * cos(angle), y1 + r * sin(angle));
+}
+
+void TiledCanvas::lineRA2(double x1, double y1, double r, double angle)
+{
+    lineRA(x1, y1, r, angle);
+    lineRA(x1, y1, r, angle + M_PI);
+}
+
+void TiledCanvas::circle(cv::Point p, int radius, bool fill)
+{
+    int m = radius + line_width + 1;
+    int tx0, ty0, tx1, ty1;
+    if (!tileRange(cv::Rect(p.x - m, p.y - m, 2 * m + 1, 2 * m + 1), tx0, ty0, tx1, ty1)) return;
+
+    for (int ty = ty0; ty <= ty1; ty++) {
+        for (int tx = tx0; tx <= tx1; tx++) {
+            // タイルの中で中心に最も近い点・最も遠い点までの距離で，円がかかるかを判定する
+            double dx = std::max(0, std::max(tx * TILE - p.x, p.x - (tx + 1) * TILE));
+            double dy = std::max(0, std::max(ty * TILE - p.y, p.y - (ty + 1) * TILE));
+            if (sqrt(dx * dx + dy * dy) > m) continue;
+            if (!fill) {
+                double fx = std::max(std::abs(tx * TILE - p.x), std::abs((tx + 1) * TILE - p.x));
+                double fy = std::max(std::abs(ty * TILE - p.y), std::abs((ty + 1) * TILE - p.y));
+                if (sqrt(fx * fx + fy * fy) < radius - line_width - 1) continue;   // 輪の内側
+            }
+            cv::Point c(p.x - tx * TILE, p.y - ty * TILE);
+            cv::circle(tile(tx, ty), c, radius, line_color, fill ? -1 : line_width, cv::LINE_AA, 0);
+        }
+    }
+}
+
+void TiledCanvas::circle(double x1, double y1, double radius, bool fill)
+{
+    circle(toPixel(x1, y1), radius/csize, fill);
+}
+
+void TiledCanvas::text(double x, double y, std::string text)
+{
+    cv::Point p = toPixel(x, y);
+    int baseline = 0;
+    cv::Size s = cv::getTextSize(text, cv::FONT_HERSHEY_SIMPLEX, 1.0, 1, &baseline);
+    int tx0, ty0, tx1, ty1;
+    if (!tileRange(cv::Rect(p.x - 2, p.y - s.height - 2, s.width + 4, s.height + baseline + 4),
+                   tx0, ty0, tx1, ty1)) return;
+
+    for (int ty = ty0; ty <= ty1; ty++) {
+        for (int tx = tx0; tx <= tx1; tx++) {
+            cv::putText(tile(tx, ty), text, cv::Point(p.x - tx * TILE, p.y - ty * TILE),
+                        cv::FONT_HERSHEY_SIMPLEX, 1.0, line_color, 1, cv::LINE_AA, false);
+        }
+    }
+}
+
+cv::Mat TiledCanvas::crop(cv::Rect r) const
+{
+    cv::Mat out(r.size(), CV_8UC3, background);
+    int tx0, ty0, tx1, ty1;
+    if (!tileRange(r, tx0, ty0, tx1, ty1)) return out;
+
+    for (int ty = ty0; ty <= ty1; ty++) {
+        for (int tx = tx0; tx <= tx1; tx++) {
+            const cv::Mat *t = find(tx, ty);
+            if (!t) continue;
+            // 端のタイルには描画領域の外にはみ出して描いた所があるので，領域で切り取る
+            cv::Rect tr(tx * TILE, ty * TILE, TILE, TILE);
+            cv::Rect c = tr & r & cv::Rect(0, 0, IMG_WIDTH, IMG_HIGHT);
+            if (c.empty()) continue;
+            cv::Mat src = (*t)(cv::Rect(c.x - tr.x, c.y - tr.y, c.width, c.height));
+            cv::Mat dst = out(cv::Rect(c.x - r.x, c.y - r.y, c.width, c.height));
+            src.copyTo(dst);
+        }
+    }
+    return out;
+}
+
+cv::Mat TiledCanvas::crop(double x1, double y1, double x2, double y2) const
+{
+    cv::Point p1 = toPixel(std::min(x1, x2), std::max(y1, y2));
+    cv::Point p2 = toPixel(std::max(x1, x2), std::min(y1, y2));
+    return crop(cv::Rect(p1.x, p1.y, p2.x - p1.x, p2.y - p1.y));
+}
+
+cv::Mat TiledCanvas::mosaic(int factor) const
+{
+    if (factor < 1) factor = 1;
+    int w = (IMG_WIDTH + factor - 1) / factor;
+    int h = (IMG_HIGHT + factor - 1) / factor;
+    cv::Mat out(cv::Size(w, h), CV_8UC3, background);
+
+    // タイルの境界が縮小後の画素の境界になるとは限らないので，タイルごとに対応する範囲を求めて縮小する
+    cv::Mat small;
+    for (const auto &kv: tiles) {
+        int tx = kv.first % tilesX;
+        int ty = kv.first / tilesX;
+        int x0 = tx * TILE / factor, x1 = std::min(w, ((tx + 1) * TILE + factor - 1) / factor);
+        int y0 = ty * TILE / factor, y1 = std::min(h, ((ty + 1) * TILE + factor - 1) / factor);
+        if (x1 <= x0 || y1 <= y0) continue;
+
+        // 縮小先の画素 [x0, x1) に対応する元の範囲（隣のタイルや描画領域の外にかかる所は crop() で補う）
+        cv::Rect src(x0 * factor, y0 * factor, (x1 - x0) * factor, (y1 - y0) * factor);
+        cv::Rect inTile = src & cv::Rect(tx * TILE, ty * TILE, TILE, TILE) & cv::Rect(0, 0, IMG_WIDTH, IMG_HIGHT);
+        cv::Mat part = (inTile == src)
+                     ? kv.second(cv::Rect(src.x - tx * TILE, src.y - ty * TILE, src.width, src.height))
+                     : crop(src);
+        cv::resize(part, small, cv::Size(x1 - x0, y1 - y0), 0, 0, cv::INTER_AREA);
+        cv::Mat dst = out(cv::Rect(x0, y0, x1 - x0, y1 - y0));
+        small.copyTo(dst);
+    }
+    return out;
+}
+
+cv::Mat TiledCanvas::mosaic(int maxWidth, int maxHight) const
+{
+    int fx = (IMG_WIDTH + maxWidth - 1) / std::max(1, maxWidth);
+    int fy = (IMG_HIGHT + maxHight - 1) / std::max(1, maxHight);
+    return mosaic(std::max(1, std::max(fx, fy)));
+}
+
+#endif
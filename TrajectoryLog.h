@@ -0,0 +1,575 @@
+/**
+ * @file TrajectoryLog.h
+ * @brief ロボット集合の姿勢を列指向のバイナリファイルに記録し，mmap で読み出す
+ * @author Kazumichi INOUE <k.inoue@oyama-ct.ac.jp>
+ *
+ * ファイルの構成（数値はすべて実行した計算機のバイト順）
+ *   ヘッダ   LogHeader，経路（numCommands 個の v, w, duration），64バイト境界まで0詰め
+ *   フレーム LogFrameHeader（64バイト），x[n]，y[n]，θ[n]
+ *            各列は float か double の配列で，64バイト境界まで0詰めする
+ * 列が64バイト境界にそろっているので，読み出し側は mmap した領域をそのまま
+ * Drawer::drawPoints() や PoseStatistics::add() に渡せる（コピーしない）．
+ * 書き込みは実行しながら1フレームずつ追記する．途中で止まったファイルも，
+ * 最後まで書けたフレームまでは読める．
+ */
+
+#ifndef __TRAJECTORY_LOG_H__
+#define __TRAJECTORY_LOG_H__
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "CommandTimeline.h"
+#include "Noise.h"
+#include "RobotBatch.h"
+
+/**
+ * @brief 列の精度
+ */
+enum LogPrecision
+{
+    LOG_FLOAT = 4,          //!< float（ファイルが半分になる．読み出し時に double に直す）
+    LOG_DOUBLE = 8          //!< double（そのまま渡せる）
+};
+
+/**
+ * @brief ファイルの先頭
+ */
+struct LogHeader
+{
+    char magic[8];          //!< "TRAJLOG"
+    uint32_t version;
+    uint32_t precision;     //!< LogPrecision
+    double dt;              //!< 時間の刻み幅 [s]
+    double a[6];            //!< MotionParam の a1〜a6
+    uint64_t seed;          //!< 乱数の種
+    uint32_t numCommands;   //!< 経路の区間の数
+    uint32_t reserved;
+};
+
+/**
+ * @brief フレームの先頭（64バイト）
+ */
+struct LogFrameHeader
+{
+    uint32_t magic;         //!< 'FRAM'
+    uint32_t n;             //!< ロボットの数
+    uint64_t step;          //!< RobotBatch::getStep()
+    double t;               //!< 時刻 [s]
+    uint64_t bytes;         //!< このヘッダを含むフレーム全体の大きさ
+    uint64_t reserved[4];
+};
+
+namespace trajlog
+{
+    const char MAGIC[8] = "TRAJLOG";
+    const uint32_t VERSION = 1;
+    const uint32_t FRAME_MAGIC = 0x4d415246;    // "FRAM"
+    const size_t ALIGN = 64;
+
+    inline size_t align(size_t s)
+    {
+        return (s + ALIGN - 1) / ALIGN * ALIGN;
+    }
+}
+
+/**
+ * @brief 列の参照（コピーしない）
+ */
+template <typename T>
+struct LogSpan
+{
+    const T *p;
+    int n;
+
+    LogSpan() : p(nullptr), n(0) {}
+    LogSpan(const T *p_, int n_) : p(p_), n(n_) {}
+
+    const T *data() const { return p; }
+    int size() const { return n; }
+    bool empty() const { return n == 0; }
+    const T &operator[](int i) const { return p[i]; }
+    const T *begin() const { return p; }
+    const T *end() const { return p + n; }
+};
+
+/**
+ * @brief ファイル中の1フレーム
+ * @details 列は mmap した領域を指すので，TrajectoryLogReader を閉じるまで有効．
+ *          double のログなら getXData() などで RobotBatch と同じように扱える
+ */
+class TrajectoryFrame
+{
+    public:
+        TrajectoryFrame();
+        TrajectoryFrame(const LogFrameHeader *h, LogPrecision precision_);
+
+        uint64_t getStep() const;
+        double getTime() const;
+        int size() const;
+        LogPrecision getPrecision() const;
+
+        /**
+         * @brief double の列（float のログなら空）
+         */
+        LogSpan<double> getX() const;
+        LogSpan<double> getY() const;
+        LogSpan<double> getTh() const;
+
+        /**
+         * @brief float の列（double のログなら空）
+         */
+        LogSpan<float> getXFloat() const;
+        LogSpan<float> getYFloat() const;
+        LogSpan<float> getThFloat() const;
+
+        const double *getXData() const;
+        const double *getYData() const;
+        const double *getThData() const;
+
+        /**
+         * @brief 列を double の塊にして f(x, y, th, n) に順に渡す
+         * @details double のログなら列全体を1回で渡す（コピーしない）．
+         *          float のログなら block 台ずつ double に直して渡す
+         */
+        template <typename F> void scan(F f, int block = 4096) const;
+
+    private:
+        const LogFrameHeader *head;
+        LogPrecision precision;
+
+        const char *column(int c) const;
+};
+
+/**
+ * @brief ログを書き出す
+ */
+class TrajectoryLogWriter
+{
+    public:
+        TrajectoryLogWriter();
+        ~TrajectoryLogWriter();
+
+        /**
+         * @brief ファイルを作り，ヘッダを書く
+         * @return 作れなかった場合は false
+         */
+        bool open(const std::string &path, const MotionParam &param, double dt,
+                  const CommandTimeline &tl, uint64_t seed, LogPrecision precision = LOG_DOUBLE);
+
+        /**
+         * @brief 1フレームを追記する
+         * @return 書けなかった場合は false．最初の失敗を1回だけ知らせ，ファイルを閉じて以後は書かない
+         */
+        bool write(uint64_t step, double t, const double *x, const double *y, const double *th, int n);
+
+        /**
+         * @brief 集合の現在の姿勢を1フレームとして追記する
+         * @details T は getXData(), getYData(), getThData(), size() を持つクラス
+         *          （RobotBatch, Snapshot など）
+         */
+        template <typename T> bool write(const T &batch, uint64_t step, double t);
+        bool write(const RobotBatch &rb, double t);
+
+        /**
+         * @brief ファイルを閉じる
+         * @return open() してから書き込みか閉じるのに失敗していれば false（ログは途中で切れている）
+         */
+        bool close();
+
+        /**
+         * @brief 書き込める状態か（書き込みに失敗した後は false）
+         */
+        bool isOpen() const;
+
+        /**
+         * @brief open() してから書き込みに失敗したか
+         */
+        bool hasError() const;
+
+        long getFrameCount() const;
+
+    private:
+        FILE *fp;
+        std::string path;
+        LogPrecision precision;
+        long frames;
+        bool error;
+        std::vector<float> buf;     //!< float に直すための作業領域（使い回す）
+
+        bool put(const void *p, size_t size, size_t count);
+        void fail();
+        bool pad(size_t bytes);
+        bool writeColumn(const double *a, int n);
+};
+
+/**
+ * @brief ログを mmap して読み出す
+ */
+class TrajectoryLogReader
+{
+    public:
+        TrajectoryLogReader();
+        ~TrajectoryLogReader();
+
+        /**
+         * @brief ファイルを開いてフレームの位置を調べる
+         * @return 開けなかった場合や，形式が違う場合は false
+         */
+        bool open(const std::string &path);
+        void close();
+
+        const MotionParam &getParam() const;
+        double getDt() const;
+        uint64_t getSeed() const;
+        const CommandTimeline &getTimeline() const;
+        LogPrecision getPrecision() const;
+
+        /**
+         * @brief フレームの数
+         */
+        int size() const;
+        TrajectoryFrame operator[](int i) const;
+
+    private:
+        const char *base;
+        size_t length;
+        LogPrecision precision;
+        double dt;
+        uint64_t seed;
+        MotionParam param;
+        CommandTimeline tl;
+        std::vector<size_t> offset;     //!< 各フレームの先頭の位置
+};
+
+TrajectoryFrame::TrajectoryFrame() : head(nullptr), precision(LOG_DOUBLE)
+{
+}
+
+TrajectoryFrame::TrajectoryFrame(const LogFrameHeader *h, LogPrecision precision_)
+    : head(h), precision(precision_)
+{
+}
+
+uint64_t TrajectoryFrame::getStep() const  { return head->step; }
+double TrajectoryFrame::getTime() const    { return head->t; }
+int TrajectoryFrame::size() const          { return head->n; }
+LogPrecision TrajectoryFrame::getPrecision() const { return precision; }
+
+const char *TrajectoryFrame::column(int c) const
+{
+    const char *p = reinterpret_cast<const char *>(head) + sizeof(LogFrameHeader);
+    return p + c * trajlog::align((size_t)head->n * precision);
+}
+
+LogSpan<double> TrajectoryFrame::getX() const  { return LogSpan<double>(getXData(), getXData() ? size() : 0); }
+LogSpan<double> TrajectoryFrame::getY() const  { return LogSpan<double>(getYData(), getYData() ? size() : 0); }
+LogSpan<double> TrajectoryFrame::getTh() const { return LogSpan<double>(getThData(), getThData() ? size() : 0); }
+
+LogSpan<float> TrajectoryFrame::getXFloat() const
+{
+    if (precision != LOG_FLOAT) return LogSpan<float>();
+    return LogSpan<float>(reinterpret_cast<const float *>(column(0)), size());
+}
+
+LogSpan<float> TrajectoryFrame::getYFloat() const
+{
+    if (precision != LOG_FLOAT) return LogSpan<float>();
+    return LogSpan<float>(reinterpret_cast<const float *>(column(1)), size());
+}
+
+LogSpan<float> TrajectoryFrame::getThFloat() const
+{
+    if (precision != LOG_FLOAT) return LogSpan<float>();
+    return LogSpan<float>(reinterpret_cast<const float *>(column(2)), size());
+}
+
+const double *TrajectoryFrame::getXData() const
+{
+    return (precision == LOG_DOUBLE) ? reinterpret_cast<const double *>(column(0)) : nullptr;
+}
+
+const double *TrajectoryFrame::getYData() const
+{
+    return (precision == LOG_DOUBLE) ? reinterpret_cast<const double *>(column(1)) : nullptr;
+}
+
+const double *TrajectoryFrame::getThData() const
+{
+    return (precision == LOG_DOUBLE) ? reinterpret_cast<const double *>(column(2)) : nullptr;
+}
+
+template <typename F>
+void TrajectoryFrame::scan(F f, int block) const
+{
+    int n = size();
+    if (precision == LOG_DOUBLE) {
+        f(getXData(), getYData(), getThData(), n);
+        return;
+    }
+
+    LogSpan<float> fx = getXFloat(), fy = getYFloat(), fth = getThFloat();
+    int b = (n < block) ? n : block;
+    std::vector<double> x(b), y(b), th(b);
+    for (int i0 = 0; i0 < n; i0 += block) {
+        int m = (n - i0 < block) ? n - i0 : block;
+        for (int i = 0; i < m; i++) {
+            x[i] = fx[i0 + i];
+            y[i] = fy[i0 + i];
+            th[i] = fth[i0 + i];
+        }
+        f(x.data(), y.data(), th.data(), m);
+    }
+}
+
+TrajectoryLogWriter::TrajectoryLogWriter() : fp(nullptr), precision(LOG_DOUBLE), frames(0), error(false)
+{
+}
+
+TrajectoryLogWriter::~TrajectoryLogWriter()
+{
+    close();
+}
+
+bool TrajectoryLogWriter::open(const std::string &path_, const MotionParam &param, double dt,
+                               const CommandTimeline &tl, uint64_t seed, LogPrecision precision_)
+{
+    close();
+    fp = fopen(path_.c_str(), "wb");
+    if (!fp) {
+        std::cerr << "ログファイルを作れません: " << path_ << "\n";
+        return false;
+    }
+    setvbuf(fp, nullptr, _IOFBF, 1 << 20);
+    path = path_;
+    precision = precision_;
+    frames = 0;
+    error = false;
+
+    LogHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, trajlog::MAGIC, sizeof(h.magic));
+    h.version = trajlog::VERSION;
+    h.precision = precision;
+    h.dt = dt;
+    h.a[0] = param.a1;
+    h.a[1] = param.a2;
+    h.a[2] = param.a3;
+    h.a[3] = param.a4;
+    h.a[4] = param.a5;
+    h.a[5] = param.a6;
+    h.seed = seed;
+    h.numCommands = tl.size();
+    if (!put(&h, sizeof(h), 1)) return false;
+
+    for (const Command &c: tl) {
+        double d[3] = { c.v, c.w, c.duration };
+        if (!put(d, sizeof(d), 1)) return false;
+    }
+    size_t bytes = sizeof(h) + tl.size() * 3 * sizeof(double);
+    return pad(trajlog::align(bytes) - bytes);
+}
+
+bool TrajectoryLogWriter::write(uint64_t step, double t, const double *x, const double *y, const double *th, int n)
+{
+    if (!fp) return false;
+
+    size_t col = trajlog::align((size_t)n * precision);
+    LogFrameHeader h;
+    memset(&h, 0, sizeof(h));
+    h.magic = trajlog::FRAME_MAGIC;
+    h.n = n;
+    h.step = step;
+    h.t = t;
+    h.bytes = sizeof(h) + 3 * col;
+    if (!put(&h, sizeof(h), 1) || !writeColumn(x, n) || !writeColumn(y, n) || !writeColumn(th, n)) return false;
+    frames++;
+    return true;
+}
+
+template <typename T>
+bool TrajectoryLogWriter::write(const T &batch, uint64_t step, double t)
+{
+    return write(step, t, batch.getXData(), batch.getYData(), batch.getThData(), batch.size());
+}
+
+bool TrajectoryLogWriter::write(const RobotBatch &rb, double t)
+{
+    return write(rb, rb.getStep(), t);
+}
+
+bool TrajectoryLogWriter::close()
+{
+    if (fp) {
+        // バッファに残っていた分はここで書かれるので，閉じるときの失敗も書き込みの失敗として扱う
+        if (fclose(fp) != 0 && !error) {
+            std::cerr << "ログを書き出せません: " << path << "\n";
+            error = true;
+        }
+        fp = nullptr;
+    }
+    return !error;
+}
+
+bool TrajectoryLogWriter::isOpen() const
+{
+    return fp != nullptr;
+}
+
+bool TrajectoryLogWriter::hasError() const
+{
+    return error;
+}
+
+long TrajectoryLogWriter::getFrameCount() const
+{
+    return frames;
+}
+
+// 書けなければ fail() して false
+bool TrajectoryLogWriter::put(const void *p, size_t size, size_t count)
+{
+    if (count == 0 || fwrite(p, size, count, fp) == count) return true;
+    fail();
+    return false;
+}
+
+// 最初の失敗を知らせ，ファイルを閉じる（ディスクが一杯なら以後も書けないので）
+void TrajectoryLogWriter::fail()
+{
+    std::cerr << "ログを書き出せません（ここで記録をやめます）: " << path
+              << "，" << frames << " フレーム目\n";
+    fclose(fp);
+    fp = nullptr;
+    error = true;
+}
+
+bool TrajectoryLogWriter::pad(size_t bytes)
+{
+    static const char zero[trajlog::ALIGN] = {};
+    return put(zero, 1, bytes);
+}
+
+bool TrajectoryLogWriter::writeColumn(const double *a, int n)
+{
+    size_t bytes = (size_t)n * precision;
+    bool ok;
+    if (precision == LOG_DOUBLE) {
+        ok = put(a, sizeof(double), n);
+    } else {
+        buf.resize(n);
+        for (int i = 0; i < n; i++) buf[i] = (float)a[i];
+        ok = put(buf.data(), sizeof(float), n);
+    }
+    return ok && pad(trajlog::align(bytes) - bytes);
+}
+
+TrajectoryLogReader::TrajectoryLogReader()
+    : base(nullptr), length(0), precision(LOG_DOUBLE), dt(0.0), seed(0)
+{
+}
+
+TrajectoryLogReader::~TrajectoryLogReader()
+{
+    close();
+}
+
+bool TrajectoryLogReader::open(const std::string &path)
+{
+    close();
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "ログファイルを開けません: " << path << "\n";
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(LogHeader)) {
+        std::cerr << "ログファイルではありません: " << path << "\n";
+        ::close(fd);
+        return false;
+    }
+    length = st.st_size;
+    void *p = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) {
+        std::cerr << "ログファイルを mmap できません: " << path << "\n";
+        length = 0;
+        return false;
+    }
+    base = static_cast<const char *>(p);
+    madvise(p, length, MADV_SEQUENTIAL);
+
+    const LogHeader *h = reinterpret_cast<const LogHeader *>(base);
+    size_t bytes = sizeof(LogHeader) + (size_t)h->numCommands * 3 * sizeof(double);
+    if (memcmp(h->magic, trajlog::MAGIC, sizeof(h->magic)) != 0 || h->version != trajlog::VERSION
+        || (h->precision != LOG_FLOAT && h->precision != LOG_DOUBLE) || bytes > length) {
+        std::cerr << "ログファイルの形式が違います: " << path << "\n";
+        close();
+        return false;
+    }
+    precision = (LogPrecision)h->precision;
+    dt = h->dt;
+    seed = h->seed;
+    param.a1 = h->a[0];
+    param.a2 = h->a[1];
+    param.a3 = h->a[2];
+    param.a4 = h->a[3];
+    param.a5 = h->a[4];
+    param.a6 = h->a[5];
+    const double *c = reinterpret_cast<const double *>(base + sizeof(LogHeader));
+    for (uint32_t i = 0; i < h->numCommands; i++) tl.add(c[3 * i], c[3 * i + 1], c[3 * i + 2]);
+
+    // フレームの位置を調べる．読むのは各フレームのヘッダだけ
+    size_t pos = trajlog::align(bytes);
+    while (pos + sizeof(LogFrameHeader) <= length) {
+        const LogFrameHeader *f = reinterpret_cast<const LogFrameHeader *>(base + pos);
+        if (f->magic != trajlog::FRAME_MAGIC
+            || f->bytes != sizeof(LogFrameHeader) + 3 * trajlog::align((size_t)f->n * precision)) {
+            std::cerr << path << ": " << offset.size() << " 番目のフレームが壊れています\n";
+            break;
+        }
+        if (pos + f->bytes > length) {
+            std::cerr << path << ": 最後のフレームが途中で切れています\n";
+            break;
+        }
+        offset.push_back(pos);
+        pos += f->bytes;
+    }
+    return true;
+}
+
+void TrajectoryLogReader::close()
+{
+    if (base) munmap(const_cast<char *>(base), length);
+    base = nullptr;
+    length = 0;
+    offset.clear();
+    tl.clear();
+}
+
+const MotionParam &TrajectoryLogReader::getParam() const  { return param; }
+double TrajectoryLogReader::getDt() const                  { return dt; }
+uint64_t TrajectoryLogReader::getSeed() const              { return seed; }
+const CommandTimeline &TrajectoryLogReader::getTimeline() const { return tl; }
+LogPrecision TrajectoryLogReader::getPrecision() const     { return precision; }
+
+int TrajectoryLogReader::size() const
+{
+    return offset.size();
+}
+
+TrajectoryFrame TrajectoryLogReader::operator[](int i) const
+{
+    return TrajectoryFrame(reinterpret_cast<const LogFrameHeader *>(base + offset[i]), precision);
+}
+
+#endif
@@ -0,0 +1,501 @@
+/**
+ * @file WheelOdometry.h
+ * @brief 車輪のエンコーダのカウント列を速度指令 (v, w, dt) に直してロボット集合を動かす
+ * @author Kazumichi INOUE <k.inoue@oyama-ct.ac.jp>
+ *
+ * 入力は1行に "時刻[s] ロボット番号 左のカウント 右のカウント" を書いたテキスト（# 以降はコメント）で，
+ * カウントはエンコーダの積算値とする．ファイルか標準入力から TickReader で1行ずつ読む．
+ * 差動二輪の左右の車輪の移動量を D_L, D_R，車輪の間隔を T とすると（prog3 の図）
+ *   v = (D_R + D_L) / (2 dt),  w = (D_R - D_L) / (T dt)
+ * となる．エンコーダは 1kHz などで届くので，OdometryIngest はロボットごとに step [s] 分のカウントを
+ * まとめて1ステップの指令にし（積算値の差をとるだけなので途中のカウントは捨ててよい），
+ * 同じ指令が続けば advance(v, w, dt, n) の1回にまとめる．指令はロボットごとの固定長の
+ * バッファにためておき，どれかが一杯になったら全ロボットを（プールがあれば並列に）進める．
+ * 1カウントごとにはメモリを確保しない．
+ */
+
+#ifndef __WHEEL_ODOMETRY_H__
+#define __WHEEL_ODOMETRY_H__
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "Probe.h"
+#include "ThreadPool.h"
+
+/**
+ * @brief 差動二輪の寸法とエンコーダ
+ */
+struct WheelGeometry
+{
+    double meterPerTickL;   //!< 左の車輪が1カウントで進む距離 [m]
+    double meterPerTickR;   //!< 右の車輪が1カウントで進む距離 [m]
+    double tread;           //!< 左右の車輪の間隔 [m]
+    int counterBits;        //!< カウンタのビット数（一周して戻る．0 なら戻らない）
+
+    WheelGeometry() : counterBits(0)
+    {
+        setWheel(0.05, 1024, 0.3);
+    }
+
+    /**
+     * @brief 車輪の半径 [m]，1回転のカウント数，車輪の間隔 [m] から設定する
+     */
+    void setWheel(double radius, int ticksPerRev, double tread_)
+    {
+        meterPerTickL = meterPerTickR = 2.0 * M_PI * radius / ticksPerRev;
+        tread = tread_;
+    }
+
+    /**
+     * @brief カウントの差（カウンタが一周した分を戻す）
+     */
+    int64_t delta(int64_t from, int64_t to) const
+    {
+        int64_t d = to - from;
+        if (counterBits > 0 && counterBits < 64) {
+            int s = 64 - counterBits;
+            d = (int64_t)((uint64_t)d << s) >> s;       // 下位 counterBits ビットを符号付きで読む
+        }
+        return d;
+    }
+};
+
+/**
+ * @brief エンコーダの1回分の読み
+ */
+struct TickSample
+{
+    double t;               //!< 時刻 [s]
+    int robot;              //!< ロボット番号
+    int64_t left, right;    //!< 左右のカウントの積算値
+};
+
+/**
+ * @brief カウント列を1行ずつ読む（行の読み込みは固定長のバッファで行い，確保しない）
+ */
+class TickReader
+{
+    public:
+        TickReader();
+        ~TickReader();
+
+        /**
+         * @brief ファイルを開く．"-" なら標準入力
+         */
+        bool open(const std::string &path);
+
+        /**
+         * @brief 開いているファイル（fmemopen したものなど）から読む．閉じるのは呼び出し側
+         */
+        void attach(FILE *fp_);
+        void close();
+
+        /**
+         * @brief 次の1回分を読む
+         * @return 終わりか，形式が違う行があれば false（hasError() で区別する）
+         */
+        bool next(TickSample &s);
+
+        bool hasError() const;
+        long getLineNo() const;
+
+    private:
+        static const int LINE_MAX_BYTES = 256;
+
+        FILE *fp;
+        bool owner;             //!< fp を閉じるのはこちらか
+        bool error;
+        long lineNo;
+        std::string name;       //!< エラー表示用
+        char line[LINE_MAX_BYTES];
+
+        bool formatError();
+};
+
+/**
+ * @brief カウント列からロボット集合を動かす
+ * @details Engine は advance(v, w, dt, nsteps) を持つクラス（RobotBatch など）．
+ *          プールで並列に進めるときは，Engine 自身にはプールを持たせないこと
+ *          （ThreadPool は2つの parallelFor を同時に扱えない）
+ */
+template <typename Engine>
+class OdometryIngest
+{
+    public:
+        /**
+         * @param g 車輪の寸法
+         * @param step_ 1ステップにまとめる時間 [s]
+         * @param maxPending ロボットごとにためておく指令の数
+         */
+        OdometryIngest(const WheelGeometry &g, double step_, int maxPending = 256);
+
+        /**
+         * @brief ロボットを登録する．番号は登録した順に 0, 1, ...
+         */
+        int addRobot(Engine &e);
+        int getNumRobots() const;
+
+        /**
+         * @brief ロボットを分担して進めるスレッドプール（nullptr なら1スレッド）
+         */
+        void setThreadPool(std::shared_ptr<ThreadPool> p);
+
+        /**
+         * @brief 1回分の読みを加える．step 分たまったら指令にする
+         * @return 登録していないロボットか，時刻が戻っていれば false（その読みは捨てる）
+         * @details 捨てたことはロボットの番号ごとに最初の1回だけ知らせ，後は数だけ数える
+         */
+        bool push(const TickSample &s);
+
+        /**
+         * @brief ためた指令で全ロボットを進める
+         * @details まだ step に満たない最後の途中の分はためたまま（続きの読みとまとめる）
+         */
+        void flush();
+
+        /**
+         * @brief 入力の終わりに呼ぶ．ロボットごとに step に満たない最後の途中の分も
+         *        （その長さの dt の）1ステップにしてから，全ロボットを進める
+         */
+        void finish();
+
+        /**
+         * @brief 終わりまで読んで進める．最後の途中の分も finish() で進める
+         * @return 形式の違う行があれば false（それまでの分は進める）
+         */
+        bool run(TickReader &r);
+
+        long getNumTicks() const;       //!< 加えた読みの数（捨てたものは数えない）
+        long getNumRejected() const;    //!< 登録していないロボットの読みとして捨てた数
+        long getNumOutOfOrder() const;  //!< 時刻が戻っていたので捨てた読みの数
+        long getNumSteps() const;       //!< 作った指令のステップ数
+        long getNumAdvances() const;    //!< advance() を呼んだ回数
+
+    private:
+        // 1ステップ分（同じ指令が続けば n にまとめる）
+        struct Pending
+        {
+            int64_t dl, dr;         //!< カウントの差
+            double dt;
+            long n;
+        };
+
+        struct Track
+        {
+            Engine *e;
+            bool started;
+            double t0;              //!< まとめ始めた時刻
+            int64_t l0, r0;         //!< まとめ始めたときのカウント
+            double tLast;
+            int64_t lLast, rLast;   //!< 最後に受け付けたカウント
+            std::vector<Pending> pending;       //!< 長さ maxPending で確保し，count 個使う
+            int count;
+            bool warnedOrder;       //!< 時刻が戻っていることを知らせたか
+        };
+
+        WheelGeometry geom;
+        double step;
+        int maxPending;
+        std::vector<Track> tracks;
+        std::shared_ptr<ThreadPool> pool;
+        long ticks, steps, advances;
+        long rejected, outOfOrder;
+        std::unordered_set<int> warnedRobot;    //!< 登録していないことを知らせたロボットの番号
+
+        void addStep(Track &tr, double t, int64_t left, int64_t right);
+        void advanceTrack(Track &tr);
+};
+
+TickReader::TickReader() : fp(nullptr), owner(false), error(false), lineNo(0)
+{
+}
+
+TickReader::~TickReader()
+{
+    close();
+}
+
+bool TickReader::open(const std::string &path)
+{
+    close();
+    name = path;
+    if (path == "-") {
+        fp = stdin;
+        owner = false;
+        name = "stdin";
+    } else {
+        fp = fopen(path.c_str(), "r");
+        owner = true;
+    }
+    if (!fp) {
+        std::cerr << "カウント列を開けません: " << path << "\n";
+        return false;
+    }
+    return true;
+}
+
+void TickReader::attach(FILE *fp_)
+{
+    close();
+    fp = fp_;
+    owner = false;
+    name = "stream";
+}
+
+void TickReader::close()
+{
+    if (fp && owner) fclose(fp);
+    fp = nullptr;
+    owner = false;
+    error = false;
+    lineNo = 0;
+}
+
+bool TickReader::next(TickSample &s)
+{
+    if (!fp) return false;
+    while (fgets(line, sizeof(line), fp)) {
+        lineNo++;
+        size_t len = strlen(line);
+        if (len == sizeof(line) - 1 && line[len - 1] != '\n' && !feof(fp)) {
+            std::cerr << name << ":" << lineNo << ": 行が長すぎます\n";
+            error = true;
+            return false;
+        }
+        char *hash = strchr(line, '#');
+        if (hash) *hash = '\0';
+
+        char *p = line, *end;
+        s.t = strtod(p, &end);
+        if (end == p) {
+            // 空行なら読み飛ばす
+            while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') p++;
+            if (*p == '\0') continue;
+            return formatError();
+        }
+        p = end;
+        errno = 0;
+        long id = strtol(p, &end, 10);
+        if (end == p || id < 0 || id > 0x7fffffff) return formatError();
+        s.robot = (int)id;
+        p = end;
+        s.left = strtoll(p, &end, 10);
+        if (end == p) return formatError();
+        p = end;
+        s.right = strtoll(p, &end, 10);
+        if (end == p || errno == ERANGE) return formatError();
+        return true;
+    }
+    if (ferror(fp)) {
+        std::cerr << name << ": 読み込めません\n";
+        error = true;
+    }
+    return false;
+}
+
+bool TickReader::formatError()
+{
+    std::cerr << name << ":" << lineNo << ": \"t robot left right\" の形式ではありません\n";
+    error = true;
+    return false;
+}
+
+bool TickReader::hasError() const
+{
+    return error;
+}
+
+long TickReader::getLineNo() const
+{
+    return lineNo;
+}
+
+template <typename Engine>
+OdometryIngest<Engine>::OdometryIngest(const WheelGeometry &g, double step_, int maxPending_)
+    : geom(g), step(step_), maxPending(std::max(1, maxPending_)), ticks(0), steps(0), advances(0),
+      rejected(0), outOfOrder(0)
+{
+}
+
+template <typename Engine>
+int OdometryIngest<Engine>::addRobot(Engine &e)
+{
+    Track tr;
+    tr.e = &e;
+    tr.started = false;
+    tr.t0 = tr.tLast = 0.0;
+    tr.l0 = tr.r0 = 0;
+    tr.lLast = tr.rLast = 0;
+    tr.pending.resize(maxPending);
+    tr.count = 0;
+    tr.warnedOrder = false;
+    tracks.push_back(tr);
+    return tracks.size() - 1;
+}
+
+template <typename Engine>
+int OdometryIngest<Engine>::getNumRobots() const
+{
+    return tracks.size();
+}
+
+template <typename Engine>
+void OdometryIngest<Engine>::setThreadPool(std::shared_ptr<ThreadPool> p)
+{
+    pool = p;
+}
+
+template <typename Engine>
+bool OdometryIngest<Engine>::push(const TickSample &s)
+{
+    if (s.robot < 0 || s.robot >= (int)tracks.size()) {
+        rejected++;
+        if (warnedRobot.insert(s.robot).second) {
+            std::cerr << "登録していないロボットです（以後は知らせずに捨てます）: " << s.robot << "\n";
+        }
+        return false;
+    }
+    Track &tr = tracks[s.robot];
+    if (!tr.started) {
+        ticks++;
+        tr.started = true;
+        tr.t0 = tr.tLast = s.t;
+        tr.l0 = tr.lLast = s.left;
+        tr.r0 = tr.rLast = s.right;
+        return true;
+    }
+    if (s.t < tr.tLast) {
+        outOfOrder++;
+        if (!tr.warnedOrder) {
+            tr.warnedOrder = true;
+            std::cerr << "ロボット " << s.robot << " の時刻が戻っています（以後は知らせずに捨てます）: "
+                      << s.t << " < " << tr.tLast << "\n";
+        }
+        return false;
+    }
+    ticks++;
+    tr.tLast = s.t;
+    tr.lLast = s.left;
+    tr.rLast = s.right;
+
+    // step 分たまったら（時刻の丸めの分だけ早めに）1ステップにする
+    if (s.t - tr.t0 >= step * (1.0 - 1e-6)) addStep(tr, s.t, s.left, s.right);
+    return true;
+}
+
+// まとめ始めてから時刻 t（カウント left, right）までを1ステップにする
+template <typename Engine>
+void OdometryIngest<Engine>::addStep(Track &tr, double t, int64_t left, int64_t right)
+{
+    Pending p;
+    p.dl = geom.delta(tr.l0, left);
+    p.dr = geom.delta(tr.r0, right);
+    p.dt = t - tr.t0;
+    p.n = 1;
+    tr.t0 = t;
+    tr.l0 = left;
+    tr.r0 = right;
+    steps++;
+
+    // 前と同じ指令ならまとめる（dt は時刻の丸めの分だけずれてよい）
+    if (tr.count > 0) {
+        Pending &last = tr.pending[tr.count - 1];
+        if (last.dl == p.dl && last.dr == p.dr && fabs(last.dt - p.dt) < 1e-9 * step + 1e-12) {
+            last.n++;
+            return;
+        }
+    }
+    if (tr.count == maxPending) flush();
+    tr.pending[tr.count++] = p;
+}
+
+template <typename Engine>
+void OdometryIngest<Engine>::advanceTrack(Track &tr)
+{
+    for (int k = 0; k < tr.count; k++) {
+        const Pending &p = tr.pending[k];
+        double dL = p.dl * geom.meterPerTickL;
+        double dR = p.dr * geom.meterPerTickR;
+        double v = (dR + dL) / (2.0 * p.dt);
+        double w = (dR - dL) / (geom.tread * p.dt);
+        tr.e->advance(v, w, p.dt, p.n);
+    }
+}
+
+template <typename Engine>
+void OdometryIngest<Engine>::flush()
+{
+    PROBE_SCOPE("odometry_flush");
+    int n = tracks.size();
+    auto robot = [&](int k, int) { advanceTrack(tracks[k]); };
+    if (pool && n > 1) {
+        pool->parallelFor(n, robot);
+    } else {
+        for (int k = 0; k < n; k++) robot(k, 0);
+    }
+    for (Track &tr: tracks) {
+        advances += tr.count;
+        tr.count = 0;
+    }
+}
+
+template <typename Engine>
+void OdometryIngest<Engine>::finish()
+{
+    for (Track &tr: tracks) {
+        if (tr.started && tr.tLast > tr.t0) addStep(tr, tr.tLast, tr.lLast, tr.rLast);
+    }
+    flush();
+}
+
+template <typename Engine>
+bool OdometryIngest<Engine>::run(TickReader &r)
+{
+    TickSample s;
+    while (r.next(s)) push(s);
+    finish();
+    return !r.hasError();
+}
+
+template <typename Engine>
+long OdometryIngest<Engine>::getNumTicks() const
+{
+    return ticks;
+}
+
+template <typename Engine>
+long OdometryIngest<Engine>::getNumRejected() const
+{
+    return rejected;
+}
+
+template <typename Engine>
+long OdometryIngest<Engine>::getNumOutOfOrder() const
+{
+    return outOfOrder;
+}
+
+template <typename Engine>
+long OdometryIngest<Engine>::getNumSteps() const
+{
+    return steps;
+}
+
+template <typename Engine>
+long OdometryIngest<Engine>::getNumAdvances() const
+{
+    return advances;
+}
+
+#endif
@@ -0,0 +1,655 @@
+/*
+ * 性能測定（ベンチマーク）
+ *
+ * 次の項目の処理速度を測る．外部のサービスやファイルは使わない．
+ *   sample          Robot.h の sample()（一様乱数12個の和）
+ *   robot_move      std::vector<Robot> の Robot::move
+ *   batch_move      RobotBatch::move による集合全体の更新（N = 10^3〜10^7）
+ *   batch_advance   RobotBatch::advance（塊ごとに複数ステップ進める）
+ *   batch_mode      命令セットと正規乱数の生成方法の組み合わせごとの move
+ *   statistics      PoseStatistics による平均・共分散
+ *   likelihood      MotionLikelihood による移動前後の姿勢の組の対数尤度
+ *   resample        ParticleFilter の重みの正規化と再標本化
+ *   odometry        エンコーダのカウント列の読み込みと，指令にまとめてロボット集合を進める処理
+ *   draw            Drawer::drawing と Drawer::drawPoints
+ *   render          DisplayList に記録したロボットの記号を Drawer::render() で描く（1スレッド・プール）と，
+ *                   Drawer::robot() で1台ずつ描く場合．config の diff は robot() で描いた画像と異なる画素の数
+ *   tiled           TiledCanvas（200m 四方，5mm/pixel）への点の描画と，crop()・mosaic() による切り出し・縮小
+ *   encode          描いた画像の PNG / JPEG への変換（メモリ上）
+ *
+ * 各項目は予備実行（--warmup 回）の後に --reps 回くり返して時間を測り，1回あたりの時間の
+ * 平均・標準偏差・最小値，1秒あたりの処理数（particle-step/s など），1つあたりの時間 [ns] と
+ * データ量 [byte] を出す．--json を指定すると同じ内容を JSON で書き出す（"-" なら標準出力）．
+ *   ./bench
+ *   ./bench --max-n 100000 --reps 3
+ *   ./bench --filter batch --json result.json
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+#include "DisplayList.h"
+#include "Drawer.h"
+#include "MotionLikelihood.h"
+#include "ParticleFilter.h"
+#include "PoseStatistics.h"
+#include "Robot.h"
+#include "RobotBatch.h"
+#include "TiledCanvas.h"
+#include "WheelOdometry.h"
+
+/**
+ * @brief コマンドライン引数で変えられる設定
+ */
+struct BenchOption
+{
+    long minN = 1000;           //!< 粒子数の最小値
+    long maxN = 10000000;       //!< 粒子数の最大値（10倍ずつ増やす）
+    int reps = 5;               //!< 測定の回数
+    int warmup = 1;             //!< 予備実行の回数
+    double work = 4e6;          //!< 1回の測定で処理する particle-step 数の目安
+    std::string filter;         //!< 項目名にこの文字列を含むものだけ測る
+    std::string jsonPath;       //!< JSON の出力先（空なら出さない）
+};
+
+/**
+ * @brief 1項目の測定結果
+ */
+struct BenchResult
+{
+    std::string name;           //!< 項目名
+    std::string config;         //!< 設定（命令セットなど）
+    std::string unit;           //!< 処理の単位（particle-step など）
+    long n;                     //!< 粒子数（encode では画素数）
+    double items;               //!< 1回に処理する単位の数
+    double bytes;               //!< 1単位あたりのデータ量 [byte]
+    std::vector<double> sec;    //!< 各回の時間 [s]
+    double mean, stddev, min;   //!< 時間の平均・標準偏差・最小値 [s]
+};
+
+// 計算結果を捨てられないように書き込む先
+volatile double sink;
+
+class Bench
+{
+    public:
+        explicit Bench(const BenchOption &o) : opt(o) {}
+
+        /**
+         * @brief name の項目を測るか
+         */
+        bool enabled(const std::string &name) const
+        {
+            return opt.filter.empty() || name.find(opt.filter) != std::string::npos;
+        }
+
+        /**
+         * @brief f() を予備実行の後 reps 回呼び，時間を測る
+         * @param items f() 1回で処理する単位の数
+         * @param bytes 1単位あたりのデータ量 [byte]
+         */
+        template <typename F>
+        void run(const std::string &name, const std::string &config, const std::string &unit,
+                 long n, double items, double bytes, F f);
+
+        void print(std::ostream &os, const BenchResult &r) const;
+        void printHeader(std::ostream &os) const;
+        void writeJson(std::ostream &os) const;
+
+        const BenchOption &getOption() const { return opt; }
+
+    private:
+        BenchOption opt;
+        std::vector<BenchResult> results;
+
+        static std::string quote(const std::string &s);
+};
+
+template <typename F>
+void Bench::run(const std::string &name, const std::string &config, const std::string &unit,
+                long n, double items, double bytes, F f)
+{
+    if (!enabled(name)) return;
+
+    BenchResult r;
+    r.name = name;
+    r.config = config;
+    r.unit = unit;
+    r.n = n;
+    r.items = items;
+    r.bytes = bytes;
+
+    for (int k = 0; k < opt.warmup; k++) f();
+    for (int k = 0; k < opt.reps; k++) {
+        auto t0 = std::chrono::steady_clock::now();
+        f();
+        auto t1 = std::chrono::steady_clock::now();
+        r.sec.push_back(std::chrono::duration<double>(t1 - t0).count());
+    }
+
+    double sum = 0.0, sum2 = 0.0;
+    for (double s: r.sec) sum += s;
+    r.mean = sum / r.sec.size();
+    for (double s: r.sec) sum2 += (s - r.mean) * (s - r.mean);
+    r.stddev = (r.sec.size() > 1) ? sqrt(sum2 / (r.sec.size() - 1)) : 0.0;
+    r.min = *std::min_element(r.sec.begin(), r.sec.end());
+
+    results.push_back(r);
+    print(opt.jsonPath == "-" ? std::cerr : std::cout, r);
+}
+
+void Bench::printHeader(std::ostream &os) const
+{
+    os << std::left << std::setw(14) << "name" << std::setw(28) << "config" << std::right
+       << std::setw(10) << "n" << std::setw(12) << "mean[ms]" << std::setw(10) << "sd[ms]"
+       << std::setw(14) << "items/s" << std::setw(14) << "ns/item" << std::setw(12) << "B/item"
+       << "  unit\n";
+}
+
+void Bench::print(std::ostream &os, const BenchResult &r) const
+{
+    os << std::left << std::setw(14) << r.name << std::setw(28) << r.config << std::right
+       << std::setw(10) << r.n
+       << std::fixed << std::setprecision(3)
+       << std::setw(12) << r.mean * 1e3 << std::setw(10) << r.stddev * 1e3
+       << std::scientific << std::setprecision(3)
+       << std::setw(14) << r.items / r.mean
+       << std::fixed << std::setprecision(2)
+       << std::setw(14) << r.mean / r.items * 1e9 << std::setw(12) << r.bytes
+       << "  " << r.unit << "\n";
+    os.unsetf(std::ios::floatfield);
+    os << std::flush;
+}
+
+std::string Bench::quote(const std::string &s)
+{
+    std::string q = "\"";
+    for (char c: s) {
+        if (c == '"' || c == '\\') q += '\\';
+        q += c;
+    }
+    return q + "\"";
+}
+
+void Bench::writeJson(std::ostream &os) const
+{
+    os << std::setprecision(9);
+    os << "{\n";
+    os << "  \"isa\": " << quote(simdIsaName(detectSimdIsa())) << ",\n";
+    os << "  \"hardware_threads\": " << std::thread::hardware_concurrency() << ",\n";
+    os << "  \"reps\": " << opt.reps << ",\n";
+    os << "  \"warmup\": " << opt.warmup << ",\n";
+    os << "  \"results\": [";
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchResult &r = results[i];
+        os << (i ? ",\n" : "\n");
+        os << "    {\"name\": " << quote(r.name) << ", \"config\": " << quote(r.config)
+           << ", \"unit\": " << quote(r.unit) << ", \"n\": " << r.n << ", \"items\": " << r.items
+           << ", \"mean_s\": " << r.mean << ", \"stddev_s\": " << r.stddev << ", \"min_s\": " << r.min
+           << ", \"items_per_s\": " << r.items / r.mean << ", \"ns_per_item\": " << r.mean / r.items * 1e9
+           << ", \"bytes_per_item\": " << r.bytes << ", \"samples_s\": [";
+        for (size_t k = 0; k < r.sec.size(); k++) os << (k ? ", " : "") << r.sec[k];
+        os << "]}";
+    }
+    os << "\n  ]\n}\n";
+}
+
+// 粒子数の列 minN, 10 minN, ..., maxN
+std::vector<long> decades(long minN, long maxN)
+{
+    std::vector<long> ns;
+    for (long n = minN; n <= maxN; n *= 10) ns.push_back(n);
+    return ns;
+}
+
+// 1回の測定が work particle-step 程度になるステップ数
+long stepsFor(double work, long n)
+{
+    return std::max(1L, (long)(work / n));
+}
+
+std::string noiseName(NoiseMode m)
+{
+    switch (m) {
+        case NOISE_ZIGGURAT:    return "ziggurat";
+        case NOISE_BOX_MULLER:  return "box_muller";
+        case NOISE_LEGACY:      return "legacy";
+    }
+    return "?";
+}
+
+void benchSample(Bench &b)
+{
+    long m = std::max(1L, (long)(b.getOption().work / 4));
+    b.run("sample", "b2=0.01", "sample", 1, m, sizeof(double), [&] {
+        double s = 0.0;
+        for (long i = 0; i < m; i++) s += sample(0.01);
+        sink = s;
+    });
+}
+
+void benchRobot(Bench &b)
+{
+    // 1台ずつ乱数を作るので遅い．10^6 台までにする
+    const BenchOption &o = b.getOption();
+    for (long n: decades(o.minN, std::min(o.maxN, 1000000L))) {
+        if (!b.enabled("robot_move")) break;
+        std::vector<Robot> rb(n);
+        long steps = std::max(1L, (long)(o.work / 8 / n));
+        b.run("robot_move", "std::vector<Robot>", "particle-step", n, (double)n * steps, sizeof(Robot), [&] {
+            for (long k = 0; k < steps; k++)
+                for (Robot &r: rb) r.move(0.1, 0.1, 0.01);
+        });
+    }
+}
+
+void benchBatch(Bench &b)
+{
+    const BenchOption &o = b.getOption();
+    SimdIsa best = detectSimdIsa();
+    int hw = std::thread::hardware_concurrency();
+    std::shared_ptr<ThreadPool> pool;
+    if (hw > 1) pool = std::make_shared<ThreadPool>();
+
+    for (long n: decades(o.minN, o.maxN)) {
+        if (!b.enabled("batch_move") && !b.enabled("batch_advance")) break;
+        RobotBatch rb(n);
+        rb.seed(1);
+        long steps = stepsFor(o.work, n);
+        std::string isa = simdIsaName(best);
+        double bytes = 3 * sizeof(double);
+
+        b.run("batch_move", isa + " threads=1", "particle-step", n, (double)n * steps, bytes, [&] {
+            for (long k = 0; k < steps; k++) rb.move(0.1, 0.1, 0.01);
+        });
+        b.run("batch_advance", isa + " threads=1", "particle-step", n, (double)n * steps, bytes, [&] {
+            rb.advance(0.1, 0.1, 0.01, steps);
+        });
+        if (pool) {
+            rb.setThreadPool(pool);
+            std::string cfg = isa + " threads=" + std::to_string(pool->size());
+            b.run("batch_move", cfg, "particle-step", n, (double)n * steps, bytes, [&] {
+                for (long k = 0; k < steps; k++) rb.move(0.1, 0.1, 0.01);
+            });
+            b.run("batch_advance", cfg, "particle-step", n, (double)n * steps, bytes, [&] {
+                rb.advance(0.1, 0.1, 0.01, steps);
+            });
+        }
+    }
+}
+
+void benchMode(Bench &b)
+{
+    // 命令セットと乱数の生成方法の比較は 10^5 台（範囲外なら範囲の端）で行う
+    const BenchOption &o = b.getOption();
+    if (!b.enabled("batch_mode")) return;
+    long n = std::min(std::max(100000L, o.minN), o.maxN);
+    long steps = stepsFor(o.work, n);
+    SimdIsa best = detectSimdIsa();
+    NoiseMode modes[] = { NOISE_BOX_MULLER, NOISE_ZIGGURAT, NOISE_LEGACY };
+
+    for (int i = ISA_SCALAR; i <= best; i++) {
+        for (NoiseMode m: modes) {
+            RobotBatch rb(n);
+            rb.seed(1);
+            rb.setSimdIsa((SimdIsa)i);
+            rb.setNoiseMode(m);
+            std::string cfg = std::string(simdIsaName((SimdIsa)i)) + " " + noiseName(m);
+            b.run("batch_mode", cfg, "particle-step", n, (double)n * steps, 3 * sizeof(double), [&] {
+                for (long k = 0; k < steps; k++) rb.move(0.1, 0.1, 0.01);
+            });
+        }
+    }
+}
+
+void benchStatistics(Bench &b)
+{
+    const BenchOption &o = b.getOption();
+    for (long n: decades(o.minN, o.maxN)) {
+        if (!b.enabled("statistics")) break;
+        RobotBatch rb(n);
+        rb.seed(1);
+        rb.move(1.0, 0.5, 1.0);         // 姿勢をばらつかせておく
+        long k = stepsFor(o.work, n);
+        PoseStatistics stat;
+        b.run("statistics", simdIsaName(detectSimdIsa()), "particle", n, (double)n * k, 3 * sizeof(double), [&] {
+            for (long j = 0; j < k; j++) {
+                stat.clear();
+                stat.add(rb.getXData(), rb.getYData(), rb.getThData(), n);
+            }
+            sink = stat.getCov(0, 0);
+        });
+    }
+}
+
+// 画像の中に収まるよう，Drawer の既定の描画範囲（幅 3m）に一様に散らした集合
+void scatter(RobotBatch &rb)
+{
+    cv::RNG r(1);
+    for (int i = 0; i < rb.size(); i++) rb.set(i, r.uniform(-1.4, 1.4), r.uniform(-0.4, 2.4), 0.0);
+}
+
+void benchLikelihood(Bench &b)
+{
+    const BenchOption &o = b.getOption();
+    for (long n: decades(o.minN, o.maxN)) {
+        if (!b.enabled("likelihood")) break;
+        RobotBatch before(n);
+        scatter(before);
+        RobotBatch after = before;
+        after.seed(1);
+        after.move(0.5, 0.2, 0.1);
+        MotionLikelihood lik;
+        std::vector<double> out(n);
+        long k = stepsFor(o.work, n);
+        b.run("likelihood", simdIsaName(detectSimdIsa()), "pair", n, (double)n * k, 7 * sizeof(double), [&] {
+            for (long j = 0; j < k; j++) lik.evaluate(0.5, 0.2, 0.1, before, after, out.data());
+            sink = out[0];
+        });
+    }
+}
+
+void benchResample(Bench &b)
+{
+    const BenchOption &o = b.getOption();
+    int hw = std::thread::hardware_concurrency();
+    for (long n: decades(o.minN, o.maxN)) {
+        if (!b.enabled("resample")) break;
+        ParticleFilter pf(n);
+        pf.seed(1);
+        std::vector<double> logL(n);
+        cv::RNG r(1);
+        for (long i = 0; i < n; i++) logL[i] = r.gaussian(2.0);
+        std::vector<int> threads(1, 1);
+        if (hw > 1) threads.push_back(hw);
+        for (int t: threads) {
+            if (t > 1) pf.setThreadPool(std::make_shared<ThreadPool>(t));
+            b.run("resample", "threads=" + std::to_string(t), "particle", n, n, 4 * sizeof(double) + 2 * sizeof(int), [&] {
+                pf.addLogWeight(logL.data());
+                pf.normalize();
+                pf.resample();
+            });
+        }
+
+        // 粒子数を決め直す手間（格子を数える分）．下限と上限を n にして数は変えない
+        KldParam kld;
+        kld.minParticles = kld.maxParticles = n;
+        scatter(pf.getParticles());
+        pf.enableAdaptive(kld);
+        b.run("resample", "kld threads=" + std::to_string(threads.back()), "particle", n, n,
+              4 * sizeof(double) + 2 * sizeof(int), [&] {
+            pf.addLogWeight(logL.data());
+            pf.normalize();
+            pf.resample();
+        });
+    }
+}
+
+void benchOdometry(Bench &b)
+{
+    const BenchOption &o = b.getOption();
+    const int R = 64;               // 1kHz で届くロボットの数
+    int hw = std::thread::hardware_concurrency();
+    for (long n: decades(o.minN, o.maxN)) {
+        if (!b.enabled("odometry")) break;
+
+        // i 番目の読みはロボット i % R の (i / R) ms 目．まっすぐ 0.6 カウント/ms で進む
+        long J = (n + R - 1) / R;
+        auto tick = [&](long i, long rep, TickSample &s) {
+            long j = i / R + rep * J;
+            s.t = j * 1e-3;
+            s.robot = i % R;
+            s.left = s.right = j * 3 / 5;
+        };
+
+        std::string text;
+        char line[64];
+        for (long i = 0; i < n; i++) {
+            TickSample s;
+            tick(i, 0, s);
+            snprintf(line, sizeof(line), "%.6f %d %lld %lld\n", s.t, s.robot, (long long)s.left, (long long)s.right);
+            text += line;
+        }
+        b.run("odometry", "parse", "tick", n, n, text.size() / n, [&] {
+            FILE *fp = fmemopen(&text[0], text.size(), "r");
+            TickReader r;
+            r.attach(fp);
+            TickSample s;
+            long k = 0;
+            while (r.next(s)) k++;
+            fclose(fp);
+            if (k != n) std::cerr << "odometry: " << k << " / " << n << "\n";
+        });
+
+        for (int particles: {0, 100}) {
+            std::vector<std::unique_ptr<RobotBatch> > robots;
+            OdometryIngest<RobotBatch> ingest(WheelGeometry(), 0.01);
+            for (int k = 0; k < R; k++) {
+                robots.emplace_back(new RobotBatch(particles));
+                ingest.addRobot(*robots.back());
+            }
+            if (hw > 1) ingest.setThreadPool(std::make_shared<ThreadPool>(hw));
+            long rep = 0;
+            b.run("odometry", "ingest particles=" + std::to_string(particles), "tick", n, n, sizeof(TickSample), [&] {
+                TickSample s;
+                for (long i = 0; i < n; i++) {
+                    tick(i, rep, s);
+                    ingest.push(s);
+                }
+                ingest.flush();
+                rep++;
+            });
+        }
+    }
+}
+
+void benchDraw(Bench &b)
+{
+    const BenchOption &o = b.getOption();
+    for (long n: decades(o.minN, o.maxN)) {
+        if (!b.enabled("draw")) break;
+        Drawer dr;
+        RobotBatch rb(n);
+        scatter(rb);
+        b.run("draw", "drawing<Pose>", "point", n, n, 2 * sizeof(double), [&] {
+            for (int i = 0; i < n; i++) {
+                RobotBatch::Pose p = rb[i];
+                dr.drawing(p);
+            }
+        });
+        b.run("draw", "drawPoints", "point", n, n, 2 * sizeof(double), [&] {
+            dr.drawPoints(rb);
+        });
+    }
+}
+
+// 2つの画像で異なる画素の数
+long countDiff(const cv::Mat &a, const cv::Mat &b)
+{
+    long d = 0;
+    for (int y = 0; y < a.rows; y++) {
+        const unsigned char *p = a.ptr<unsigned char>(y);
+        const unsigned char *q = b.ptr<unsigned char>(y);
+        for (int x = 0; x < a.cols; x++) {
+            if (p[3 * x] != q[3 * x] || p[3 * x + 1] != q[3 * x + 1] || p[3 * x + 2] != q[3 * x + 2]) d++;
+        }
+    }
+    return d;
+}
+
+// ロボットの記号（円・向きの線・車輪の6図形）を n 台分描く．2割は描画範囲の外に置く
+void benchRender(Bench &b)
+{
+    const BenchOption &o = b.getOption();
+    int hw = std::max(2, (int)std::thread::hardware_concurrency());
+    for (long n: decades(o.minN, std::min(o.maxN, 100000L))) {
+        if (!b.enabled("render")) break;
+        RobotBatch rb(n);
+        cv::RNG r(1);
+        for (int i = 0; i < n; i++) {
+            if (i % 5 == 0) rb.set(i, r.uniform(-6.0, 6.0) + (r.uniform(0, 2) ? 4.5 : -4.5), r.uniform(-3.0, 5.0), r.uniform(-M_PI, M_PI));
+            else            rb.set(i, r.uniform(-1.6, 1.6), r.uniform(-0.6, 2.6), r.uniform(-M_PI, M_PI));
+        }
+        const double radius = 0.03;
+
+        Drawer immediate;
+        auto drawImmediate = [&] {
+            immediate.clear();
+            for (int i = 0; i < n; i++) immediate.robot(rb.getX(i), rb.getY(i), radius, rb.getTh(i));
+        };
+        DisplayList dl;
+        dl.reserve(6 * n);
+        auto record = [&] {
+            dl.clear();
+            for (int i = 0; i < n; i++) dl.robot(rb.getX(i), rb.getY(i), radius, rb.getTh(i));
+        };
+        Drawer single, pooled;
+        pooled.setThreadPool(std::make_shared<ThreadPool>(hw));
+
+        // 描いた画像を比べる（帯の境界や領域の外の切り落としで形が変わっていないか）
+        drawImmediate();
+        record();
+        single.render(dl);
+        pooled.render(dl);
+        long diffSingle = countDiff(single.getImage(), immediate.getImage());
+        long diffPooled = countDiff(pooled.getImage(), immediate.getImage());
+
+        b.run("render", "robot()", "robot", n, n, 3 * sizeof(double), drawImmediate);
+        b.run("render", "threads=1 diff=" + std::to_string(diffSingle), "robot", n, n, 3 * sizeof(double), [&] {
+            single.clear();
+            record();
+            single.render(dl);
+        });
+        b.run("render", "threads=" + std::to_string(hw) + " diff=" + std::to_string(diffPooled), "robot", n, n,
+              3 * sizeof(double), [&] {
+            pooled.clear();
+            record();
+            pooled.render(dl);
+        });
+    }
+}
+
+// 200m 四方（40000x40000 画素）の描画領域に，x 軸に沿って 100m にわたる細長い集合を描く．
+// 確保するのは集合の通るタイルだけになる
+void benchTiled(Bench &b)
+{
+    const BenchOption &o = b.getOption();
+    for (long n: decades(o.minN, o.maxN)) {
+        if (!b.enabled("tiled")) break;
+        TiledCanvas tc;
+        tc.setCsize(0.005);
+        tc.setImgWidth(200.0);
+        tc.setImgHight(200.0);
+        tc.setOriginXfromLeft(100.0);
+        tc.setOriginYfromBottom(100.0);
+        RobotBatch rb(n);
+        cv::RNG r(1);
+        for (int i = 0; i < n; i++) rb.set(i, r.uniform(-50.0, 50.0), r.gaussian(0.2), 0.0);
+        tc.drawPoints(rb);
+        std::string tiles = std::to_string(tc.getTileCount()) + " tiles";
+
+        b.run("tiled", "drawPoints " + tiles, "point", n, n, 2 * sizeof(double), [&] {
+            tc.drawPoints(rb);
+        });
+        b.run("tiled", "crop 600x600 " + tiles, "frame", n, 1, 600 * 600 * 3, [&] {
+            cv::Mat img = tc.crop(-1.5, 1.5, 1.5, -1.5);
+            sink = img.data[0];
+        });
+        b.run("tiled", "mosaic 1000x1000 " + tiles, "frame", n, 1, (double)tc.getBytes(), [&] {
+            cv::Mat img = tc.mosaic(1000, 1000);
+            sink = img.data[0];
+        });
+    }
+}
+
+void benchEncode(Bench &b)
+{
+    if (!b.enabled("encode")) return;
+    Drawer dr;
+    RobotBatch rb(100000);
+    scatter(rb);
+    dr.drawPoints(rb);
+    const cv::Mat &img = dr.getImage();
+    long pixels = (long)img.cols * img.rows;
+
+    const char *ext[] = { ".png", ".jpg" };
+    for (const char *e: ext) {
+        std::vector<unsigned char> buf;
+        cv::imencode(e, img, buf);
+        b.run("encode", std::string(e + 1) + " " + std::to_string(img.cols) + "x" + std::to_string(img.rows),
+              "frame", pixels, 1, buf.size(), [&] {
+            cv::imencode(e, img, buf);
+        });
+    }
+}
+
+void usage(const char *prog)
+{
+    std::cerr << "使い方: " << prog << " [--min-n N] [--max-n N] [--reps R] [--warmup W]"
+              << " [--work 回数] [--filter 項目名] [--json ファイル|-]\n";
+}
+
+int main(int argc, char *argv[])
+{
+    BenchOption opt;
+    for (int i = 1; i < argc; i++) {
+        std::string a = argv[i];
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return 1;
+        }
+        std::string v = argv[++i];
+        if      (a == "--min-n")  opt.minN = atol(v.c_str());
+        else if (a == "--max-n")  opt.maxN = atol(v.c_str());
+        else if (a == "--reps")   opt.reps = atoi(v.c_str());
+        else if (a == "--warmup") opt.warmup = atoi(v.c_str());
+        else if (a == "--work")   opt.work = atof(v.c_str());
+        else if (a == "--filter") opt.filter = v;
+        else if (a == "--json")   opt.jsonPath = v;
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (opt.minN < 1) opt.minN = 1;
+    if (opt.reps < 1) opt.reps = 1;
+    if (opt.warmup < 0) opt.warmup = 0;
+
+    Bench b(opt);
+    b.printHeader(opt.jsonPath == "-" ? std::cerr : std::cout);
+    benchSample(b);
+    benchRobot(b);
+    benchBatch(b);
+    benchMode(b);
+    benchStatistics(b);
+    benchLikelihood(b);
+    benchResample(b);
+    benchOdometry(b);
+    benchDraw(b);
+    benchRender(b);
+    benchTiled(b);
+    benchEncode(b);
+
+    if (opt.jsonPath == "-") {
+        b.writeJson(std::cout);
+    } else if (!opt.jsonPath.empty()) {
+        std::ofstream f(opt.jsonPath);
+        if (!f) {
+            std::cerr << "ファイルを開けません: " << opt.jsonPath << "\n";
+            return 1;
+        }
+        b.writeJson(f);
+    }
+    return 0;
+}
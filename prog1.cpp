@@ -12,14 +12,25 @@
  *  描画時の色を指定するようにした
  * 2020.3.23
  *  描画クラスを大幅にアップデート
+ *
+ * 引数でロボットの数を指定できる（例: ./prog1 1000000）．
+ * 多い場合は点を打つ代わりに，画素ごとの点の数を濃淡（密度）で表示する
+ * 描画は SnapshotPipeline のスレッドで行い，その間もシミュレーションを進める
+ * 環境変数 KLD_PARTICLES="下限,上限" を指定すると，途中経過ごとにロボットの数を KLD サンプリングで決め直す
  */
 
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
 #include <iostream>
+#include <memory>
 #include <opencv2/opencv.hpp>
-#include <vector>
 
-#include "Robot.h"
+#include "RobotBatch.h"
 #include "Drawer.h"
+#include "ParticleFilter.h"
+#include "SnapshotPipeline.h"
+#include "ThreadPool.h"
 
 int main(int argc, char *argv[])
 {
@@ -31,25 +42,73 @@ int main(int argc, char *argv[])
     w = 0.1;
 
     int numRobot = 500;                     // シミュレーションするロボットの数
-    std::vector<Robot> rb(numRobot);
+    if (argc > 1) {
+        char *end;
+        long n = strtol(argv[1], &end, 10);
+        if (end == argv[1] || *end != '\0' || n < 1 || n > INT32_MAX) {
+            std::cerr << "使い方: " << argv[0] << " [ロボットの数（1 以上）]\n";
+            return 1;
+        }
+        numRobot = n;
+    }
+    ParticleFilter pf(numRobot);
+    RobotBatch &rb = pf.getParticles();
+
+    // 雲がまとまっている間は少ない数で足りるので，途中経過ごとに数を決め直す
+    KldParam kld;
+    bool adaptive = getKldParamFromEnv(kld);
+    if (adaptive) pf.enableAdaptive(kld);
+    int maxRobot = adaptive ? std::max(numRobot, kld.maxParticles) : numRobot;
+
+    // 点が多いと画像が塗りつぶされるので密度で表示する．数えるのはスレッドごとに分担する．
+    // ThreadPool は2つのスレッドから同時に使えないので，描画用のプールは別に用意する
+    bool useDensity = (maxRobot > 10000);
+    std::shared_ptr<ThreadPool> pool, drawPool;
+    if (useDensity) {
+        pool = std::make_shared<ThreadPool>();
+        drawPool = std::make_shared<ThreadPool>();
+        pf.setThreadPool(pool);
+        dr.setDensityWorkers(drawPool->size());
+    }
+
+    // 途中経過の描画（描画スレッドで行う）
+    SnapshotPipeline pipe([&](const Snapshot &s) {
+        if (useDensity) {
+            const int chunk = 65536;
+            int n = s.size();
+            drawPool->parallelFor((n + chunk - 1) / chunk, [&](int k, int worker) {
+                int m = std::min(chunk, n - k * chunk);
+                dr.accumulate(s.getXData() + k * chunk, s.getYData() + k * chunk, m, worker);
+            });
+            dr.drawDensity(DENSITY_LOG, cv::COLORMAP_JET);
+        } else {
+            dr.drawPoints(s.getXData(), s.getYData(), s.size());
+        }
+        dr.publish();                           // 表示はメインスレッドの present() で行う
+    });
 
     int numLoop = 5000;                     // シミュレーション時間（繰り返し数）
     int skipNum = 300;                      // 途中経過の出力するためのスキップ数
 
-    for (int i = 0; i < numLoop; i++) {
-        for (int k = 0; k < numRobot; k++) {
-            rb[k].move(v, w, dt);                   // すべてのロボットを動作更新
-        }
-        if (i % skipNum == 0) {                     // 途中経過を表示
-            for (int k = 0; k < numRobot; k++) {
-                dr.drawing<Robot>(rb[k]);
-            }
-            dr.show();
+    // 途中経過は i = 0, skipNum, 2 skipNum, ... 回目の動作更新の後（1, 301, 601, ... ステップ目）に表示する
+    int done = 0;                           // 進めたステップ数
+    for (int i = 0; i < numLoop; i += skipNum) {
+        int n = i + 1 - done;
+        rb.advance(v, w, dt, n);                    // すべてのロボットを n ステップ動作更新
+        done += n;
+        pipe.submit(rb, done * dt);                 // 姿勢をコピーして描画を頼み，すぐに次へ進む
+        dr.present();                               // 描き終えた途中経過があれば表示する
+        if (adaptive) {
+            pf.resample();                          // 分布はそのままで数だけを変える
+            std::cerr << done * dt << " [s] 格子 " << pf.getNumBins() << " 台数 " << pf.size() << "\n";
         }
     }
+    rb.advance(v, w, dt, numLoop - done);           // 最後の途中経過より後（表示しない）
+    pipe.flush();
+    dr.present();                               // 最後の途中経過を表示する
 
     dr.imgWrite();
-    cv::waitKey(0);     // 何かキーを押すまで待つ
+    dr.waitKey(0);      // 何かキーを押すまで待つ
 
     return 0;
 }
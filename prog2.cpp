@@ -1,13 +1,23 @@
 #include <iostream>
 #include <vector>
+#include "CommandTimeline.h"
 #include "Drawer.h"
-#include "Robot.h"
+#include "ParticleFilter.h"
+#include "RobotBatch.h"
+#include "SnapshotPipeline.h"
+#include "TrajectoryLog.h"
 
 int main(int argc, char* argv[])
 {
-    std::vector<Robot> rb(1000);
+    ParticleFilter pf(1000);
+    RobotBatch &rb = pf.getParticles();
     Drawer dr;
 
+    // KLD_PARTICLES="下限,上限" を指定すると，描画のたびにロボットの数を決め直す
+    KldParam kld;
+    bool adaptive = getKldParamFromEnv(kld);
+    if (adaptive) pf.enableAdaptive(kld);
+
     dr.setCsize(0.015);
     dr.setImgWidth(20.0);
     dr.setImgHight(10.0);
@@ -17,69 +27,72 @@ int main(int argc, char* argv[])
     dr.text(-10, 7, "K.INOUE");
     dr.show();
 
-    // 目標経路
-    dr.setLineWidth(2);                   
-    dr.setLineColor(cv::Scalar(0, 0, 180));            
-    dr.line(0.0, 0.0, 6.0, 0.0);
-    dr.line(6.0, 0.0, 6.0, 6.0);
-    dr.line(6.0, 6.0,-6.0, 6.0);
-
-    double dt = 0.01;                           // 時間の刻み幅
-    int drawStep = 2.0/dt;                      // 画像に出力する間隔
-    dr.setPointColor(cv::Scalar(200, 0, 0));    // 点を描画するための色をセットする
-
-    // 経路1
-    for (int i = 0; i < 6.0/dt; i++) {
-        for (Robot &x: rb) 
-            x.move(1.0, 0.0, dt);
-            
-        if (i % drawStep == 0) {
-            for (Robot x: rb)
-                dr.drawing<Robot>(x);
-            dr.show();
-            cv::waitKey(5);
-        }
+    // 経路（引数で経路ファイルを指定できる．例: ../route/route1.txt）
+    CommandTimeline tl;
+    if (argc > 1) {
+        if (!tl.load(argv[1])) return 1;
+    } else {
+        tl.add(1.0, 0.0, 6.0);                  // 経路1
+        tl.add(0.0, 0.1, M_PI/2.0/0.1);         // 経路2
+        tl.add(1.0, 0.0, 6.0);                  // 経路3
+        tl.add(0.0, 0.1, M_PI/2.0/0.1);         // 経路4
+        tl.add(1.0, 0.0, 13.0);                 // 経路5
     }
 
-    // 経路2
-    for (int i = 0; i < M_PI/2.0/0.1/dt; i++) {
-        for (Robot &x: rb) 
-            x.move(0.0, 0.1, dt);
-    }
+    double dt = 0.01;                           // 時間の刻み幅
+    double drawInterval = 2.0;                  // 画像に出力する間隔 [s]
 
-    // 経路3
-    for (int i = 0; i < 6.0/dt; i++) {
-        for (Robot &x: rb) 
-            x.move(1.0, 0.0, dt);
+    // 目標経路（誤差なしで経路をたどったときの軌跡）
+    dr.setLineWidth(2);                   
+    dr.setLineColor(cv::Scalar(0, 0, 180));            
+    RobotBatch ideal(1);
+    MotionParam zero;
+    zero.a1 = zero.a2 = zero.a3 = zero.a4 = zero.a5 = zero.a6 = 0.0;
+    ideal.setParam(zero);
+    double px = 0.0, py = 0.0;
+    TimelineExecutor<RobotBatch> path(dt);
+    path.addObserver([&](RobotBatch &r, double) {
+        dr.line(px, py, r.getX(0), r.getY(0));
+        px = r.getX(0);
+        py = r.getY(0);
+    }, 0.1);
+    path.run(ideal, tl);
 
-        if (i % drawStep == 0) {
-            for (Robot x: rb)
-                dr.drawing<Robot>(x);
-            dr.show();
-            cv::waitKey(5);
-        }
-    }
+    // ロゴ・文字・目標経路は一番下の層に描いたので描き直さない．これまでの途中経過は "trail" の層に
+    // 薄い色で残し，最新の途中経過は毎回消して描き直す "particles" の層に描く（重ね直すのは変わった所だけ）
+    cv::Scalar trailColor(230, 170, 170), pointColor(200, 0, 0);
 
-    // 経路4
-    for (int i = 0; i < M_PI/2.0/0.1/dt; i++) {
-        for (Robot &x: rb) 
-            x.move(0.0, 0.1, dt);
+    // 2つ目の引数を指定すると，途中経過の姿勢をログに記録する（prog6 で再生できる）
+    TrajectoryLogWriter log;
+    if (argc > 2) {
+        if (!log.open(argv[2], rb.getParam(), dt, tl, rb.getSeed())) return 1;
     }
 
-    // 経路5
-    for (int i = 0; i < 13.0/dt; i++) {
-        for (Robot &x: rb) 
-            x.move(1.0, 0.0, dt);
+    // 描画とログの書き出しは別スレッドで行い，その間もシミュレーションを進める
+    SnapshotPipeline pipe([&](const Snapshot &s) {
+        log.write(s, s.step, s.t);
+        dr.setLayer("trail");
+        dr.setPointColor(trailColor);
+        dr.drawPoints(s.getXData(), s.getYData(), s.size());
+        dr.setLayer("particles");
+        dr.clearLayer("particles");
+        dr.setPointColor(pointColor);
+        dr.drawPoints(s.getXData(), s.getYData(), s.size());
+        dr.publish();                           // 表示はメインスレッドの present() で行う
+    });
 
-        if (i % drawStep == 0) {
-            for (Robot x: rb)
-                dr.drawing<Robot>(x);
-            dr.show();
-            cv::waitKey(5);
-        }
-    }
+    TimelineExecutor<RobotBatch> ex(dt);
+    ex.addObserver([&](RobotBatch &r, double t) {
+        pipe.submit(r, t);
+        dr.present();                           // 描き終えた途中経過があれば表示する
+        if (adaptive) pf.resample();            // 分布はそのままで数だけを変える
+    }, drawInterval);
+    ex.run(rb, tl);
+    pipe.flush();
+    dr.present();                               // 最後の途中経過を表示する
+    bool logOk = log.close();                   // 書き込みに失敗していれば（ログが途中で切れていれば）false
 
     dr.imgWrite();                            // img をファイルに書き出す
-    cv::waitKey(0);
-    return 0;
+    dr.waitKey(0);
+    return logOk ? 0 : 1;
 }
@@ -1,87 +1,38 @@
 #include <iostream>
 #include <vector>
+#include "CommandTimeline.h"
 #include "Drawer.h"
-#include "Robot.h"
+#include "ParticleFilter.h"
+#include "RobotBatch.h"
+#include "SnapshotPipeline.h"
 
-struct STATISTIC
+// 統計を表示する
+void printStatistics(const PoseStatistics &s)
 {
-    double xg, yg;
-    double sxx, sxy, syy;
-    double u, v;
-    double lambda;
-};
-
-STATISTIC calcCovariance(std::vector<Robot> &rb) 
-{
-    STATISTIC stat;
-
-    // 姿勢の重心を求める
-    double xg = 0.0;
-    double yg = 0.0;
-    int N = rb.size();
-    for (Robot &x: rb) {
-        xg += x.getX();
-        yg += x.getY();
-    }
-    xg /= N;
-    yg /= N;
-    std::cerr << "平均位置: " << xg << "," << yg << std::endl;
-    stat.xg = xg;
-    stat.yg = yg;
-
-    // 分散・共分散
-    double sxx = 0.0;
-    double syy = 0.0;
-    double sxy = 0.0;
-    for (Robot &x: rb) {
-        sxx += (x.getX() - xg) * (x.getX() - xg);
-        sxy += (x.getX() - xg) * (x.getY() - yg);
-        syy += (x.getY() - yg) * (x.getY() - yg);
-    }
-    sxx /= N;
-    sxy /= N;
-    syy /= N;
-    std::cerr << "共分散行列\n";
-    std::cerr 
-        << sxx << "\t" << sxy << "\n"
-        << sxy << "\t" << syy << "\n";
-    stat.sxx = sxx;
-    stat.sxy = sxy;
-    stat.syy = syy;
-
-    // 累乗法で固有ベクトルと固有値を求める
-    double u = 1.0;
-    double v = 0.0;     // 固有ベクトル
-
-    for (int i = 0; i < 10; i++) {
-        double u_ = sxx * u + sxy * v;
-        double v_ = sxy * u + syy * v;
-        // 規格化
-        double k = sqrt(u_ * u_ + v_ * v_);
-        u = u_ / k;
-        v = v_ / k;
+    std::cerr << "平均姿勢: " << s.getMeanX() << "," << s.getMeanY() << "," << s.getMeanTh() << std::endl;
+    std::cerr << "共分散行列 (x, y, th)\n";
+    for (int i = 0; i < 3; i++) {
+        std::cerr << s.getCov(i, 0) << "\t" << s.getCov(i, 1) << "\t" << s.getCov(i, 2) << "\n";
     }
-    // 固有値
-    double a = sxx * u + sxy * v;
-    double b = sxy * u + sxy * v;
-    double lambda = sqrt(a*a + b*b);
 
+    double u, v, lambda;
+    s.getPrincipalAxis(u, v, lambda);
     std::cerr << "固有ベクトル " << u << "," << v << "\n";
     std::cerr << "固有値 " << lambda << "\n";
     std::cerr << "\n";
-
-    stat.u = u;
-    stat.v = v;
-    stat.lambda = lambda;
-
-    return stat;
 }
 
 int main(int argc, char* argv[])
 {
-    std::vector<Robot> rb(1000);
+    ParticleFilter pf(1000);
+    RobotBatch &rb = pf.getParticles();
     Drawer dr;
 
+    // KLD_PARTICLES="下限,上限" を指定すると，描画のたびにロボットの数を決め直す
+    KldParam kld;
+    bool adaptive = getKldParamFromEnv(kld);
+    if (adaptive) pf.enableAdaptive(kld);
+
     dr.setCsize(0.015);
     dr.setImgWidth(20.0);
     dr.setImgHight(10.0);
@@ -91,80 +42,81 @@ int main(int argc, char* argv[])
     dr.text(-10, 7, "K.INOUE");
     dr.show();
 
-    // 目標経路
-    dr.setLineWidth(2);                   
-    dr.setLineColor(cv::Scalar(0, 0, 180));            
-    dr.line(0.0, 0.0, 6.0, 0.0);
-    dr.line(6.0, 0.0, 6.0, 6.0);
-    dr.line(6.0, 6.0,-6.0, 6.0);
-
-    double dt = 0.01;                           // 時間の刻み幅
-    int drawStep = 2.0/dt;                      // 画像に出力する間隔
-    dr.setPointColor(cv::Scalar(200, 0, 0));    // 点を描画するための色をセットする
-
-    STATISTIC stat;
-    dr.setLineColor(cv::Scalar(0, 180, 0));
-
-    // 経路1
-    for (int i = 0; i < 6.0/dt; i++) {
-        for (Robot &x: rb) 
-            x.move(1.0, 0.0, dt);
-            
-        if (i % drawStep == 0) {
-            for (Robot x: rb)
-                dr.drawing<Robot>(x);
-            stat = calcCovariance(rb);
-            dr.line(stat.xg, stat.yg, stat.xg + stat.lambda * stat.u, stat.yg + stat.lambda * stat.v);
-            dr.show();
-            cv::waitKey(5);
-        }
-    }
-
-    // 経路2
-    for (int i = 0; i < M_PI/2.0/0.1/dt; i++) {
-        for (Robot &x: rb) 
-            x.move(0.0, 0.1, dt);
-    }
-
-    // 経路3
-    for (int i = 0; i < 6.0/dt; i++) {
-        for (Robot &x: rb) 
-            x.move(1.0, 0.0, dt);
-
-        if (i % drawStep == 0) {
-            for (Robot x: rb)
-                dr.drawing<Robot>(x);
-            stat = calcCovariance(rb);
-            dr.line(stat.xg, stat.yg, stat.xg + stat.lambda * stat.u, stat.yg + stat.lambda * stat.v);
-            dr.show();
-            cv::waitKey(5);
-        }
-    }
-
-    // 経路4
-    for (int i = 0; i < M_PI/2.0/0.1/dt; i++) {
-        for (Robot &x: rb) 
-            x.move(0.0, 0.1, dt);
+    // 経路（引数で経路ファイルを指定できる．例: ../route/route1.txt）
+    CommandTimeline tl;
+    if (argc > 1) {
+        if (!tl.load(argv[1])) return 1;
+    } else {
+        tl.add(1.0, 0.0, 6.0);                  // 経路1
+        tl.add(0.0, 0.1, M_PI/2.0/0.1);         // 経路2
+        tl.add(1.0, 0.0, 6.0);                  // 経路3
+        tl.add(0.0, 0.1, M_PI/2.0/0.1);         // 経路4
+        tl.add(1.0, 0.0, 13.0);                 // 経路5
     }
 
-    // 経路5
-    for (int i = 0; i < 13.0/dt; i++) {
-        for (Robot &x: rb) 
-            x.move(1.0, 0.0, dt);
+    double dt = 0.01;                           // 時間の刻み幅
+    double drawInterval = 2.0;                  // 画像に出力する間隔 [s]
 
-        if (i % drawStep == 0) {
-            for (Robot x: rb)
-                dr.drawing<Robot>(x);
-            stat = calcCovariance(rb);
-            dr.line(stat.xg, stat.yg, stat.xg + stat.lambda * stat.u, stat.yg + stat.lambda * stat.v);
-            dr.show();
-            cv::waitKey(5);
-        }
+    // 目標経路（誤差なしで経路をたどったときの軌跡）
+    dr.setLineWidth(2);                   
+    dr.setLineColor(cv::Scalar(0, 0, 180));            
+    RobotBatch ideal(1);
+    MotionParam zero;
+    zero.a1 = zero.a2 = zero.a3 = zero.a4 = zero.a5 = zero.a6 = 0.0;
+    ideal.setParam(zero);
+    double px = 0.0, py = 0.0;
+    TimelineExecutor<RobotBatch> path(dt);
+    path.addObserver([&](RobotBatch &r, double) {
+        dr.line(px, py, r.getX(0), r.getY(0));
+        px = r.getX(0);
+        py = r.getY(0);
+    }, 0.1);
+    path.run(ideal, tl);
+
+    // ロゴ・文字・目標経路は一番下の層に描いたので描き直さない．これまでの途中経過は "trail" の層に
+    // 薄い色で残し，最新の途中経過は毎回消して描き直す "particles" の層に描く（重ね直すのは変わった所だけ）
+    cv::Scalar trailColor(230, 170, 170), trailAxisColor(150, 210, 150);
+    cv::Scalar pointColor(200, 0, 0), axisColor(0, 180, 0);
+
+    // 描画と統計の表示は別スレッドで行い，その間もシミュレーションを進める
+    SnapshotPipeline pipe([&](const Snapshot &s) {
+        printStatistics(s.stat);
+        // 点と共分散行列の主軸を描く
+        double u, v, lambda;
+        s.stat.getPrincipalAxis(u, v, lambda);
+        auto draw = [&](const cv::Scalar &pc, const cv::Scalar &lc) {
+            dr.setPointColor(pc);
+            dr.drawPoints(s.getXData(), s.getYData(), s.size());
+            dr.setLineColor(lc);
+            dr.line(s.stat.getMeanX(), s.stat.getMeanY(),
+                    s.stat.getMeanX() + lambda * u, s.stat.getMeanY() + lambda * v);
+        };
+        dr.setLayer("trail");
+        draw(trailColor, trailAxisColor);
+        dr.setLayer("particles");
+        dr.clearLayer("particles");
+        draw(pointColor, axisColor);
+        dr.publish();                           // 表示はメインスレッドの present() で行う
+    });
+
+    TimelineExecutor<RobotBatch> ex(dt);
+    // 統計は動作更新と同時に求められる．姿勢と一緒に描画スレッドへ渡す
+    ex.addStatisticsObserver([&](RobotBatch &r, const PoseStatistics &s, double t) {
+        pipe.submit(r, s, t);
+        dr.present();                           // 描き終えた途中経過があれば表示する
+    }, drawInterval);
+    // 統計の観測者は集合を変えられないので，数の決め直しは普通の観測者で行う（同じステップでは統計の後に呼ばれる）
+    if (adaptive) {
+        ex.addObserver([&](RobotBatch &, double) {
+            pf.resample();                      // 分布はそのままで数だけを変える
+        }, drawInterval);
     }
+    ex.run(rb, tl);
+    pipe.flush();
+    dr.present();                               // 最後の途中経過を表示する
 
     dr.imgWrite();                            // img をファイルに書き出す
-    cv::waitKey(0);
+    dr.waitKey(0);
 
     return 0;
 }
-
@@ -0,0 +1,70 @@
+#include <iostream>
+#include <vector>
+#include "CommandTimeline.h"
+#include "Drawer.h"
+#include "LinearizedPropagator.h"
+#include "RobotBatch.h"
+
+// 共分散行列の主軸を描く
+void drawAxis(Drawer &dr, const PoseStatistics &s)
+{
+    double u, v, lambda;
+    s.getPrincipalAxis(u, v, lambda);
+    dr.line(s.getMeanX(), s.getMeanY(), s.getMeanX() + lambda * u, s.getMeanY() + lambda * v);
+}
+
+int main(int argc, char* argv[])
+{
+    RobotBatch rb(1000);
+    LinearizedPropagator lin;
+    LinearizationCheck chk(rb, lin);
+    Drawer dr;
+
+    dr.setCsize(0.015);
+    dr.setImgWidth(20.0);
+    dr.setImgHight(10.0);
+    dr.setOriginXfromLeft(10.0);
+    dr.setOriginYfromBottom(1.0);
+    dr.text(-10, 9, "Monte Carlo (green) / linearized (red)");
+    dr.show();
+
+    // 経路（引数で経路ファイルを指定できる．例: ../route/route1.txt）
+    CommandTimeline tl;
+    if (argc > 1) {
+        if (!tl.load(argv[1])) return 1;
+    } else {
+        tl.add(1.0, 0.0, 6.0);                  // 経路1
+        tl.add(0.0, 0.1, M_PI/2.0/0.1);         // 経路2
+        tl.add(1.0, 0.0, 6.0);                  // 経路3
+        tl.add(0.0, 0.1, M_PI/2.0/0.1);         // 経路4
+        tl.add(1.0, 0.0, 13.0);                 // 経路5
+    }
+
+    double dt = 0.01;                           // 時間の刻み幅
+    double drawInterval = 2.0;                  // 画像に出力する間隔 [s]
+
+    dr.setPointColor(cv::Scalar(200, 0, 0));    // 点を描画するための色をセットする
+    dr.setLineWidth(2);
+
+    TimelineExecutor<LinearizationCheck> ex(dt);
+    // 描画と比較．統計はモンテカルロ側のもので，動作更新と同時に求められる
+    ex.addStatisticsObserver([&](LinearizationCheck &c, const PoseStatistics &s, double t) {
+        dr.drawPoints(c.getMonteCarlo());
+
+        PoseStatistics l;
+        c.getLinearized().getStatistics(l);
+        dr.setLineColor(cv::Scalar(0, 180, 0));
+        drawAxis(dr, s);
+        dr.setLineColor(cv::Scalar(0, 0, 180));
+        drawAxis(dr, l);
+
+        std::cerr << "t = " << t << "  KL(モンテカルロ || 線形化) = " << c.getDivergence() << "\n";
+        dr.show();
+    }, drawInterval);
+    ex.run(chk, tl);
+
+    dr.imgWrite();                            // img をファイルに書き出す
+    dr.waitKey(0);
+
+    return 0;
+}
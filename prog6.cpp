@@ -0,0 +1,89 @@
+/*
+ * 軌跡ログの再生
+ *
+ * prog2 が記録したログ（TrajectoryLog.h）を mmap で読み，シミュレーションをやり直さずに
+ * 途中経過の描画と統計を作り直す．
+ *   ./prog6 run.trj                 全フレーム
+ *   ./prog6 run.trj 10 20 2         10〜20 番目のフレームを2つおきに
+ */
+
+#include <cstdlib>
+#include <iostream>
+#include "CommandTimeline.h"
+#include "Drawer.h"
+#include "PoseStatistics.h"
+#include "RobotBatch.h"
+#include "TrajectoryLog.h"
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2) {
+        std::cerr << "使い方: " << argv[0] << " ログファイル [最初 [最後 [間隔]]]\n";
+        return 1;
+    }
+
+    TrajectoryLogReader log;
+    if (!log.open(argv[1])) return 1;
+
+    int first = (argc > 2) ? atoi(argv[2]) : 0;
+    int last = (argc > 3) ? atoi(argv[3]) : log.size() - 1;
+    int stride = (argc > 4) ? atoi(argv[4]) : 1;
+    if (first < 0) first = 0;
+    if (last > log.size() - 1) last = log.size() - 1;
+    if (stride < 1) stride = 1;
+
+    const MotionParam &p = log.getParam();
+    std::cerr << "フレーム数 " << log.size() << "，dt " << log.getDt() << "，種 " << log.getSeed() << "\n";
+    std::cerr << "a1〜a6 " << p.a1 << " " << p.a2 << " " << p.a3 << " "
+              << p.a4 << " " << p.a5 << " " << p.a6 << "\n";
+
+    Drawer dr;
+    dr.setCsize(0.015);
+    dr.setImgWidth(20.0);
+    dr.setImgHight(10.0);
+    dr.setOriginXfromLeft(10.0);
+    dr.setOriginYfromBottom(1.0);
+
+    // 目標経路（ログに記録した経路を誤差なしでたどる．1台だけなので一瞬で終わる）
+    dr.setLineWidth(2);
+    dr.setLineColor(cv::Scalar(0, 0, 180));
+    RobotBatch ideal(1);
+    MotionParam zero;
+    zero.a1 = zero.a2 = zero.a3 = zero.a4 = zero.a5 = zero.a6 = 0.0;
+    ideal.setParam(zero);
+    double px = 0.0, py = 0.0;
+    TimelineExecutor<RobotBatch> path(log.getDt());
+    path.addObserver([&](RobotBatch &r, double) {
+        dr.line(px, py, r.getX(0), r.getY(0));
+        px = r.getX(0);
+        py = r.getY(0);
+    }, 0.1);
+    path.run(ideal, log.getTimeline());
+
+    dr.setPointColor(cv::Scalar(200, 0, 0));
+    dr.setLineColor(cv::Scalar(0, 180, 0));
+
+    PoseStatistics stat;
+    for (int k = first; k <= last; k += stride) {
+        TrajectoryFrame f = log[k];
+
+        // 列を（double のログならコピーせずに）描画と統計に渡す
+        stat.clear();
+        f.scan([&](const double *x, const double *y, const double *th, int n) {
+            dr.drawPoints(x, y, n);
+            stat.add(x, y, th, n);
+        });
+
+        double u, v, lambda;
+        stat.getPrincipalAxis(u, v, lambda);
+        dr.line(stat.getMeanX(), stat.getMeanY(), stat.getMeanX() + lambda * u, stat.getMeanY() + lambda * v);
+        std::cout << f.getTime() << "\t" << f.size() << "\t"
+                  << stat.getMeanX() << "\t" << stat.getMeanY() << "\t" << stat.getMeanTh() << "\t"
+                  << stat.getCov(0, 0) << "\t" << stat.getCov(1, 1) << "\t" << stat.getCov(2, 2) << "\n";
+        dr.show();
+    }
+
+    dr.imgWrite();
+    dr.waitKey(0);
+    return 0;
+}
@@ -0,0 +1,143 @@
+/*
+ * 車輪のエンコーダのカウント列からロボット集合を動かす
+ *
+ * 1行に "時刻[s] ロボット番号 左のカウント 右のカウント" を書いたカウント列（WheelOdometry.h）を読み，
+ * 10ms ごとの速度指令にまとめてロボットごとの RobotBatch を進め，最後の姿勢の分布を描く．
+ *   ./prog7 ticks.txt [ロボット数 [1台あたりの粒子数]]      ファイルから
+ *   ./prog7 - 4 < ticks.txt                                  標準入力から
+ *   ./prog7 -g 4 [経路ファイル] > ticks.txt                  経路をたどる 1kHz のカウント列を作る
+ *   ./prog7 -g 4 | ./prog7 - 4                               作りながら読む
+ */
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <vector>
+#include "CommandTimeline.h"
+#include "Drawer.h"
+#include "RobotBatch.h"
+#include "ThreadPool.h"
+#include "WheelOdometry.h"
+
+// 経路を誤差なしでたどったときのカウント列を rate [Hz] で書き出す．k 番目のロボットは速さを 1/(1 + 0.2k) 倍にする
+void generate(const CommandTimeline &tl, const WheelGeometry &g, int numRobot, double rate)
+{
+    std::vector<double> dl(numRobot, 0.0), dr(numRobot, 0.0);
+    double dt = 1.0 / rate;
+    for (int k = 0; k < numRobot; k++) printf("%.6f %d 0 0\n", 0.0, k);
+    long i = 0;
+    for (const Command &c: tl) {
+        long n = (long)ceil(c.duration * rate - 1e-9);
+        for (long s = 0; s < n; s++) {
+            i++;
+            for (int k = 0; k < numRobot; k++) {
+                double f = 1.0 / (1.0 + 0.2 * k);
+                dl[k] += f * (c.v - 0.5 * g.tread * c.w) * dt;
+                dr[k] += f * (c.v + 0.5 * g.tread * c.w) * dt;
+                printf("%.6f %d %ld %ld\n", i * dt, k,
+                       (long)floor(dl[k] / g.meterPerTickL), (long)floor(dr[k] / g.meterPerTickR));
+            }
+        }
+    }
+}
+
+void usage(const char *prog)
+{
+    std::cerr << "使い方: " << prog << " カウント列 [ロボット数 [粒子数]]\n"
+              << "        " << prog << " -g ロボット数 [経路ファイル] > カウント列\n"
+              << "        （ロボット数・粒子数は 1 以上）\n";
+}
+
+// 1 以上の整数として読む
+bool parseCount(const char *s, int &n)
+{
+    char *end;
+    long v = strtol(s, &end, 10);
+    if (end == s || *end != '\0' || v < 1 || v > INT32_MAX) return false;
+    n = v;
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    WheelGeometry geom;                 // 半径 5cm，1024 カウント/回転，車輪の間隔 30cm
+    double step = 0.01;                 // 指令にまとめる時間 [s]
+
+    if (argc < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (strcmp(argv[1], "-g") == 0) {
+        int numRobot = 1;
+        if (argc > 2 && !parseCount(argv[2], numRobot)) {
+            usage(argv[0]);
+            return 1;
+        }
+        CommandTimeline tl;
+        if (argc > 3) {
+            if (!tl.load(argv[3])) return 1;
+        } else {
+            tl.add(1.0, 0.0, 6.0);
+            tl.add(0.0, 0.1, M_PI/2.0/0.1);
+            tl.add(1.0, 0.0, 6.0);
+            tl.add(0.0, 0.1, M_PI/2.0/0.1);
+            tl.add(1.0, 0.0, 13.0);
+        }
+        generate(tl, geom, numRobot, 1000.0);
+        return 0;
+    }
+
+    int numRobot = 1;
+    int numParticle = 1000;
+    if ((argc > 2 && !parseCount(argv[2], numRobot)) || (argc > 3 && !parseCount(argv[3], numParticle))) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    TickReader reader;
+    if (!reader.open(argv[1])) return 1;
+
+    // ロボットごとの粒子の集合．ロボットをスレッドに分けるので，集合は1スレッドで進める
+    std::vector<std::unique_ptr<RobotBatch> > robots;
+    OdometryIngest<RobotBatch> ingest(geom, step);
+    for (int k = 0; k < numRobot; k++) {
+        robots.emplace_back(new RobotBatch(numParticle));
+        robots.back()->seed(k + 1);
+        ingest.addRobot(*robots.back());
+    }
+    if (numRobot > 1) ingest.setThreadPool(std::make_shared<ThreadPool>());
+
+    auto t0 = std::chrono::steady_clock::now();
+    bool ok = ingest.run(reader);
+    double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    std::cerr << "カウント " << ingest.getNumTicks() << "，指令 " << ingest.getNumSteps()
+              << "（advance " << ingest.getNumAdvances() << " 回），" << sec << " [s]，"
+              << ingest.getNumTicks() / sec << " [カウント/s]\n";
+    if (ingest.getNumRejected() > 0 || ingest.getNumOutOfOrder() > 0) {
+        std::cerr << "捨てたカウント: 登録していないロボット " << ingest.getNumRejected()
+                  << "，時刻の逆行 " << ingest.getNumOutOfOrder() << "\n";
+    }
+
+    Drawer dr;
+    dr.setCsize(0.015);
+    dr.setImgWidth(20.0);
+    dr.setImgHight(10.0);
+    dr.setOriginXfromLeft(10.0);
+    dr.setOriginYfromBottom(1.0);
+    dr.includeImage(-10, 9, "../fig/logo.jpeg");
+    dr.text(-10, 7, "K.INOUE");
+    for (int k = 0; k < numRobot; k++) {
+        dr.setPointColor(cv::Scalar(200 - 150 * k / numRobot, 60, 60 + 150 * k / numRobot));
+        dr.drawPoints(*robots[k]);
+    }
+    dr.show();
+    dr.imgWrite();
+    dr.waitKey(0);
+    return ok ? 0 : 1;
+}